@@ -1,11 +1,17 @@
-from flask import Flask, send_file, render_template, make_response
+from flask import Flask, send_file, render_template, make_response, request, jsonify
 import datetime
 import StringIO
+import gzip
+import os
+import time
 import random
 from time import sleep
 from datetime import datetime
 import numpy as np
 from flask_table import Table, Col
+from thermshm import ThermShm
+import thermtsc
+from thermlog import load_log, segment_files
 
 from matplotlib.backends.backend_agg import FigureCanvasAgg as FigureCanvas
 from matplotlib.figure import Figure
@@ -13,12 +19,17 @@ from matplotlib.dates import DateFormatter
 
 app = Flask(__name__)
 
-temperature_file="/home/pi/development/therm/rpi/temperature.csv"
+# the log therm writes, THERM_LOG points elsewhere (a .csv or .tsc, segmented or not)
+temperature_file=os.environ.get("THERM_LOG", "/home/pi/development/therm/rpi/temperature.csv")
+
+def query_range():
+    return request.args.get('from', None, type=int), request.args.get('to', None, type=int)
 
 @app.route("/")
 def hello():
     current_time = str(datetime.now())
-    data = np.loadtxt(open("/home/pi/development/therm/rpi/temperature.csv", 'rb'), delimiter=",", dtype='S8,d8,f8', skiprows=1)
+    start, end = query_range()
+    data = load_log(temperature_file, start, end)
     class ItemTable(Table):
         column1 = Col("time")
         column2 = Col("elapsed")
@@ -37,14 +48,49 @@ def hello():
 
 @app.route("/download.csv")
 def download():
+    if temperature_file.endswith(".tsc"):
+        response = make_response(thermtsc.to_csv(temperature_file))
+        response.headers['Content-Type'] = 'text/csv'
+        return response
     return send_file(temperature_file)
 
+@app.route("/latest")
+def latest():
+    # straight from therm's shared memory (therm --shm), no log file parsing
+    try:
+        shm = ThermShm()
+    except (IOError, OSError):
+        return make_response("therm is not running with --shm\n", 503)
+    sample = shm.latest() if shm.running() else None
+    shm.close()
+    if sample is None:
+        return make_response("no sample yet\n", 503)
+    return jsonify(t=sample["t"], elapsed=sample["elapsed"], temps=sample["temps"])
+
+@app.route("/aggregate")
+def aggregate():
+    # count/min/max/mean/first/last per bucket seconds, from the block summaries
+    # therm keeps next to a .tsc log, so long ranges never load every row
+    start, end = query_range()
+    bucket = request.args.get('bucket', 3600, type=int)
+    board = request.args.get('board', 0, type=int)
+    if start is None:
+        start = 0
+    if end is None:
+        end = int(time.time())
+    if bucket <= 0 or board < 0:
+        return make_response("bucket must be positive and board at least 0\n", 400)
+    files = segment_files(temperature_file, start, end)
+    if not all(f.endswith(".tsc") for f in files):
+        return make_response("aggregates need a .tsc log (therm 1 file.tsc)\n", 501)
+    return jsonify(bucket=bucket, board=board, rows=thermtsc.aggregate(files, start, end, bucket, board))
+
 @app.route("/display")
 def display():
-    data = np.loadtxt(open("/home/pi/development/therm/rpi/temperature.csv", 'rb'), delimiter=",", dtype='S8,d8,f8', skiprows=1)
-    data = np.array(data.tolist())
-    x = data[:,1]
-    y = data[:,2]
+    start, end = query_range()
+    data = load_log(temperature_file, start, end)
+    x = data['f1']
+    y = data['f2']
     fig = Figure()
     ax = fig.add_subplot(111)
     ax.plot(x,y,"ko-")
@@ -0,0 +1,106 @@
+# Reader for the log therm writes, one file or segments listed in
+# <file>.manifest (--segment-size/--segment-time), .csv or .tsc. It needs no
+# Flask so it can be used and checked on its own; hello.py serves from it.
+#
+# The segment therm is writing is marked open in the manifest. therm rewrites
+# the manifest about once a second while the segment fills, so its rows and
+# times lag the file a little: an open segment is always read, whatever its
+# rows and first/last say.
+import gzip
+import io
+import os
+import numpy as np
+import thermtsc
+
+DTYPE = 'S8,f8,f8'
+
+
+# each manifest line is seq,file,first_unix,last_unix,first_elapsed,last_elapsed,rows,state
+def read_manifest(fname):
+    segments = []
+    try:
+        f = open(fname + ".manifest")
+    except IOError:
+        return None
+    for line in f:
+        if line.startswith("#"):
+            continue
+        fields = line.strip().split(",")
+        if len(fields) < 8:
+            continue
+        segments.append({"file": fields[1],
+                         "first": int(fields[2]), "last": int(fields[3]),
+                         "first_elapsed": int(fields[4]), "rows": int(fields[6]),
+                         "open": fields[7] == "open"})
+    f.close()
+    return segments
+
+
+def in_range(seg, start=None, end=None):
+    """whether a segment may hold rows between unix times start and end"""
+    if seg["open"]:
+        return True
+    if seg["rows"] == 0:
+        return False
+    return (start is None or seg["last"] >= start) and (end is None or seg["first"] <= end)
+
+
+def segment_files(fname, start=None, end=None):
+    """paths of the files that may hold rows between start and end"""
+    segments = read_manifest(fname)
+    if segments is None:
+        return [fname]
+    logdir = os.path.dirname(fname)
+    return [os.path.join(logdir, seg["file"]) for seg in segments if in_range(seg, start, end)]
+
+
+def open_segment(path):
+    # a segment may get compressed between reading the manifest and opening it
+    if not os.path.exists(path) and os.path.exists(path + ".gz"):
+        path = path + ".gz"
+    if path.endswith(".gz"):
+        return gzip.open(path, 'rb')
+    return open(path, 'rb')
+
+
+def load_csv(f, dtype=DTYPE):
+    text = f.read()
+    f.close()
+    # the writer flushes whole rows, a file just started may not even have its header
+    if text.count(b"\n") < 2:
+        return np.zeros(0, dtype=dtype)
+    return np.loadtxt(io.BytesIO(text), delimiter=",", dtype=dtype, skiprows=1, usecols=(0, 1, 2), ndmin=1)
+
+
+def load_log(fname, start=None, end=None, dtype=DTYPE):
+    """rows of the log between unix times start and end, only opening the segments that overlap"""
+    segments = read_manifest(fname)
+    if segments is None and fname.endswith(".tsc"):
+        return thermtsc.load_log(fname, start, end, dtype)
+    if segments is None:
+        return load_csv(open(fname, 'rb'), dtype)
+    logdir = os.path.dirname(fname)
+    parts = []
+    for seg in segments:
+        if not in_range(seg, start, end):
+            continue
+        if seg["file"].endswith(".tsc"):
+            # compressed segments carry real timestamps, thermtsc does the range filtering
+            parts.append(thermtsc.load_log(os.path.join(logdir, seg["file"]), start, end, dtype))
+            continue
+        data = load_csv(open_segment(os.path.join(logdir, seg["file"])), dtype)
+        # an open segment the manifest has no rows for yet has nothing to map
+        # elapsed seconds from, it is at most a second old so all of it is kept
+        if (start is not None or end is not None) and seg["rows"]:
+            # elapsed seconds map to unix time relative to the segment's first row
+            t = seg["first"] + (data['f1'] - seg["first_elapsed"])
+            keep = np.ones(len(data), dtype=bool)
+            if start is not None:
+                keep &= t >= start
+            if end is not None:
+                keep &= t <= end
+            data = data[keep]
+        parts.append(data)
+    if len(parts) == 0:
+        return np.zeros(0, dtype=dtype)
+    return np.concatenate(parts)
@@ -0,0 +1,72 @@
+# Reader for the shared memory published by 'therm --shm', see rpi/therm_shm.h
+# for the layout. The segment is mapped once and every read is a copy out of
+# memory, so the web pages can ask for the latest temperature as often as they
+# like without touching the logger or the log files.
+import mmap
+import os
+import struct
+
+SHM_DIR = "/dev/shm"
+MAGIC = 0x4d524854
+VERSION = 1
+
+HEADER = struct.Struct("<IIIIIIQ")   # magic,version,ring_size,slot_size,pid,pad,head
+SLOT = struct.Struct("<IIQqii8i")    # seq,pad,index,t,elapsed,nboards,temp10[8]
+LATEST_OFFSET = 32
+RING_OFFSET = 96
+HEAD_OFFSET = 24
+
+
+class ThermShm(object):
+    def __init__(self, name="/therm"):
+        f = open(os.path.join(SHM_DIR, name.lstrip("/")), "rb")
+        try:
+            self.m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        finally:
+            f.close()
+        magic, version, self.ring_size, slot_size, pid, pad, head = HEADER.unpack_from(self.m, 0)
+        if magic != MAGIC or version != VERSION or slot_size != SLOT.size:
+            self.m.close()
+            raise IOError("%s is not a therm shared memory segment" % name)
+
+    def close(self):
+        self.m.close()
+
+    def running(self):
+        return HEADER.unpack_from(self.m, 0)[4] != 0
+
+    # seqlock read, retry while the logger is writing the slot
+    def _slot(self, offset):
+        while True:
+            s1 = struct.unpack_from("<I", self.m, offset)[0]
+            if s1 & 1:
+                continue
+            fields = SLOT.unpack_from(self.m, offset)
+            if fields[0] == s1 and struct.unpack_from("<I", self.m, offset)[0] == s1:
+                break
+        nboards = fields[5]
+        return {"index": fields[2], "t": fields[3], "elapsed": fields[4],
+                "temps": [v / 10.0 for v in fields[6:6 + nboards]]}
+
+    # latest sample (updated every tick), None before the first one
+    def latest(self):
+        s = self._slot(LATEST_OFFSET)
+        if s["t"] == 0:
+            return None
+        return s
+
+    # up to n of the most recent logged rows, oldest first
+    def recent(self, n):
+        head = struct.unpack_from("<Q", self.m, HEAD_OFFSET)[0]
+        n = min(n, self.ring_size)
+        rows = []
+        for i in range(max(head - n, 0), head):
+            s = self._slot(RING_OFFSET + (i % self.ring_size) * SLOT.size)
+            if s["index"] == i:   # skip slots overwritten while reading
+                rows.append(s)
+        return rows
+
+
+if __name__ == "__main__":
+    shm = ThermShm()
+    print(shm.latest())
@@ -0,0 +1,313 @@
+# Reader for the compressed .tsc logs therm writes when its log file name ends
+# in .tsc, see rpi/therm_tsc.h for the layout. Block headers carry each block's
+# time range, so a range query only decodes the blocks it needs, and the
+# varints of all those blocks are decoded together with numpy instead of one
+# value at a time in Python.
+#
+# aggregate() answers count/min/max/mean/first/last per time bucket from the
+# per block summaries in <file>.idx, decoding only the blocks that straddle a
+# bucket or the ends of the range, so months of 1 Hz rows cost a read of a few
+# hundred kilobytes of index instead of a full decode.
+#
+# python thermtsc.py bench <dir>   times the Flask side reads of the files
+#                                  'therm bench-codec <dir>' leaves behind
+import calendar
+import struct
+import sys
+import time
+import numpy as np
+
+MAGIC = 0x42435354
+VERSION = 1
+HEADER = struct.Struct("<IHBBIiqq")   # magic,rows,cols,version,size,first_elapsed,first_t,last_t
+INDEX_MAGIC = 0x49435354
+INDEX_VERSION = 1
+INDEX_HEADER = struct.Struct("<IIII")  # magic,version,cols,record bytes
+
+
+def blocks(data, start=None, end=None):
+    """(offset, rows, cols, size, first_elapsed, first_t) of the blocks that overlap start..end"""
+    out = []
+    pos = 0
+    while pos + HEADER.size <= len(data):
+        magic, rows, cols, version, size, first_elapsed, first_t, last_t = HEADER.unpack_from(data, pos)
+        total = HEADER.size + 4 * cols + size
+        if magic != MAGIC or version != VERSION or pos + total > len(data):
+            break   # corrupt, or the last block of a file being written
+        if (start is None or last_t >= start) and (end is None or first_t <= end):
+            out.append((pos, rows, cols, size, first_elapsed, first_t))
+        pos += total
+    return out
+
+
+def _unzigzag_varints(buf):
+    """every zigzag varint in a uint8 array"""
+    ends = np.flatnonzero(buf < 0x80)
+    if len(ends) == len(buf):
+        v = buf.astype(np.int64)   # the usual case, every value fits in a byte
+    else:
+        starts = np.concatenate(([0], ends[:-1] + 1))
+        grp = np.repeat(np.arange(len(ends)), ends - starts + 1)
+        shift = np.arange(len(buf)) - starts[grp]
+        v = np.bincount(grp, weights=(buf & 0x7f) * (2.0 ** (7 * shift)), minlength=len(ends)).astype(np.int64)
+    return (v >> 1) ^ -(v & 1)
+
+
+def _segmented_cumsum(x, rowstart, n):
+    c = np.cumsum(x)
+    return c - np.repeat(c[rowstart] - x[rowstart], n)
+
+
+def _decode(data, bl):
+    """unix times, elapsed, temperatures in tenths and rows per block of the blocks bl found in data"""
+    raw = np.frombuffer(data, dtype=np.uint8)
+    ncols = bl[0][2]
+    n = np.array([b[1] for b in bl], dtype=np.int64)
+    firsts = np.array([struct.unpack_from("<%di" % ncols, data, b[0] + HEADER.size) for b in bl], dtype=np.int64)
+    payload_at = [b[0] + HEADER.size + 4 * ncols for b in bl]
+    v = _unzigzag_varints(np.concatenate([raw[p:p + b[3]] for p, b in zip(payload_at, bl)]))
+
+    # the varints of block i start at voff[i], stream s at voff[i] + s*(n[i]-1),
+    # row r >= 1 of a block is entry r-1 of each stream, row 0 comes from the header
+    voff = np.concatenate(([0], np.cumsum((ncols + 2) * (n - 1))[:-1]))
+    rowstart = np.concatenate(([0], np.cumsum(n)[:-1]))
+    blk = np.repeat(np.arange(len(bl)), n)
+    pos = np.arange(n.sum()) - rowstart[blk]
+    later = pos > 0
+
+    def stream(s):
+        x = np.zeros(len(pos), dtype=np.int64)
+        x[later] = v[(voff[blk] + s * (n[blk] - 1) + pos - 1)[later]]
+        return x
+
+    first_t = np.array([b[5] for b in bl], dtype=np.int64)
+    first_e = np.array([b[4] for b in bl], dtype=np.int64)
+    t = first_t[blk] + _segmented_cumsum(_segmented_cumsum(stream(0), rowstart, n), rowstart, n)
+    el = first_e[blk] + _segmented_cumsum(_segmented_cumsum(stream(1), rowstart, n), rowstart, n)
+    temps = np.empty((len(t), ncols), dtype=np.int64)
+    for c in range(ncols):
+        temps[:, c] = firsts[blk, c] + _segmented_cumsum(stream(2 + c), rowstart, n)
+    return t, el, temps, n
+
+
+def load(path, start=None, end=None):
+    """unix times, elapsed seconds and temperatures (rows x boards, in degrees) between start and end"""
+    f = open(path, "rb")
+    data = f.read()
+    f.close()
+    bl = blocks(data, start, end)
+    if len(bl) == 0:
+        return np.zeros(0, np.int64), np.zeros(0, np.int64), np.zeros((0, 1))
+    bl = [b for b in bl if b[2] == bl[0][2]]
+    t, el, temps, n = _decode(data, bl)
+    temps = temps / 10.0
+    keep = np.ones(len(t), dtype=bool)
+    if start is not None:
+        keep &= t >= start
+    if end is not None:
+        keep &= t <= end
+    return t[keep], el[keep], temps[keep]
+
+
+def _index_dtype(cols):
+    col = np.dtype([("min", "<i4"), ("max", "<i4"), ("first", "<i4"), ("last", "<i4"), ("sum", "<i8")])
+    return np.dtype([("offset", "<i8"), ("first_t", "<i8"), ("last_t", "<i8"), ("rows", "<u4"), ("pad", "<u4"),
+                     ("col", col, (cols,))])
+
+
+def _summarize(data, bl, base):
+    """index records for blocks bl of data (found at file offset base), for blocks the index lacks"""
+    t, el, temps, n = _decode(data, bl)
+    rowstart = np.concatenate(([0], np.cumsum(n)[:-1]))
+    s = np.zeros(len(bl), dtype=_index_dtype(bl[0][2]))
+    s["offset"] = [base + b[0] for b in bl]
+    s["first_t"] = t[rowstart]
+    s["last_t"] = t[rowstart + n - 1]
+    s["rows"] = n
+    s["col"]["min"] = np.minimum.reduceat(temps, rowstart)
+    s["col"]["max"] = np.maximum.reduceat(temps, rowstart)
+    s["col"]["first"] = temps[rowstart]
+    s["col"]["last"] = temps[rowstart + n - 1]
+    s["col"]["sum"] = np.add.reduceat(temps, rowstart)
+    return s
+
+
+def summaries(path):
+    """one index record per block of a .tsc file, from <path>.idx where therm wrote it
+    and by decoding whatever blocks it does not cover (a missing index, or a log still
+    being written or cut short by a crash)"""
+    f = open(path, "rb")
+    f.seek(0, 2)
+    size = f.tell()
+    recs = None
+    try:
+        idx = open(path + ".idx", "rb")
+        hdr = idx.read(INDEX_HEADER.size)
+        if len(hdr) == INDEX_HEADER.size:
+            magic, version, cols, recsize = INDEX_HEADER.unpack(hdr)
+            dt = _index_dtype(cols)
+            if magic == INDEX_MAGIC and version == INDEX_VERSION and recsize == dt.itemsize:
+                buf = idx.read()
+                recs = np.frombuffer(buf[:len(buf) // dt.itemsize * dt.itemsize], dtype=dt)
+        idx.close()
+    except IOError:
+        pass
+    pos = 0
+    if recs is not None and len(recs):
+        # drop entries written ahead of blocks that never made it to the file
+        recs = recs[recs["offset"] < size]
+        while len(recs):
+            f.seek(int(recs["offset"][-1]))
+            h = f.read(HEADER.size)
+            if len(h) == HEADER.size:
+                magic, rows, cols, version, bsize = HEADER.unpack(h)[:5]
+                pos = int(recs["offset"][-1]) + HEADER.size + 4 * cols + bsize
+                if magic == MAGIC and pos <= size:
+                    break
+            recs = recs[:-1]
+            pos = 0
+    f.seek(pos)
+    tail = f.read()
+    f.close()
+    bl = blocks(tail)
+    if recs is not None and len(recs):
+        bl = [b for b in bl if b[2] == recs.dtype["col"].shape[0]]
+    elif len(bl):
+        bl = [b for b in bl if b[2] == bl[0][2]]
+    if len(bl):
+        more = _summarize(tail, bl, pos)
+        recs = more if recs is None or len(recs) == 0 else np.concatenate((recs, more))
+    return recs
+
+
+def utc_offset(t):
+    """seconds local time is ahead of UTC at unix time t"""
+    return calendar.timegm(time.localtime(t)) - int(t)
+
+
+def _parts(path, start, end, bucket, col, off):
+    """(bucket, count, min, max, sum, first, last, first_t, last_t) pieces of one file"""
+    s = summaries(path)
+    if s is None or len(s) == 0 or col >= s.dtype["col"].shape[0]:
+        return None
+    s = s[(s["last_t"] >= start) & (s["first_t"] <= end)]
+    b0 = (s["first_t"] + off) // bucket
+    whole = (s["first_t"] >= start) & (s["last_t"] <= end) & ((s["last_t"] + off) // bucket == b0)
+    c = s["col"][:, col]
+    parts = [(b0[whole], s["rows"][whole].astype(np.int64), c["min"][whole], c["max"][whole], c["sum"][whole],
+              c["first"][whole], c["last"][whole], s["first_t"][whole], s["last_t"][whole])]
+
+    # blocks across a bucket boundary or an end of the range are decoded row by row
+    edge = s["offset"][~whole]
+    if len(edge):
+        f = open(path, "rb")
+        data = []
+        bl = []
+        for offset in edge:
+            f.seek(int(offset))
+            h = f.read(HEADER.size)
+            magic, rows, cols, version, size, first_elapsed, first_t, last_t = HEADER.unpack(h)
+            pos = sum(len(d) for d in data)
+            data.append(h + f.read(4 * cols + size))
+            bl.append((pos, rows, cols, size, first_elapsed, first_t))
+        f.close()
+        t, el, temps, n = _decode(b"".join(data), bl)
+        keep = (t >= start) & (t <= end)
+        t = t[keep]
+        v = temps[keep, col]
+        parts.append(((t + off) // bucket, np.ones(len(t), dtype=np.int64), v, v, v, v, v, t, t))
+    return parts
+
+
+def aggregate(paths, start, end, bucket, col=0):
+    """count, min, max, mean, first and last of board col per bucket seconds between unix
+    times start and end, over one or more .tsc files in time order. Buckets line up with
+    local time (daily buckets start at midnight), using the UTC offset at end."""
+    off = utc_offset(end) if bucket >= 3600 else 0
+    parts = []
+    for path in paths:
+        p = _parts(path, start, end, bucket, col, off)
+        if p:
+            parts.extend(p)
+    if len(parts) == 0:
+        return []
+    b, cnt, mn, mx, sm, first, last, first_t, last_t = [np.concatenate([p[i] for p in parts]) for i in range(9)]
+    if len(b) == 0:
+        return []
+    order = np.lexsort((first_t, b))
+    b, cnt, mn, mx, sm, first, last = b[order], cnt[order], mn[order], mx[order], sm[order], first[order], last[order]
+    at = np.flatnonzero(np.concatenate(([True], b[1:] != b[:-1])))
+    lastat = np.concatenate((at[1:], [len(b)])) - 1
+    count = np.add.reduceat(cnt, at)
+    total = np.add.reduceat(sm, at)
+    low = np.minimum.reduceat(mn, at)
+    high = np.maximum.reduceat(mx, at)
+    # pieces never overlap in time, so sorted by first time the group's first
+    # piece holds its first reading and its last piece the last one
+    cols = zip((b[at] * bucket - off).tolist(), count.tolist(), (low / 10.0).tolist(), (high / 10.0).tolist(),
+               (total / 10.0 / count).tolist(), (first[at] / 10.0).tolist(), (last[lastat] / 10.0).tolist())
+    return [dict(zip(("t", "count", "min", "max", "mean", "first", "last"), row)) for row in cols]
+
+
+def hhmmss(t):
+    """local HH:MM:SS of unix times, as an S8 array"""
+    t = np.asarray(t, dtype=np.int64)
+    # UTC offset once per hour covered, so a DST change lands on the right row
+    hours = np.unique(t // 3600)
+    offs = np.array([calendar.timegm(time.localtime(h * 3600)) - h * 3600 for h in hours], dtype=np.int64)
+    sod = (t + offs[np.searchsorted(hours, t // 3600)]) % 86400
+    c = np.empty((len(t), 8), dtype=np.uint8)
+    c[:, 2] = c[:, 5] = ord(":")
+    for col, v in ((0, sod // 3600), (3, sod // 60 % 60), (6, sod % 60)):
+        c[:, col] = 48 + v // 10
+        c[:, col + 1] = 48 + v % 10
+    return c.view("S8").ravel()
+
+
+def load_log(path, start=None, end=None, dtype="S8,f8,f8"):
+    """rows as the CSV reader in hello.py returns them: time string, elapsed, first board's temperature"""
+    t, el, temps = load(path, start, end)
+    data = np.zeros(len(t), dtype=dtype)
+    data["f0"] = hhmmss(t)
+    data["f1"] = el
+    data["f2"] = temps[:, 0] if temps.shape[1] else 0
+    return data
+
+
+def to_csv(path):
+    """the log as the CSV therm would have written"""
+    t, el, temps = load(path)
+    lines = ["Time HH:MM:SS,Elapsed Sec,Temp C" + "".join(",Temp C %d" % c for c in range(1, temps.shape[1]))]
+    for hms, e, row in zip(hhmmss(t), el, temps):
+        lines.append("%s,%d,%s" % (hms.decode("ascii"), e, ",".join("%.1f" % x for x in row)))
+    return "\n".join(lines) + "\n"
+
+
+def bench(d):
+    import gzip
+    dtype = "S8,f8,f8"
+    runs = (("csv np.loadtxt", lambda: np.loadtxt(open(d + "/bench.csv", "rb"), delimiter=",", dtype=dtype, skiprows=1, usecols=(0, 1, 2), ndmin=1)),
+            ("csv.gz np.loadtxt", lambda: np.loadtxt(gzip.open(d + "/bench.csv.gz", "rb"), delimiter=",", dtype=dtype, skiprows=1, usecols=(0, 1, 2), ndmin=1)),
+            ("tsc load", lambda: load(d + "/bench.tsc")[0]),
+            ("tsc load_log", lambda: load_log(d + "/bench.tsc", dtype=dtype)),
+            ("tsc last hour", lambda: load(d + "/bench.tsc", *last_hour)[0]),
+            ("tsc hourly aggregate", lambda: sum(r["count"] for r in aggregate([d + "/bench.tsc"], t[0], t[-1], 3600))),
+            ("tsc daily aggregate", lambda: sum(r["count"] for r in aggregate([d + "/bench.tsc"], t[0], t[-1], 86400))))
+    t = load(d + "/bench.tsc")[0]
+    last_hour = (t[-1] - 3600, t[-1])
+    print("%-20s %10s %14s" % ("read", "rows", "rows/s"))
+    for name, fn in runs:
+        t0 = time.time()
+        rows = fn()
+        rows = rows if isinstance(rows, int) else len(rows)   # aggregates return the rows they cover
+        secs = time.time() - t0
+        print("%-20s %10d %14.0f" % (name, rows, rows / secs))
+
+
+if __name__ == "__main__":
+    if len(sys.argv) == 3 and sys.argv[1] == "bench":
+        bench(sys.argv[2])
+    else:
+        t, el, temps = load(sys.argv[1])
+        for row in zip(hhmmss(t), el, temps):
+            print(row)
@@ -4,6 +4,8 @@ var app = require('http').createServer(handler)
   , io = require('socket.io').listen(app)
   , fs = require('fs');
 var path = require('path');
+var net = require('net');
+var ThermShm = require('./thermshm');
 
 app.listen(8081);
 
@@ -13,13 +15,84 @@ var prog;
 var prog2;
 var runscope=0;
 
-var progpath='/home/pi/development/therm/';
+// where therm and the page files live, extra therm options and how to run it
+// as root, so the page also works against simulated or replayed boards, e.g.
+// THERM_HOME=~/therm/rpi THERM_OPTS='--board=sim,replay=raw.csv' THERM_SUDO= node index.js
+var progpath=path.join(process.env.THERM_HOME || '/home/pi/development/therm', '/');
+var thermopts=(process.env.THERM_OPTS || '').split(' ').filter(function(s) { return s.length>0; });
+var sudo=process.env.THERM_SUDO===undefined ? 'sudo' : process.env.THERM_SUDO;
 var values = "abc";
 var rfile = progpath;
-var child2=require('child_process').exec;
-var cprog2;
+var ctlpath=process.env.THERM_CONTROL || '/var/run/therm.sock'; // therm --control
 var oldinfo1='1';
 var oldinfo2='2';
+var shm=null;
+
+// log names from the browser must be plain names in progpath, nothing that
+// climbs out of it or means something to the shell
+function log_name_ok(name)
+{
+	return typeof name=='string' && /^[A-Za-z0-9_][A-Za-z0-9_.-]*$/.test(name);
+}
+
+function pad2(v)
+{
+	return (v<10 ? '0' : '')+v;
+}
+
+// latest sample from a logger running with --shm, in the same format
+// as 'therm withtime', or null if there is none or it is stale
+function shm_gettemp()
+{
+	var v, d;
+	try
+	{
+		if (shm==null)
+			shm=new ThermShm();
+		if (!shm.running())
+			throw new Error('logger stopped');
+		v=shm.latest();
+	}
+	catch (e)
+	{
+		if (shm!=null)
+			shm.close();
+		shm=null;
+		return null;
+	}
+	if (v==null || Date.now()/1000-v.t>5)
+		return null;
+	d=new Date(v.t*1000);
+	return pad2(d.getHours())+':'+pad2(d.getMinutes())+':'+pad2(d.getSeconds())+
+		v.temps.map(function(t) { return ' '+t.toFixed(1); }).join('')+'\n';
+}
+
+// send one command to the logger's control socket, cb(err, reply)
+// err is set when no logger is running
+function therm_control(cmd, cb)
+{
+	var reply='';
+	var done=false;
+	var sock=net.connect(ctlpath);
+	function finish(err)
+	{
+		if (done)
+			return;
+		done=true;
+		sock.destroy();
+		cb(err, reply.trim());
+	}
+	sock.setTimeout(8000, function() { finish(new Error('timeout')); }); // start/stop wait for a tick
+	sock.on('connect', function() { sock.end(cmd+'\n'); });
+	sock.on('data', function(data)
+	{
+		reply+=data.toString();
+		if (reply.indexOf('\n')>=0)
+			finish(null);
+	});
+	sock.on('error', function(err) { finish(err); });
+	sock.on('end', function() { finish(reply.length ? null : new Error('no reply')); });
+}
 
 // HTML handler
 function handler (req, res)
@@ -112,14 +185,34 @@ io.sockets.on('connection', function (socket)
 			}
 		}
 
-		if (isgettemp)
+		if (isgettemp && (values=shm_gettemp())!=null)
+		{
+			socket.emit('results', values);
+		}
+		else if (isgettemp)
 		{
-			prog=child.exec('sudo '+progpath+'therm withtime', function (error, data, stderr) {
-	  		values=data.toString();
-	  		//console.log('retrieve complete, length is '+values.length);
-	  		socket.emit('results', values);
+			// a running logger has the reading already, and owns the SPI bus
+			therm_control('latest', function(err, reply) {
+				if (!err && reply.indexOf('error')!=0)
+				{
+					socket.emit('results', reply+'\n');
+					return;
+				}
+				prog=child.exec((sudo ? sudo+' ' : '')+[progpath+'therm'].concat(thermopts).join(' ')+' withtime', function (error, data, stderr) {
+					values=data.toString();
+					//console.log('retrieve complete, length is '+values.length);
+					socket.emit('results', values);
+				});
 			});
 		}
+		if ((isreadfile || islogstart) && !log_name_ok(temp[1]))
+		{
+			if (isreadfile)
+				socket.emit('lastline', 'error,0,error');
+			else
+				socket.emit('stateresult', 'idle');
+			isreadfile=islogstart=0;
+		}
 		if (isreadfile)
 		{
 			prog=child.exec('tail -n 1 '+progpath+temp[1], function (error, data, stderr) {
@@ -149,37 +242,32 @@ io.sockets.on('connection', function (socket)
 		}
 		if (islogstart)
 		{
-			cprog2=child2('sudo '+progpath+'therm 1 '+temp[1]+' msg "Logging..." &');
-			//cprog2.stdout.on('data', function(data) {
-			//});
-			//cprog2.stderr.on('data', function(data) {
-			//});
-			//cprog2.on('close', function(code) {
-			//});
-			
+			therm_control('start '+temp[1]+' 1', function(err, reply) {
+				if (!err)
+				{
+					console.log('logstart: '+reply);
+					return;
+				}
+				// no logger yet, start one that stays up (idle) after logstop
+				var args=[progpath+'therm'].concat(thermopts, ['--control='+ctlpath, '--log-dir='+progpath, '--shm',
+					'1', progpath+temp[1], 'msg', 'Logging...']);
+				var logger=sudo ? child.spawn(sudo, args, {detached: true, stdio: 'ignore'})
+					: child.spawn(args[0], args.slice(1), {detached: true, stdio: 'ignore'});
+				logger.unref();
+			});
 		}
 		if (islogstop)
 		{
-			// not implemented yet
+			// the log is flushed and synced before the reply comes back
+			therm_control('stop', function(err, reply) {
+				socket.emit('stateresult', 'idle');
+			});
 		}
 		
 		if (ischeckstate)
 		{
-			var state_is_logging=0;
-			prog=child.exec('ps -ef | grep therm', function (error, data, stderr) {
-				var lines = data.toString().split('\n');
-				lines.forEach(function(line) {
-					if (line.indexOf(progpath+'therm')>0)
-					{
-						if (line.indexOf('msg')>0)
-						{
-							// ok, confident it is logging
-							state_is_logging=1;
-						}
-					}
-							
-				});
-				if (state_is_logging==1)
+			therm_control('status', function(err, reply) {
+				if (!err && reply.indexOf('logging')==0)
 				{
 					socket.emit('stateresult', 'logging');
 				}
@@ -187,8 +275,6 @@ io.sockets.on('connection', function (socket)
 				{
 					socket.emit('stateresult', 'idle');
 				}
-	  		//values=data.toString();
-	  		//socket.emit('results', values);
 			});
 		}
 		
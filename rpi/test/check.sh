@@ -0,0 +1,42 @@
+#!/bin/sh
+# Builds therm and runs the checks in this directory, all on simulated boards
+# so no hardware (or sudo) is needed:
+#   test_*.py   run with THERM pointing at the build, in a scratch directory
+#   test_*.c    built against the headers in rpi/ and run
+# Usage: test/check.sh [test name...], from rpi/ or anywhere else.
+# Exit status is the number of failed checks.
+
+cd "$(dirname "$0")/.." || exit 1
+RPI=$(pwd)
+WORK=$(mktemp -d /tmp/therm-check.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+
+CFLAGS=${CFLAGS:--O2 -Wall}
+SRCS="therm.c therm_http.c therm_trig.c therm_ctl.c therm_bench.c"
+if ! gcc $CFLAGS -o "$WORK/therm" $SRCS -lpthread -lm -lrt 2>"$WORK/build.log"; then
+	echo "FAIL build"
+	cat "$WORK/build.log"
+	exit 1
+fi
+export THERM="$WORK/therm"
+export PYTHONPATH="$RPI/test:$RPI/../flask"
+export PYTHONDONTWRITEBYTECODE=1
+
+failed=0
+for t in ${*:-$(cd test && ls test_*.py test_*.c 2>/dev/null)}; do
+	dir="$WORK/${t%.*}"
+	mkdir -p "$dir"
+	case "$t" in
+	*.py) (cd "$dir" && python3 "$RPI/test/$t") >"$dir.log" 2>&1 ;;
+	*.c) gcc $CFLAGS -I"$RPI" -o "$dir/run" "test/$t" -lpthread -lm -lrt >"$dir.log" 2>&1 \
+		&& (cd "$dir" && ./run) >>"$dir.log" 2>&1 ;;
+	esac
+	if [ $? -eq 0 ]; then
+		echo "ok   $t"
+	else
+		echo "FAIL $t"
+		sed 's/^/     /' "$dir.log"
+		failed=$((failed+1))
+	fi
+done
+exit $failed
@@ -0,0 +1,42 @@
+# per-bus workers: boards on three simulated SPI buses, every row must carry one
+# reading per board, and every bus must have sampled the same ticks
+from thermtest import *
+
+boards = ["sim:0.0", "sim:1.0", "sim:1.1", "sim:2.0"]
+args = ["--board=%s,record=raw%d.csv" % (b, i) for i, b in enumerate(boards)]
+
+# flat out on the virtual clock, then a few ticks in real time
+for speed, ticks in ((["--speed=0"], 30), ([], 3)):
+    status, out = therm(*(args + speed + ["--duration=%d" % ticks, "1", "log.csv"]))
+    check(status == 0, "therm exited with %d: %s" % (status, out))
+
+    header, rows = read_csv("log.csv")
+    check(len(header) == 2 + len(boards), "header %s" % header)
+    check(len(rows) == ticks, "%d rows, expected %d" % (len(rows), ticks))
+    for n, r in enumerate(rows):
+        check(len(r) == 2 + len(boards), "row %d has %d fields: %s" % (n, len(r), r))
+        check(all(v != "" for v in r[2:]), "row %d has an empty reading: %s" % (n, r))
+        check(int(r[1]) == n, "row %d elapsed is %s" % (n, r[1]))
+        check((hms(r[0]) - hms(rows[0][0])) % 86400 == n, "row %d time %s after %s" % (n, r[0], rows[0][0]))
+
+    # stdout carries the same rows, space separated
+    printed = [l.split() for l in out.splitlines() if l[:1].isdigit()]
+    check(printed == rows, "stdout differs from the log")
+
+    # record= keeps every code with its time: each bus must have read the same
+    # number of internal sensor and thermocouple codes in every second
+    per_board = []
+    for i in range(len(boards)):
+        counts = {}
+        with open("raw%d.csv" % i) as f:
+            for line in f:
+                if line.startswith("#"):
+                    continue
+                ns, kind, code = line.strip().split(",")
+                key = (int(ns) // 1000000000, kind)
+                counts[key] = counts.get(key, 0) + 1
+        per_board.append(counts)
+    for i in range(1, len(boards)):
+        check(per_board[i] == per_board[0], "board %s sampled other ticks than %s" % (boards[i], boards[0]))
+    seconds = sorted(set(s for s, k in per_board[0] if k == "T"))
+    check(len(seconds) == ticks, "%d ticks recorded, expected %d" % (len(seconds), ticks))
@@ -0,0 +1,83 @@
+# control socket: several clients at once, a stalled one holds up nobody,
+# one start or stop at a time, and a client's lines are answered in order
+import os
+import socket
+import time
+from thermtest import *
+
+path = os.path.abspath("ctl.sock")
+
+
+def connect():
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.settimeout(10)
+    s.connect(path)
+    return s
+
+
+def lines(s, n):
+    data = b""
+    while data.count(b"\n") < n:
+        chunk = s.recv(4096)
+        if not chunk:
+            break
+        data += chunk
+    return data.decode().splitlines()
+
+
+p = start("--board=sim:0.0", "--control=" + path, "--log-dir=" + os.getcwd(), "1", "first.csv")
+try:
+    for i in range(50):
+        if os.path.exists(path):
+            break
+        time.sleep(0.1)
+
+    # a client that connects and sends half a line must not block the others
+    stalled = connect()
+    stalled.sendall(b"sta")
+    s = connect()
+    t0 = time.time()
+    s.sendall(b"status\n")
+    check(lines(s, 1)[0].startswith("logging first.csv period 1 rows ") and time.time() - t0 < 1, "status behind a stalled client")
+
+    # a start waits for the next tick, a stop from someone else meanwhile is busy
+    a = connect()
+    b = connect()
+    a.sendall(b"start a.csv\n")
+    time.sleep(0.05)
+    b.sendall(b"stop\n")
+    check(lines(b, 1) == ["error busy"], "second request not busy")
+    check(lines(a, 1) == ["ok logging a.csv"], "start not answered")
+    b.sendall(b"status\n")
+    check(lines(b, 1)[0].startswith("logging %s/a.csv period 1" % os.getcwd()), "status after start")
+
+    # pipelined lines are answered in order, after the start they follow
+    a.sendall(b"start b.csv 2\nfile\nstatus\n")
+    got = lines(a, 3)
+    check(got[0] == "ok logging b.csv" and got[1] == os.getcwd() + "/b.csv" and " period 2 " in got[2], "pipelined %s" % got)
+
+    # a last command without a newline, the client closing its side
+    c = connect()
+    c.sendall(b"stop")
+    c.shutdown(socket.SHUT_WR)
+    check(lines(c, 1) == ["ok idle"], "half closed stop")
+    check(c.recv(10) == b"", "connection left open")
+
+    # at most CTL_MAX_CLIENTS at once
+    more = [connect() for i in range(13)]   # with stalled, s, a and b that is 17
+    check(lines(more[-1], 1) == ["error too many clients"], "17th client served")
+    for m in more[:-1]:
+        m.sendall(b"status\n")
+        check(lines(m, 1)[0].startswith("idle"), "client %d" % more.index(m))
+    stalled.sendall(b"tus\n")
+    check(lines(stalled, 1)[0].startswith("idle"), "stalled client finishing its line")
+    s.sendall(b"quit\n")
+    check(lines(s, 1) == ["ok"], "quit")
+    out = p.communicate(timeout=20)[0]
+    status = p.returncode
+finally:
+    if p.poll() is None:
+        status, out = stop(p)
+check(status == 0, "therm exited with %d: %s" % (status, out))
+check(not os.path.exists(path), "socket left behind")
+check(os.path.exists("a.csv") and os.path.exists("b.csv"), "logs missing")
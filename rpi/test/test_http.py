@@ -0,0 +1,101 @@
+# embedded HTTP server: listens on 127.0.0.1 unless told otherwise, streams a
+# long /range in full, and a WebSocket client may send its first frame in the
+# same packet as the upgrade request
+import json
+import os
+import socket
+import struct
+import time
+from thermtest import *
+
+PORT = 18000 + os.getpid() % 1000
+
+
+def get(path):
+    s = socket.create_connection(("127.0.0.1", PORT), timeout=10)
+    s.sendall(("GET %s HTTP/1.1\r\nHost: x\r\n\r\n" % path).encode())
+    data = b""
+    while True:
+        chunk = s.recv(65536)
+        if not chunk:
+            break
+        data += chunk
+    s.close()
+    head, body = data.split(b"\r\n\r\n", 1)
+    return head.decode(), body
+
+
+def listening():
+    """local addresses listening on PORT, from /proc/net/tcp"""
+    out = []
+    with open("/proc/net/tcp") as f:
+        for line in f.readlines()[1:]:
+            local, state = line.split()[1], line.split()[3]
+            addr, port = local.split(":")
+            if state == "0A" and int(port, 16) == PORT:
+                out.append(socket.inet_ntoa(struct.pack("<I", int(addr, 16))))
+    return out
+
+
+def recv_frame(s):
+    hdr = b""
+    while len(hdr) < 2:
+        hdr += s.recv(2 - len(hdr))
+    n = hdr[1] & 0x7f
+    if n == 126:
+        n = struct.unpack(">H", s.recv(2))[0]
+    data = b""
+    while len(data) < n:
+        data += s.recv(n - len(data))
+    return hdr[0] & 0x0f, data
+
+
+# 2000 simulated seconds a second fill the ring well past one send buffer
+p = start("--board=sim:0.0", "--speed=2000", "--http=%d" % PORT, "--http-buffer=100000", "1", "log.csv")
+try:
+    for i in range(50):
+        if listening():
+            break
+        time.sleep(0.1)
+    check(listening() == ["127.0.0.1"], "listening on %s" % listening())
+    time.sleep(3)
+
+    head, body = get("/range?from=0")
+    check(head.startswith("HTTP/1.1 200"), head)
+    rows = json.loads(body.decode())
+    check(len(rows) > 2000 and len(body) > 200000, "%d rows, %d bytes" % (len(rows), len(body)))
+    check([r["elapsed"] for r in rows] == list(range(rows[0]["elapsed"], rows[0]["elapsed"] + len(rows))),
+          "elapsed not consecutive")
+    mid = rows[len(rows) // 2]["unix"]
+    head, body = get("/range?from=%d&to=%d" % (mid, mid + 9))
+    check([r["unix"] for r in json.loads(body.decode())] == list(range(mid, mid + 10)), "range %s" % body[:200])
+    head, body = get("/range?from=%d" % (2 ** 31 - 2))
+    check(json.loads(body.decode()) == [], "empty range %s" % body)
+
+    # upgrade and a masked ping in one send()
+    s = socket.create_connection(("127.0.0.1", PORT), timeout=10)
+    ping = b"hello"
+    mask = b"\x01\x02\x03\x04"
+    frame = bytes([0x89, 0x80 | len(ping)]) + mask + bytes(b ^ mask[i % 4] for i, b in enumerate(ping))
+    s.sendall(b"GET /stream HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+              b"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n" + frame)
+    resp = b""
+    while b"\r\n\r\n" not in resp:
+        resp += s.recv(1)
+    check(b"s3pPLMBiTxaQ9kYGzzhZRbK+xOo=" in resp, "handshake %s" % resp)
+    pong = None
+    for i in range(200):
+        op, data = recv_frame(s)
+        if op == 10:
+            pong = data
+            break
+        check(op == 1 and "temp" in json.loads(data.decode()), "frame %d %s" % (op, data))
+    check(pong == ping, "pong %s" % pong)
+    s.close()
+finally:
+    status, out = stop(p)
+check(status == 0, "therm exited with %d: %s" % (status, out[-500:]))
+
+# --http-bind takes another address, a bad one is refused
+status, out = therm("--board=sim:0.0", "--http=%d" % PORT, "--http-bind=localhost", "--duration=1", "1", "log.csv")
+check(status != 0 and "--http-bind" in out, "bad bind address: %d %s" % (status, out))
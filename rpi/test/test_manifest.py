@@ -0,0 +1,28 @@
+# segmented log: the manifest follows the open segment while it fills, and the
+# Flask side reader returns its rows before the segment is ever closed
+import time
+from thermtest import *
+import thermlog
+
+p = start("--board=sim:0.0", "--segment-size=1000000", "--flush-rows=1", "1", "log.csv")
+time.sleep(4.5)
+segs = thermlog.read_manifest("log.csv")
+now = int(time.time())
+data = thermlog.load_log("log.csv")
+ranged = thermlog.load_log("log.csv", now - 60, now + 60)
+status, out = stop(p)
+check(status == 0, "therm exited with %d: %s" % (status, out))
+
+check(segs is not None and len(segs) == 1, "manifest %s" % segs)
+seg = segs[0]
+check(seg["open"], "segment not open: %s" % seg)
+check(seg["rows"] >= 3, "manifest has %d rows mid-segment" % seg["rows"])
+check(abs(seg["last"] - now) <= 2, "last row at %d, now %d" % (seg["last"], now))
+check(len(data) >= seg["rows"], "read %d rows, manifest has %d" % (len(data), seg["rows"]))
+check(len(ranged) == len(data), "read %d rows in range, %d in all" % (len(ranged), len(data)))
+check(list(data["f1"]) == list(range(len(data))), "elapsed %s" % data["f1"])
+
+# a manifest written before the segment's first row still has the open segment read
+check(thermlog.in_range(dict(seg, rows=0, first=0, last=0), now - 60, now + 60), "empty open segment skipped")
+check(not thermlog.in_range(dict(seg, open=False, rows=0), now - 60, now + 60), "empty closed segment read")
+check(len(thermlog.load_log("log.csv", now + 3600, now + 7200)) == 0, "rows read past the end")
@@ -0,0 +1,22 @@
+// round_tenths against the printf("%#.1f") formatting therm used before
+// board_format_temp, over the whole range of a thermocouple in hundredths
+#include "therm.h"
+
+int
+main(void)
+{
+	char buf[32];
+	int h;
+	int bad=0;
+
+	for (h=-30000; h<=200000; h++)
+	{
+		snprintf(buf, sizeof(buf), "%#.1f", h/100.0);
+		if (lround(strtod(buf, NULL)*10)!=round_tenths(h))
+		{
+			if (bad++<10)
+				printf("%d hundredths: printf %s, round_tenths %d\n", h, buf, round_tenths(h));
+		}
+	}
+	return(bad!=0);
+}
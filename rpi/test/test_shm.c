@@ -0,0 +1,101 @@
+// the seqlock in therm_shm.h: readers copying a slot while a writer keeps
+// rewriting it must only ever see whole samples
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "therm_shm.h"
+
+#define WRITES 2000000
+#define READERS 3
+
+therm_shm_slot_t slot;
+volatile int writing=1;
+long torn=0;
+
+void
+fill(therm_shm_slot_t* s, uint64_t k)
+{
+	int i;
+
+	s->index=k;
+	s->t=1700000000+k;
+	s->elapsed=k;
+	s->nboards=THERM_SHM_BOARDS;
+	for (i=0; i<THERM_SHM_BOARDS; i++)
+		s->temp10[i]=k*10+i;
+}
+
+void*
+writer(void* arg)
+{
+	therm_shm_slot_t s;
+	uint64_t k;
+
+	for (k=1; k<=WRITES; k++)
+	{
+		fill(&s, k);
+		therm_shm_put(&slot, &s);
+	}
+	writing=0;
+	return(NULL);
+}
+
+void*
+reader(void* arg)
+{
+	therm_shm_slot_t got;
+	therm_shm_slot_t want;
+	long reads=0;
+	uint64_t last=0;
+
+	while (writing)
+	{
+		therm_shm_get(&slot, &got);
+		reads++;
+		if (got.index==0)
+			continue;
+		fill(&want, got.index);
+		if (memcmp(&got.index, &want.index, sizeof(got)-offsetof(therm_shm_slot_t, index))!=0
+			|| got.index<last)
+			__atomic_fetch_add(&torn, 1, __ATOMIC_RELAXED);
+		last=got.index;
+	}
+	*(long*)arg=reads;
+	return(NULL);
+}
+
+int
+main(void)
+{
+	pthread_t w;
+	pthread_t r[READERS];
+	long reads[READERS];
+	int i;
+
+	for (i=0; i<READERS; i++)
+		pthread_create(&r[i], NULL, reader, &reads[i]);
+	pthread_create(&w, NULL, writer, NULL);
+	pthread_join(w, NULL);
+	for (i=0; i<READERS; i++)
+		pthread_join(r[i], NULL);
+	if (slot.seq!=2*WRITES || slot.index!=WRITES)
+	{
+		printf("seq %u index %llu after %d writes\n", slot.seq, (unsigned long long)slot.index, WRITES);
+		return(1);
+	}
+	for (i=0; i<READERS; i++)
+	{
+		if (reads[i]==0)
+		{
+			printf("reader %d never read while the writer ran\n", i);
+			return(1);
+		}
+	}
+	if (torn)
+	{
+		printf("%ld torn or out of order reads\n", torn);
+		return(1);
+	}
+	return(0);
+}
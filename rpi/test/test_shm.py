@@ -0,0 +1,30 @@
+# --shm: a second logger must not take over a segment a running logger
+# publishes, while one left by a logger that died is replaced
+import os
+import signal
+import time
+from thermtest import *
+
+name = "/therm_test_%d" % os.getpid()
+path = "/dev/shm" + name
+args = ["--board=sim:0.0", "--shm=" + name]
+
+p = start(*(args + ["1", "a.csv"]))
+try:
+    for i in range(50):
+        if os.path.exists(path):
+            break
+        time.sleep(0.1)
+    time.sleep(0.5)
+    status, out = therm(*(args + ["--duration=1", "1", "b.csv"]))
+    check(status != 0 and "pid %d" % p.pid in out, "second logger on the same segment: %d %s" % (status, out))
+    check(os.path.exists(path), "segment removed by the second logger")
+finally:
+    p.send_signal(signal.SIGKILL)
+    p.wait()
+
+# the dead logger's segment is still there, with its pid
+check(os.path.exists(path), "segment gone after SIGKILL")
+status, out = therm(*(args + ["--duration=2", "1", "c.csv"]))
+check(status == 0, "logger after a dead one: %d %s" % (status, out))
+check(not os.path.exists(path), "segment left behind after a clean stop")
@@ -0,0 +1,78 @@
+# trigger engine on a simulated board, whose thermocouple follows
+# 20 + 2 sin(2 pi t / 60) C with +-0.1 C of noise: level, rate and window
+# triggers fire once per swing, and each capture holds the readings from
+# --pre-trigger ms before the trigger to --post-trigger ms after it
+import glob
+import os
+from thermtest import *
+
+
+def run(spec, ticks=150, pre=500, post=300):
+    d = spec.replace("=", "_").replace(":", "_").replace(",", "_")
+    os.mkdir(d)
+    status, out = therm("--board=sim:0.0", "--speed=0", "--duration=%d" % ticks, "--trigger=" + spec,
+                        "--pre-trigger=%d" % pre, "--post-trigger=%d" % post, "--capture-dir=" + d, "1", d + "/log.csv")
+    check(status == 0, "therm exited with %d: %s" % (status, out))
+    alarms = [l for l in out.splitlines() if l.startswith("trigger ")]
+    logged = []
+    if os.path.exists(d + "/triggers.csv"):  # made by the first trigger
+        with open(d + "/triggers.csv") as f:
+            logged = f.read().splitlines()[1:]
+    check(len(alarms) == len(logged), "%s: %d alarms printed, %d logged" % (spec, len(alarms), len(logged)))
+    captures = []
+    for line in logged:
+        name = line.split(",")[-1]
+        with open(os.path.join(d, name)) as f:
+            lines = f.read().splitlines()
+        check(lines[0].startswith("# trigger " + spec) and lines[1] == "ms,temperature", "%s header %s" % (name, lines[:2]))
+        rows = [(float(a), float(b)) for a, b in (l.split(",") for l in lines[2:])]
+        ms = [r[0] for r in rows]
+        check(ms == sorted(ms), "%s out of order" % name)
+        check(-pre <= ms[0] < -pre + 30 and post <= ms[-1] < post + 30, "%s spans %s..%s" % (name, ms[0], ms[-1]))
+        check(0.0 in ms, "%s has no reading at the trigger" % name)
+        # 780 readings/s, fewer in the averaged measurement at each tick
+        gaps = [b - a for a, b in zip(ms, ms[1:])]
+        check(max(gaps) < 30 and len(rows) > 0.6 * 0.78 * (pre + post), "%s: %d readings, gap %.1f ms" % (name, len(rows), max(gaps)))
+        captures.append(rows)
+    check(len(glob.glob(d + "/capture-*.csv")) == len(captures), "%s: stray captures" % spec)
+    return captures
+
+
+# level: armed below 21.0, fires on the first reading at or above 21.5
+caps = run("above=21.5")
+check(len(caps) == 2 or len(caps) == 3, "above: %d captures in 150 s" % len(caps))
+for rows in caps:
+    i = [r[0] for r in rows].index(0.0)
+    check(rows[i][1] >= 21.5 and rows[i - 1][1] < 21.5, "above fired on %s after %s" % (rows[i], rows[i - 1]))
+
+caps = run("below=18.5")
+check(len(caps) == 2 or len(caps) == 3, "below: %d captures" % len(caps))
+for rows in caps:
+    i = [r[0] for r in rows].index(0.0)
+    check(rows[i][1] <= 18.5 and rows[i - 1][1] > 18.5, "below fired on %s after %s" % (rows[i], rows[i - 1]))
+
+# window: leaving 18.6..21.4 either way, about four times in 150 s
+caps = run("window=18.6:21.4")
+check(4 <= len(caps) <= 6, "window: %d captures" % len(caps))
+for rows in caps:
+    i = [r[0] for r in rows].index(0.0)
+    check(not 18.6 <= rows[i][1] <= 21.4 and 18.6 <= rows[i - 1][1] <= 21.4,
+          "window fired on %s after %s" % (rows[i], rows[i - 1]))
+
+# rate: over 5 s the sine changes by up to 0.21 C/s. The capture reaches back
+# a span, so the rate the trigger saw can be worked out from it: at least
+# 0.15 C/s at the trigger, less on the reading before (the trigger truncates
+# to whole hundredths per second)
+caps = run("rate=0.15,span=5000", pre=5200)
+check(len(caps) >= 1, "rate never fired")
+for rows in caps:
+    ms = [r[0] for r in rows]
+    i = ms.index(0.0)
+
+    def rate(j):
+        old = max(k for k in range(j) if ms[j] - ms[k] >= 5000)
+        return (rows[j][1] - rows[old][1]) * 1000 / (ms[j] - ms[old])
+    check(rate(i) >= 0.15 - 1e-6, "rate fired at %.3f C/s" % rate(i))
+    check(rate(i - 1) < 0.16, "rate was already %.3f C/s before it fired" % rate(i - 1))
+caps = run("rate=0.5,span=5000")
+check(len(caps) == 0, "rate above the sine's slope fired %d times" % len(caps))
@@ -0,0 +1,90 @@
+# .tsc logs: what thermtsc.py decodes is what therm printed, the block
+# summaries in <file>.idx and the ones rebuilt for a tail without index
+# entries match a brute force pass over the rows, and aggregate() agrees
+# with bucketing every row
+import os
+import shutil
+import numpy as np
+from thermtest import *
+import thermtsc
+
+boards = ["sim:0.0", "sim:0.1", "sim:1.0"]
+args = ["--board=" + b for b in boards]
+status, out = therm(*(args + ["--speed=0", "--duration=7300", "--block-rows=128", "1", "log.tsc"]))
+check(status == 0, "therm exited with %d: %s" % (status, out[-500:]))
+printed = [l.split() for l in out.splitlines() if l[:1].isdigit()]
+check(len(printed) == 7300, "%d rows printed" % len(printed))
+
+# round trip
+t, el, temps = thermtsc.load("log.tsc")
+check(len(t) == len(printed) and temps.shape[1] == len(boards), "decoded %s rows x %s" % (len(t), temps.shape))
+hms = thermtsc.hhmmss(t)
+for n, p in enumerate(printed):
+    row = [hms[n].decode(), "%d" % el[n]] + ["%.1f" % x for x in temps[n]]
+    check(row == p, "row %d decodes as %s, printed %s" % (n, row, p))
+check(list(np.diff(t)) == [1] * (len(t) - 1), "time steps")
+csv = thermtsc.to_csv("log.tsc").splitlines()
+check([l.split(",") for l in csv[1:]] == printed, "to_csv differs from stdout")
+
+# a range only decodes the blocks it needs and returns exactly the rows in it
+a, b = int(t[1000]) + 3, int(t[2500]) - 7
+rt, rel, rtemps = thermtsc.load("log.tsc", a, b)
+check(list(rt) == list(t[(t >= a) & (t <= b)]) and (rtemps == temps[(t >= a) & (t <= b)]).all(), "range load")
+with open("log.tsc", "rb") as f:
+    data = f.read()
+bl = thermtsc.blocks(data)
+check(len(thermtsc.blocks(data, a, b)) < len(bl) // 2, "range touches %d of %d blocks" % (len(thermtsc.blocks(data, a, b)), len(bl)))
+
+
+def brute(data, bl):
+    """the index records, one block at a time without the vectorised summary code"""
+    out = []
+    for blk in bl:
+        bt, bel, btemps, n = thermtsc._decode(data, [blk])
+        cols = [(int(c.min()), int(c.max()), int(c[0]), int(c[-1]), int(c.sum())) for c in btemps.T]
+        out.append((blk[0], int(bt[0]), int(bt[-1]), len(bt), cols))
+    return out
+
+
+def records(s):
+    return [(int(r["offset"]), int(r["first_t"]), int(r["last_t"]), int(r["rows"]),
+             [tuple(int(r["col"][c][k]) for k in ("min", "max", "first", "last", "sum")) for c in range(len(boards))])
+            for r in s]
+
+
+want = brute(data, bl)
+check(os.path.getsize("log.tsc.idx") == thermtsc.INDEX_HEADER.size + len(bl) * thermtsc._index_dtype(len(boards)).itemsize,
+      "index size %d for %d blocks" % (os.path.getsize("log.tsc.idx"), len(bl)))
+check(records(thermtsc.summaries("log.tsc")) == want, "index summaries differ from the rows")
+
+# a crash: the index is missing its last entries and the file ends mid-block,
+# the complete blocks past the index are summarised from the data
+shutil.copy("log.tsc", "cut.tsc")
+with open("cut.tsc", "r+b") as f:
+    f.truncate(bl[-3][0] + 20)
+rec = thermtsc._index_dtype(len(boards)).itemsize
+with open("log.tsc.idx", "rb") as f:
+    idx = f.read()
+with open("cut.tsc.idx", "wb") as f:
+    f.write(idx[:len(idx) - 10 * rec])
+check(records(thermtsc.summaries("cut.tsc")) == want[:-3], "summaries with a short index and a cut block")
+os.remove("cut.tsc.idx")
+check(records(thermtsc.summaries("cut.tsc")) == want[:-3], "summaries without an index")
+
+# aggregates against bucketing every row, with range ends inside buckets and blocks
+for bucket, col in ((600, 0), (3600, 2)):
+    a, b = int(t[77]), int(t[-130])
+    got = thermtsc.aggregate(["log.tsc"], a, b, bucket, col)
+    off = thermtsc.utc_offset(b) if bucket >= 3600 else 0
+    keep = (t >= a) & (t <= b)
+    kt, kv = t[keep], temps[keep, col]
+    keys = (kt + off) // bucket
+    exp = []
+    for k in np.unique(keys):
+        v = kv[keys == k]
+        exp.append({"t": int(k * bucket - off), "count": len(v), "min": v.min(), "max": v.max(),
+                    "mean": v.sum() / len(v), "first": v[0], "last": v[-1]})
+    check(len(got) == len(exp), "%d buckets, expected %d" % (len(got), len(exp)))
+    for g, e in zip(got, exp):
+        check(g["t"] == e["t"] and g["count"] == e["count"] and all(abs(g[k] - e[k]) < 1e-6 for k in ("min", "max", "mean", "first", "last")),
+              "bucket %s, expected %s" % (g, e))
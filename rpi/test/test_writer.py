@@ -0,0 +1,60 @@
+# group commit: --flush-rows writes whole groups of rows, --flush-ms alone
+# holds rows until the timer, and a clean stop leaves every row on disk
+import os
+import time
+from thermtest import *
+
+
+def data_rows(path):
+    if not os.path.exists(path):
+        return -1
+    with open(path) as f:
+        text = f.read()
+    check(text == "" or text.endswith("\n"), "partial row in %r" % text[-40:])
+    return max(text.count("\n") - 1, 0)
+
+
+def run(args, poll):
+    """start therm in real time, poll() the log size as it runs, stop it"""
+    p = start(*(["--board=sim:0.0"] + args + ["1", "log.csv"]))
+    seen = []
+    t0 = time.time()
+    while time.time() - t0 < 5:
+        time.sleep(0.25)
+        seen.append((time.time() - t0, data_rows("log.csv")))
+    status, out = stop(p)
+    check(status == 0, "therm exited with %d: %s" % (status, out))
+    poll(seen)
+    header, rows = read_csv("log.csv")
+    check(header[0].startswith("Time"), "header %s" % header)
+    printed = [l.split() for l in out.splitlines() if l[:1].isdigit()]
+    check(rows == printed, "%d rows in the log, %d printed" % (len(rows), len(printed)))
+    return rows
+
+
+# every third row, never a part of a group, the header not counted as a row
+def groups(seen):
+    check(all(n % 3 == 0 for t, n in seen if n >= 0), "rows on disk %s" % seen)
+    check(max(n for t, n in seen) >= 3, "no group written %s" % seen)
+run(["--flush-rows=3"], groups)
+
+
+# only --flush-ms: nothing before the oldest row is 3 s old, rows after that
+def timer(seen):
+    check(all(n <= 0 for t, n in seen if t < 2.5), "rows before the flush timer %s" % seen)
+    check(seen[-1][1] >= 2, "timer never flushed %s" % seen)
+run(["--flush-ms=3000"], timer)
+
+
+# with --sync-ms and --prealloc the file length still only covers real rows
+def synced(seen):
+    check(seen[-1][1] >= 4, "rows %s" % seen)
+rows = run(["--sync-ms=500", "--prealloc=65536"], synced)
+check(os.path.getsize("log.csv") == sum(len(",".join(r)) + 1 for r in rows) + len("Time HH:MM:SS,Elapsed Sec,Temp C\n"),
+      "file size %d" % os.path.getsize("log.csv"))
+
+# bench-writer: with only a flush window the writes are a buffer's worth of rows
+status, out = therm("bench-writer", os.path.abspath("bench.csv"), "200000")
+check(status == 0, "bench-writer exited with %d: %s" % (status, out))
+line = [l for l in out.splitlines() if l.startswith("1000ms ")]
+check(len(line) == 1 and float(line[0].split()[-1]) < 0.01, "bench-writer: %s" % out)
@@ -0,0 +1,44 @@
+# helpers for the test_*.py checks, run by check.sh
+import os
+import subprocess
+import sys
+
+THERM = os.environ.get("THERM", os.path.join(os.path.dirname(__file__), "..", "therm"))
+
+
+def therm(*args, **kw):
+    """run therm with a private pidfile, returns (exit status, stdout)"""
+    cmd = [THERM, "--pidfile=" + os.path.abspath("therm.pid")] + list(args)
+    p = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                       universal_newlines=True, timeout=kw.get("timeout", 60))
+    return p.returncode, p.stdout
+
+
+def start(*args):
+    """start therm in the background, stop it with stop()"""
+    cmd = [THERM, "--pidfile=" + os.path.abspath("therm.pid")] + list(args)
+    return subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+
+
+def stop(p):
+    p.send_signal(2)
+    out = p.communicate(timeout=20)[0]
+    return p.returncode, out
+
+
+def check(cond, msg):
+    if not cond:
+        print("failed: " + msg)
+        sys.exit(1)
+
+
+def read_csv(path):
+    """header fields and rows of a therm CSV log, as lists of strings"""
+    with open(path) as f:
+        lines = f.read().splitlines()
+    return lines[0].split(","), [l.split(",") for l in lines[1:]]
+
+
+def hms(s):
+    h, m, sec = s.split(":")
+    return int(h) * 3600 + int(m) * 60 + int(sec)
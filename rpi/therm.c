@@ -28,6 +28,105 @@
  * therm msg "Hello there" // Print Hello there on line 1
  * therm 10 msg "hi" 	// display the temperature every 10 seconds
  * therm 5 outputfile.csv msg "Logging to file"		// store the temperature every 5 seconds
+ * therm --board=/dev/spidev0.1,lcd=/dev/spidev0.0 --board=/dev/spidev1.1 1 myfile.csv
+ *                    // log two boards, one per SPI bus, into one time-aligned file
+ * therm --board=sim:0.0 --board=sim:1.0 1 // simulated boards, no hardware needed
+ * therm --segment-time=3600 --retain-age=2592000 1 myfile.csv
+ *                    // hourly segments, gzipped when closed, kept for 30 days
+ * therm 1 myfile.tsc // compressed log, see therm_tsc.h
+ * therm --board=/dev/spidev0.1,lcd=/dev/spidev0.0,record=raw.csv 1 myfile.csv
+ *                    // log as usual and keep every ADC code read
+ * therm --board=sim,replay=raw.csv,lcd=lcd.txt --speed=0 1 replay.csv
+ *                    // replay it flat out, replay.csv comes out the same as myfile.csv
+ *
+ * Board options:
+ * --board=<ads device>[,lcd=<lcd device>][,rs=<gpio>][,record=<file>]
+ * --board=sim[:<bus>.<cs>][,replay=<file>][,lcd=<file>][,record=<file>]
+ * Can be repeated (up to MAX_BOARDS). Without any --board option the single
+ * board wiring below is used (ADS on /dev/spidev0.1, LCD on /dev/spidev0.0, RS on GPIO17).
+ * Boards on the same SPI bus are sampled by one worker thread, different
+ * buses are sampled in parallel and every row of output is taken at the same tick.
+ * record= writes every conversion code the board returns, with its time. A
+ * simulated board follows a synthetic waveform, or with replay= hands back
+ * the codes of a recording, and its lcd= is a text file showing the display.
+ *
+ * Simulation options (every board simulated):
+ * --speed=<x>                run simulated time x times faster than real time, 0 = as fast
+ *                            as it goes. Row times follow the simulated clock, a replay
+ *                            starts at the recording's first second and ends with it.
+ * --duration=<sec>           stop after this many ticks (also with real boards)
+ *
+ * Log options:
+ * --segment-size=<bytes>, --segment-time=<sec>  roll over to a new segment file
+ * --retain-segments=<n>, --retain-age=<sec>     delete the oldest closed segments
+ * --compress=0|1                                gzip closed segments (default 1)
+ * --flush-rows=<n>, --flush-ms=<ms>             group commit: write every n rows or
+ *                                               once a row has waited ms (default: every row,
+ *                                               with only flush-ms: when the buffer fills)
+ * --sync-ms=<ms>                                fdatasync on a separate timer
+ * --prealloc=<bytes>                            reserve file space with fallocate in chunks
+ * --block-rows=<n>                              rows per block of a .tsc log (default 300)
+ *                                               A .tsc block is written once it is sealed, so
+ *                                               there flush-rows caps the rows per block and
+ *                                               flush-ms/sync-ms cap how long a block stays
+ *                                               open (whole ticks, at least one). Short
+ *                                               windows mean small blocks that compress worse
+ * --block-align=<sec>                           a .tsc block also ends on every multiple of sec
+ *                                               (default 300, 0 = off), so the per block
+ *                                               summaries in <file>.idx line up with hourly
+ *                                               and daily aggregates
+ *
+ * Server options:
+ * --http=<port>              serve /latest, /range?from=&to=, a /stream WebSocket
+ *                            and /metrics (stage latency histograms, loop jitter, counters)
+ * --http-bind=<addr>         address it listens on (default 127.0.0.1, this host only;
+ *                            0.0.0.0 for every interface, any web page may read it then)
+ * --http-buffer=<samples>    logged rows kept in memory for it (default 86400)
+ * --shm[=<name>]             publish the latest sample and recent rows in POSIX shared
+ *                            memory (default /therm), see therm_shm.h for the readers
+ * --shm-ring=<rows>          logged rows kept in the shared ring (default 4096)
+ *
+ * Control options:
+ * --control[=<socket>]       answer status/file/latest/start/stop/quit on a unix socket
+ *                            (default /var/run/therm.sock), see ctl_command() and index.js
+ * --control-group=<group>    group allowed to use the socket (mode 0660), default the
+ *                            group of the user that ran sudo (SUDO_GID), else root only
+ * --log-dir=<dir>            where 'start <file>' logs, file being a plain name
+ *                            (default the directory of the log on the command line, or .)
+ * --pidfile=<file>           lock file that keeps a second logger off the SPI buses
+ *                            (default /var/run/therm.pid, always taken by a repeating
+ *                            therm with real boards, a one-shot reading refuses to run
+ *                            while it is held). SIGTERM stops as cleanly as SIGINT.
+ *
+ * Trigger options (alarms and high rate captures around them):
+ * --trigger=<spec>           fire when a raw reading crosses a limit, may be repeated
+ *                            spec is <condition>[,board=<n>][,hyst=<C>][,span=<ms>]
+ *                            above=<C> or below=<C>    level
+ *                            rate=<C/s>                rate of change over span ms (default 250),
+ *                                                      negative for falling
+ *                            window=<lo>:<hi>          reading leaves lo..hi
+ *                            hyst (default 0.5 C, 0.1 C/s for rate) is how far back
+ *                            it must go to re-arm
+ * --trig-rate=<readings/s>   raw readings between ticks (default 780, the ADS1118 tops out at 860)
+ *                            (for ~115 ms from each tick the averaged measurement has the
+ *                            ADS1118, captures there have none for ~25 ms, then one every 10 ms)
+ * --pre-trigger=<ms>         readings kept before a trigger (default 500)
+ * --post-trigger=<ms>        and after it (default 500)
+ * --capture-dir=<dir>        where capture-*.csv and triggers.csv go (default .)
+ *
+ * therm bench-writer <file> [rows]              rows/s and syscalls/row per setting
+ * therm bench-format [rows]                     row formatting cost, old vs new
+ * therm bench-codec <dir> [rows]                .tsc against CSV and gzip, size and scan speed
+ * therm bench-e2e <dir> [seconds] [boards]      samples/s from simulated boards through the
+ *                                               log to a /stream client (default a day, 2 boards)
+ *
+ * Build:
+ * gcc -o therm therm.c therm_http.c therm_trig.c therm_ctl.c therm_bench.c -lpthread -lm -lrt
+ * therm.h has what the files share, therm_http.c the HTTP/WebSocket server,
+ * therm_trig.c the trigger engine and captures, therm_ctl.c the pidfile and
+ * the control socket, therm_bench.c the bench-* commands.
+ * test/check.sh builds it and runs the checks in test/ on simulated boards.
+ * (add -DTELEMETRY=0 to compile out the acquisition telemetry)
  *
  * Connections:
  * TI board       RPI B+
@@ -44,40 +143,11 @@
 
 
 // include files
-#include <stdio.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <stdlib.h>
-#include <signal.h>
-#include <sys/ioctl.h>
-#include <stdint.h>
-#include <linux/spi/spidev.h>
-#include <unistd.h> // sleep
-#include <time.h>
-#include <sys/mman.h>
-#include <string.h>
-#include <time.h>
-
-// definitions
-#define DBG_PRINT 0
-#define BCM2708_PERI_BASE        0x20000000
-#define GPIO_BASE                (BCM2708_PERI_BASE + 0x200000) /* GPIO controller */
-#define PAGE_SIZE (4*1024)
-#define BLOCK_SIZE (4*1024)
-
-#define ADS1118_TS			   (0x0010)    
-#define ADS1118_PULLUP     	   (0x0008)
-#define ADS1118_NOP     	   (0x0002)  
-#define ADS1118_CNVRDY     	   (0x0001)
-//Set the configuration to AIN0/AIN1, FS=+/-0.256, SS, DR=128sps, PULLUP on DOUT
-#define ADSCON_CH0		(0x8B8A)
-//Set the configuration to AIN2/AIN3, FS=+/-0.256, SS, DR=128sps, PULLUP on DOUT
-#define ADSCON_CH1		(0xBB8A)
-
-#define INTERNAL_SENSOR 0
-#define EXTERNAL_SIGNAL 1
-#define BUFSIZE 64
-#define LCD_RS_GPIO 17
+#include "therm.h"
+#include "therm_http.h"
+#include "therm_trig.h"
+#include "therm_ctl.h"
+#include "therm_bench.h"
 
 // GPIO setup macros. Always use INP_GPIO(x) before using OUT_GPIO(x) or SET_GPIO_ALT(x,y)
 #define INP_GPIO(g) *(gpio+((g)/10)) &= ~(7<<(((g)%10)*3))
@@ -94,45 +164,101 @@
 // Pull up/pull down clock
 #define GPIO_PULLCLK0 *(gpio+38)
 
-// typedefs
-typedef struct spi_ioc_transfer spi_t;
-
 // global variables
 int  mem_fd;
 void *gpio_map;
 volatile unsigned *gpio;
 extern int errno;
-static const char *device0 = "/dev/spidev0.0";
-static const char *device1 = "/dev/spidev0.1";
-int ads_fd;
-int lcd_fd;
-spi_t spi;
+static const char *default_ads_dev = "/dev/spidev0.1";
+static const char *default_lcd_dev = "/dev/spidev0.0";
+board_t boards[MAX_BOARDS];
+int nboards=0;
+bus_worker_t workers[MAX_BOARDS];
+int nworkers=0;
+pthread_barrier_t tick_start;
+pthread_barrier_t tick_done;
+volatile sig_atomic_t not_finished=1;
 int dofile;
-FILE* outfile;
-int lcd_initialised=0;
+seglog_t* tlog=NULL;       // the log being written while dofile is set
+long segment_size=0;       // roll to a new segment after this many bytes, 0 = never
+long segment_time=0;       // roll to a new segment every this many seconds, 0 = never
+int retain_segments=0;     // keep at most this many segments, 0 = keep all
+long retain_age=0;         // delete segments older than this many seconds, 0 = keep all
+int compress_segments=1;   // gzip closed segments
+int flush_rows=0;          // group commit settings, see logwriter_t, 0 = every row, or on the timer with flush_ms
+int flush_ms=0;
+int sync_ms=0;
+long prealloc=0;
+int block_rows=300;        // rows per block in a .tsc log
+int block_align=300;       // and a block ends on every multiple of this many seconds
+char shm_name[FNAME_LEN]=""; // shared memory publication, empty = off
+int shm_ring=4096;         // logged rows kept in the shared ring
+therm_shm_t* shm=NULL;
+double sim_speed=1;        // simulated time runs this many times faster than real time, 0 = flat out
+int sim_clock=0;           // 1 = every board is simulated and time is virtual, see now_ns()
+time_t sim_start;          // unix time the virtual clock starts at
+int64_t sim_tick_ns;       // virtual time of the tick being measured, set by the main loop
+__thread int64_t sim_ns;   // the calling thread's virtual time, moved on by delay_ms()
+long run_seconds=0;        // stop after this many ticks, 0 = run until stopped
+volatile int replay_ended=0; // a tick ran past the end of a recording, it is not logged
+#if TELEMETRY
+telemetry_t telemetry;
+#endif
+pthread_t bg_thread;
+pthread_mutex_t bg_lock=PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t bg_cond=PTHREAD_COND_INITIALIZER;
+bg_job_t* bg_head=NULL;
+bg_job_t* bg_tail=NULL;
+int bg_running=0;
+int bg_busy=0;             // a job is running
+pthread_cond_t bg_idle=PTHREAD_COND_INITIALIZER;
+int logs_closing=0;        // logs handed to the background thread to close, under bg_lock
+pthread_cond_t log_closed=PTHREAD_COND_INITIALIZER;
+char log_fname[FNAME_LEN]; // file being logged to, when dofile is set
+int log_period=1;
+long log_rows=0;
 uint8_t spi_bits = 8;
 //uint32_t spi_speed = 2621440;
 uint32_t spi_speed = 3932160;
-unsigned char txbuf[BUFSIZE];
-unsigned char rxbuf[BUFSIZE];
-int local_comp;
-
-// function prototypes
 
 
 // functions
+
+// unix time in ns, the virtual time of the calling thread when the boards are
+// replayed or simulated at another speed
+int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	if (sim_clock)
+		return(sim_ns);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return((int64_t)ts.tv_sec*1000000000LL+ts.tv_nsec);
+}
+
 int
 delay_ms(unsigned int msec)
 {
   int ret;
+  long ns;
   struct timespec a;
   if (msec>999)
   {
     //fprintf(stderr, "delay_ms error: delay value needs to be less than 999\n");
     msec=999;
   }
-  a.tv_nsec=((long)(msec))*1E6d;
-  a.tv_sec=0;
+  ns=((long)(msec))*1000000L;
+  if (sim_clock)
+  {
+    // virtual time moves on by the full delay, the wait is scaled by --speed
+    sim_ns+=ns;
+    if (sim_speed<=0)
+      return(0);
+    ns=(long)(ns/sim_speed);
+  }
+  a.tv_nsec=ns%1000000000L;
+  a.tv_sec=ns/1000000000L;
   if ((ret = nanosleep(&a, NULL)) != 0)
   {
     //fprintf(stderr, "delay_ms error: %s\n", strerror(errno));
@@ -140,6 +266,35 @@ delay_ms(unsigned int msec)
   return(0);
 }
 
+#if TELEMETRY
+void
+stat_add(stat_hist_t* h, uint64_t ns)
+{
+	uint64_t us=ns/1000;
+	uint64_t old;
+	int i=0;
+
+	if (us)
+		i=64-__builtin_clzll(us);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+	if (i<STAT_BUCKETS)
+		__atomic_fetch_add(&h->bucket[i], 1, __ATOMIC_RELAXED);
+	old=__atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+	while (ns>old && !__atomic_compare_exchange_n(&h->max_ns, &old, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// record the time since start (CLOCK_MONOTONIC)
+void
+stat_since(stat_hist_t* h, struct timespec* start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stat_add(h, (now.tv_sec-start->tv_sec)*1000000000LL+(now.tv_nsec-start->tv_nsec));
+}
+#endif
+
 // Set up a memory regions to access GPIO
 void setup_io()
 {
@@ -171,15 +326,12 @@ void setup_io()
 }
 
 int
-spi_open(int* f_desc, int sel, uint8_t config)
+spi_open(int* f_desc, const char* device, uint8_t config)
 {
 	uint8_t spi_bits = 8;
 	int ret;
-	
-	if (sel)
-		*f_desc=open(device1, O_RDWR);
-	else
-		*f_desc=open(device0, O_RDWR);
+
+	*f_desc=open(device, O_RDWR);
 	if (*f_desc<0)
 	{
 		fprintf(stderr, "Error opening device: %s\n", strerror(errno));
@@ -225,24 +377,79 @@ spi_open(int* f_desc, int sel, uint8_t config)
 	return(0);
 }
 
+/******************************************************************************
+ * function: sim_lcd_write(board_t* b, unsigned char c, int data)
+ * introduction: stands in for the LCD of a simulated board given lcd=<file>.
+ * Follows the cursor and clear commands, and rewrites the file with both
+ * lines of text after every change, so cat shows what the display would.
+ ******************************************************************************/
+void
+sim_lcd_write(board_t* b, unsigned char c, int data)
+{
+	char buf[2*SIM_LCD_COLS+2];
+	int col;
+
+	if (!data)
+	{
+		if (c==0x01) // clear
+		{
+			memset(b->lcd_text, ' ', sizeof(b->lcd_text));
+			b->lcd_addr=0;
+		}
+		else if (c==0x02) // home
+		{
+			b->lcd_addr=0;
+			return;
+		}
+		else if (c & 0x80) // set address, 0x40 and up is line 2
+		{
+			b->lcd_addr=c & 0x7f;
+			return;
+		}
+		else
+		{
+			return;
+		}
+	}
+	else
+	{
+		col=b->lcd_addr & 0x3f;
+		if (col<SIM_LCD_COLS)
+			b->lcd_text[b->lcd_addr>=0x40][col]=c;
+		b->lcd_addr++;
+	}
+	memcpy(buf, b->lcd_text[0], SIM_LCD_COLS);
+	buf[SIM_LCD_COLS]='\n';
+	memcpy(buf+SIM_LCD_COLS+1, b->lcd_text[1], SIM_LCD_COLS);
+	buf[2*SIM_LCD_COLS+1]='\n';
+	pwrite(b->lcd_fd, buf, sizeof(buf), 0);
+}
+
 // write command to LCD
 void
-lcd_writecom(unsigned char c)
+lcd_writecom(board_t* b, unsigned char c)
 {
 	int ret;
-	
-	GPIO_CLR = 1<<LCD_RS_GPIO; //set RS low for transmitting command
-
-	txbuf[0]=c;
-	spi.len=1;
-  spi.delay_usecs=0;
-  spi.speed_hz=spi_speed;
-  spi.bits_per_word=spi_bits;
-  spi.cs_change=0;
-  spi.tx_buf=(unsigned long)txbuf;
-  spi.rx_buf=(unsigned long)rxbuf;
-
-  ret=ioctl(lcd_fd, SPI_IOC_MESSAGE(1), &spi);
+
+	if (b->lcd_fd<0) // no LCD on this board
+		return;
+	if (b->sim)
+	{
+		sim_lcd_write(b, c, 0);
+		return;
+	}
+	GPIO_CLR = 1<<b->lcd_rs_gpio; //set RS low for transmitting command
+
+	b->txbuf[0]=c;
+	b->spi.len=1;
+  b->spi.delay_usecs=0;
+  b->spi.speed_hz=spi_speed;
+  b->spi.bits_per_word=spi_bits;
+  b->spi.cs_change=0;
+  b->spi.tx_buf=(unsigned long)b->txbuf;
+  b->spi.rx_buf=(unsigned long)b->rxbuf;
+
+  ret=ioctl(b->lcd_fd, SPI_IOC_MESSAGE(1), &b->spi);
   if (ret<0)
   {
   	fprintf(stderr, "Error performing SPI exchange: %s\n", strerror(errno));
@@ -251,22 +458,29 @@ lcd_writecom(unsigned char c)
 }
 
 void
-lcd_writedata(unsigned char c)	//write data
+lcd_writedata(board_t* b, unsigned char c)	//write data
 {
 	int ret;
-	
-	GPIO_SET = 1<<LCD_RS_GPIO; //set RS high for writing data
-
-	txbuf[0]=c;
-	spi.len=1;
-  spi.delay_usecs=0;
-  spi.speed_hz=spi_speed;
-  spi.bits_per_word=spi_bits;
-  spi.cs_change=0;
-  spi.tx_buf=(unsigned long)txbuf;
-  spi.rx_buf=(unsigned long)rxbuf;
-
-  ret=ioctl(lcd_fd, SPI_IOC_MESSAGE(1), &spi);
+
+	if (b->lcd_fd<0)
+		return;
+	if (b->sim)
+	{
+		sim_lcd_write(b, c, 1);
+		return;
+	}
+	GPIO_SET = 1<<b->lcd_rs_gpio; //set RS high for writing data
+
+	b->txbuf[0]=c;
+	b->spi.len=1;
+  b->spi.delay_usecs=0;
+  b->spi.speed_hz=spi_speed;
+  b->spi.bits_per_word=spi_bits;
+  b->spi.cs_change=0;
+  b->spi.tx_buf=(unsigned long)b->txbuf;
+  b->spi.rx_buf=(unsigned long)b->rxbuf;
+
+  ret=ioctl(b->lcd_fd, SPI_IOC_MESSAGE(1), &b->spi);
   if (ret<0)
   {
   	fprintf(stderr, "Error performing SPI exchange: %s\n", strerror(errno));
@@ -275,11 +489,13 @@ lcd_writedata(unsigned char c)	//write data
 }
 
 void
-lcd_clear(void)
+lcd_clear(board_t* b)
 {
-	lcd_writecom(0x01);
+	if (b->lcd_fd<0)
+		return;
+	lcd_writecom(b, 0x01);
 	delay_ms(2);
-	lcd_writecom(0x02);
+	lcd_writecom(b, 0x02);
 	delay_ms(2);
 }
 
@@ -290,77 +506,239 @@ parameters:L is the display line, 0 indicates the first line, 1 indicates the se
 return value:
 *******************************************************************************/
 void
-lcd_display_string(unsigned char line_num, char *ptr)
+lcd_display_string(board_t* b, unsigned char line_num, char *ptr)
 {
 //	unsigned char i;
 
+	if (b->lcd_fd<0)
+		return;
 	if(line_num==0)		//first line
 	{
-		lcd_writecom(0x80);
+		lcd_writecom(b, 0x80);
 	}
 	else if(line_num==1)	//second line
 	{
-		lcd_writecom(0xc0);
+		lcd_writecom(b, 0xc0);
 	}
 
 	while (*ptr)
 	{
-		lcd_writedata(*ptr++);
+		lcd_writedata(b, *ptr++);
 	}
 
 }
 
 // initialize and clear the display
 void
-lcd_init(void)
-{
-	GPIO_SET = 1<<LCD_RS_GPIO;
-	lcd_writecom(0x30);	//wake up
-	lcd_writecom(0x39);	//function set
-	lcd_writecom(0x14);	//internal osc frequency
-	lcd_writecom(0x56);	//power control
-	lcd_writecom(0x6D);	//follower control
-	lcd_writecom(0x70);	//contrast
-	lcd_writecom(0x0C);	//display on
-	lcd_writecom(0x06);	//entry mode
-	lcd_writecom(0x01);	//clear
+lcd_init(board_t* b)
+{
+	if (b->lcd_fd<0)
+		return;
+	if (!b->sim)
+		GPIO_SET = 1<<b->lcd_rs_gpio;
+	lcd_writecom(b, 0x30);	//wake up
+	lcd_writecom(b, 0x39);	//function set
+	lcd_writecom(b, 0x14);	//internal osc frequency
+	lcd_writecom(b, 0x56);	//power control
+	lcd_writecom(b, 0x6D);	//follower control
+	lcd_writecom(b, 0x70);	//contrast
+	lcd_writecom(b, 0x0C);	//display on
+	lcd_writecom(b, 0x06);	//entry mode
+	lcd_writecom(b, 0x01);	//clear
 	delay_ms(20);
+	b->lcd_initialised=1;
+}
+
+// find the thermocouple code that adc_code2temp() turns into temp_c
+// (codes exactly on a table breakpoint are off scale, so step over them)
+int
+sim_temp2code(double temp_c)
+{
+	int lo=-0x33A;
+	int hi=0x0A52;
+	int mid;
+	int t;
+
+	while (hi-lo>1)
+	{
+		mid=(lo+hi)/2;
+		t=adc_code2temp(mid & 0xffff);
+		if (t==10*0x270F)
+			t=adc_code2temp((mid+1) & 0xffff);
+		if (t<(int)(temp_c*10))
+			lo=mid;
+		else
+			hi=mid;
+	}
+	if (adc_code2temp(hi & 0xffff)==10*0x270F)
+		hi++;
+	return(hi);
+}
+
+/******************************************************************************
+ * Replay of recorded conversion results. A board given record=<file> writes
+ * every code it reads from the ADS1118 as <unix ns>,<T|C>,<code> (T for the
+ * internal sensor, C for the thermocouple), and a simulated board given
+ * replay=<file> hands those codes back in place of its waveform. Codes are
+ * picked by time rather than by position, so a replay with other settings
+ * (period, trigger rate) still reads what the board saw at that moment, and
+ * they go through the same compensation and conversion as live readings.
+ ******************************************************************************/
+int
+replay_load(board_t* b, const char* fname)
+{
+	FILE* fp;
+	char line[LINE_LEN];
+	long long ns;
+	char kind;
+	int code;
+	long cap[2]={0, 0};
+	replay_t* r;
+	int k;
+
+	fp=fopen(fname, "r");
+	if (fp==NULL)
+	{
+		fprintf(stderr, "Error opening %s: %s\n", fname, strerror(errno));
+		return(-1);
+	}
+	r=calloc(1, sizeof(replay_t));
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "%lld,%c,%d", &ns, &kind, &code)!=3 || (kind!='T' && kind!='C'))
+			continue; // the header
+		k=(kind=='C');
+		if (r->n[k]==cap[k])
+		{
+			cap[k]=cap[k] ? 2*cap[k] : 4096;
+			r->ns[k]=realloc(r->ns[k], cap[k]*sizeof(int64_t));
+			r->code[k]=realloc(r->code[k], cap[k]*sizeof(int));
+		}
+		r->ns[k][r->n[k]]=ns;
+		r->code[k][r->n[k]++]=code;
+	}
+	fclose(fp);
+	if (r->n[1]==0)
+	{
+		fprintf(stderr, "%s has no thermocouple readings to replay\n", fname);
+		return(-1);
+	}
+	b->replay=r;
+	return(0);
+}
+
+// the recorded code of kind k (0 = internal sensor, 1 = thermocouple) for time
+// now, ending the replay once the recording has run out
+int
+replay_code(board_t* b, int k, int64_t now)
+{
+	replay_t* r=b->replay;
+
+	if (r->n[k]==0)
+		return(25*32*4); // no internal sensor readings recorded, say 25 C
+	while (r->cur[k]<r->n[k] && r->ns[k][r->cur[k]]<now-REPLAY_EARLY_NS)
+		r->last[k]=r->code[k][r->cur[k]++];
+	if (r->cur[k]<r->n[k] && r->ns[k][r->cur[k]]<=now+REPLAY_LATE_NS)
+		r->last[k]=r->code[k][r->cur[k]++];
+	else if (r->cur[k]==0) // before the recording starts
+		r->last[k]=r->code[k][0];
+	if (k && r->cur[k]==r->n[k] && now>r->ns[k][r->n[k]-1]+REPLAY_LATE_NS)
+		replay_ended=1;
+	return(r->last[k]);
+}
+
+/******************************************************************************
+ * function: sim_transact(board_t* b)
+ * introduction: stands in for the ADS1118 on a simulated board.
+ * Like the real device in single-shot mode, the value returned is the result
+ * of the conversion started by the previous transaction, and the config word
+ * sent now selects what the next conversion measures.
+ * The cold junction sits at 25 C and the thermocouple follows a slow sine
+ * around sim_base with a little noise, or with replay=<file> the codes come
+ * from a recording instead.
+ * return value: 16 bit conversion code
+ ******************************************************************************/
+int
+sim_transact(board_t* b)
+{
+	unsigned int cfg;
+	int ret;
+	double now;
+	double temp_c;
+
+	cfg=(b->txbuf[0]<<8) | b->txbuf[1];
+	if (b->replay)
+	{
+		ret=replay_code(b, b->sim_kind, now_ns());
+	}
+	else
+	{
+		ret=b->sim_result & 0xffff;
+		if (cfg & ADS1118_TS)
+		{
+			b->sim_result=25*32*4; // internal sensor, 14 bits left aligned
+		}
+		else
+		{
+			now=now_ns()/1E9;
+			temp_c=b->sim_base+2.0*sin(now*2*M_PI/60.0);
+			temp_c+=((double)(rand_r(&b->sim_seed)%100)-50)/500.0;
+			b->sim_result=sim_temp2code(temp_c)-local_compensation(25*32*4);
+		}
+	}
+	b->sim_kind=(cfg & ADS1118_TS) ? 0 : 1;
+	b->rxbuf[0]=(ret>>8) & 0xff;
+	b->rxbuf[1]=ret & 0xff;
+	return(ret);
 }
 
 // Send four bytes (two config bytes repeated twice, and return two bytes)
 int
-therm_transact(void)
+therm_transact(board_t* b)
 {
 	int ret;
-	
-	txbuf[0]=txbuf[0] | 0x80;
-	
-	spi.len=4;
-	txbuf[2]=txbuf[0];
-	txbuf[3]=txbuf[1];
 
-  spi.delay_usecs=0;
-  spi.speed_hz=spi_speed;
-  spi.bits_per_word=spi_bits;
-  spi.cs_change=0;
-  spi.tx_buf=(unsigned long)txbuf;
-  spi.rx_buf=(unsigned long)rxbuf;
+	b->txbuf[0]=b->txbuf[0] | 0x80;
 
-	if (DBG_PRINT)  
-  	printf("sending [%02x %02x %02x %02x]. ", txbuf[0], txbuf[1], txbuf[2], txbuf[3]);
+	b->spi.len=4;
+	b->txbuf[2]=b->txbuf[0];
+	b->txbuf[3]=b->txbuf[1];
 
-  ret=ioctl(ads_fd, SPI_IOC_MESSAGE(1), &spi);
+  b->spi.delay_usecs=0;
+  b->spi.speed_hz=spi_speed;
+  b->spi.bits_per_word=spi_bits;
+  b->spi.cs_change=0;
+  b->spi.tx_buf=(unsigned long)b->txbuf;
+  b->spi.rx_buf=(unsigned long)b->rxbuf;
+
+	if (DBG_PRINT)
+  	printf("%s sending [%02x %02x %02x %02x]. ", b->ads_dev, b->txbuf[0], b->txbuf[1], b->txbuf[2], b->txbuf[3]);
+
+	TM_START(t0);
+	if (b->sim)
+	{
+		ret=sim_transact(b);
+	}
+	else
+	{
+		ret=ioctl(b->ads_fd, SPI_IOC_MESSAGE(1), &b->spi);
+	}
+	TM_END(STAGE_SPI, t0);
   if (ret<0)
   {
   	fprintf(stderr, "Error performing SPI exchange: %s\n", strerror(errno));
 		exit(1);
   }
-  
+
   if (DBG_PRINT)
-  	printf("received [%02x %02x]\n", rxbuf[0], rxbuf[1]);
-  ret=rxbuf[0];
+  	printf("received [%02x %02x]\n", b->rxbuf[0], b->rxbuf[1]);
+  ret=b->rxbuf[0];
   ret=ret<<8;
-  ret=ret | rxbuf[1];
+  ret=ret | b->rxbuf[1];
+  // the code is the result of the conversion the previous transaction started
+  if (b->record && b->prev_cfg)
+    fprintf(b->record, "%lld,%c,%d\n", (long long)now_ns(), (b->prev_cfg & ADS1118_TS) ? 'T' : 'C', ret);
+  b->prev_cfg=(b->txbuf[0]<<8) | b->txbuf[1];
   return(ret);
 }
 
@@ -573,7 +951,7 @@ adc_code2temp(int code)	// transform ADC code for far-end to temperature.
  * return value:
 *******************************************************************************/
 void
-ads_config(unsigned int mode, unsigned int chan)
+ads_config(board_t* b, unsigned int mode, unsigned int chan)
 {
 
 	unsigned int tmp;
@@ -594,9 +972,9 @@ ads_config(unsigned int mode, unsigned int chan)
 			tmp = ADSCON_CH0 + ADS1118_TS;// internal temperature sensor mode.DR=8sps, PULLUP on DOUT
 	}
 
-	txbuf[0]=(unsigned char)((tmp>>8) & 0xff);
-	txbuf[1]=(unsigned char)(tmp & 0xff);
-	ret=therm_transact();
+	b->txbuf[0]=(unsigned char)((tmp>>8) & 0xff);
+	b->txbuf[1]=(unsigned char)(tmp & 0xff);
+	ret=therm_transact(b);
 }
 
 /******************************************************************************
@@ -609,7 +987,7 @@ ads_config(unsigned int mode, unsigned int chan)
  * return value:result of last conversion
  */
 int
-ads_read(unsigned int mode, unsigned int chan)
+ads_read(board_t* b, unsigned int mode, unsigned int chan)
 {
 	unsigned int tmp;
 	int result;
@@ -630,31 +1008,43 @@ ads_read(unsigned int mode, unsigned int chan)
 	}
 
 
-	txbuf[0]=(unsigned char)((tmp>>8) & 0xff);
-	txbuf[1]=(unsigned char)(tmp & 0xff);
-	result=therm_transact();
+	b->txbuf[0]=(unsigned char)((tmp>>8) & 0xff);
+	b->txbuf[1]=(unsigned char)(tmp & 0xff);
+	result=therm_transact(b);
+
+	return(result);
+}
+
+// compensate a thermocouple code and turn it into tenths of a degree
+int
+convert_code(board_t* b, int code)
+{
+	int result;
 
+	TM_START_EVERY(t0, TM_CONVERT_EVERY);
+	result = code + b->local_comp;
+	result=result & 0xffff;
+	result = adc_code2temp(result);
+	TM_END_EVERY(STAGE_CONVERT, t0);
 	return(result);
 }
 
 // returns the measured temperature
 double
-get_measurement(void)
+get_measurement(board_t* b)
 {
 	int result;
 	int local_data;
 	double result_d;
 	
-	ads_config(INTERNAL_SENSOR,0);  // start internal sensor measurement
+	ads_config(b, INTERNAL_SENSOR,0);  // start internal sensor measurement
 	delay_ms(10);
-	local_data=ads_read(EXTERNAL_SIGNAL,0); // read internal sensor measurement and start external sensor measurement
+	local_data=ads_read(b, EXTERNAL_SIGNAL,0); // read internal sensor measurement and start external sensor measurement
 	delay_ms(10);
-	result=ads_read(EXTERNAL_SIGNAL,0); // read external sensor measurement and restart external sensor measurement
+	result=ads_read(b, EXTERNAL_SIGNAL,0); // read external sensor measurement and restart external sensor measurement
 	
-	local_comp = local_compensation(local_data);
-	result = result + local_comp;
-	result=result & 0xffff;
-	result = adc_code2temp(result);
+	b->local_comp = local_compensation(local_data);
+	result = convert_code(b, result);
 	
 	//printf("10x temp is %d\n", result);
 	result_d=((double)result)/10;
@@ -662,115 +1052,1809 @@ get_measurement(void)
 	return(result_d);
 }
 
-double
-get_measurement_fast(void)
+// as get_measurement_fast(), in tenths of a degree
+int
+get_measurement_fast_tenths(board_t* b)
 {
 	int result;
-	double result_d;
-	
-	result=ads_read(EXTERNAL_SIGNAL,0); // read external sensor measurement and restart external sensor measurement
-	result = result + local_comp;
-	result=result & 0xffff;
-	result = adc_code2temp(result);
-	
-	result_d=((double)result)/10;
 	
-	return(result_d);
+	result=ads_read(b, EXTERNAL_SIGNAL,0); // read external sensor measurement and restart external sensor measurement
+	return(convert_code(b, result));
+}
+
+double
+get_measurement_fast(board_t* b)
+{
+	return(((double)get_measurement_fast_tenths(b))/10);
+}
+
+/******************************************************************************
+ * function: bus_measure(board_t** list, int n)
+ * introduction: averaged measurement (1 full + 9 fast readings) on every board
+ * of one SPI bus. The boards are stepped together so they share the conversion
+ * delays, a bus with several boards takes no longer than a bus with one.
+ * Results are left in each board's tval and tsum. With triggers set, every
+ * thermocouple reading also goes to the trigger engine.
+ ******************************************************************************/
+void
+bus_measure(board_t** list, int n)
+{
+	int i;
+	int k;
+	int local_data[MAX_BOARDS];
+	int result;
+
+	for (k=0; k<n; k++)
+		ads_config(list[k], INTERNAL_SENSOR,0);  // start internal sensor measurement
+	delay_ms(10);
+	for (k=0; k<n; k++)
+		local_data[k]=ads_read(list[k], EXTERNAL_SIGNAL,0); // read internal sensor measurement and start external sensor measurement
+	delay_ms(10);
+	for (k=0; k<n; k++)
+	{
+		result=ads_read(list[k], EXTERNAL_SIGNAL,0); // read external sensor measurement and restart external sensor measurement
+		list[k]->local_comp = local_compensation(local_data[k]);
+		list[k]->tsum=convert_code(list[k], result);
+		if (ntriggers)
+			trig_sample(list[k], list[k]->tsum);
+	}
+	for (i=1; i<10; i++)
+	{
+		delay_ms(10);
+		for (k=0; k<n; k++)
+		{
+			result=get_measurement_fast_tenths(list[k]);
+			list[k]->tsum=list[k]->tsum+result;
+			if (ntriggers)
+				trig_sample(list[k], result);
+		}
+	}
+	for (k=0; k<n; k++)
+		list[k]->tval=((double)list[k]->tsum)/100;
+}
+
+/******************************************************************************
+ * Record formatting for the logging loop. A row is built once, without
+ * printf or locale lookups, into a line buffer that then goes to the log
+ * file and (with spaces for commas) to stdout. The temperature text is made
+ * once per board by the bus worker and also used for the LCD.
+ ******************************************************************************/
+
+// write v in decimal, returns the number of characters
+int
+fmt_uint(char* out, unsigned long v)
+{
+	char tmp[24];
+	int n=0;
+	int len;
+
+	do
+	{
+		tmp[n++]='0'+(v%10);
+		v=v/10;
+	} while (v);
+	len=n;
+	while (n)
+		*out++=tmp[--n];
+	return(len);
+}
+
+// write tenths/10 with one decimal place, like %#.1f
+int
+fmt_tenths(char* out, long tenths)
+{
+	int len=0;
+
+	if (tenths<0)
+	{
+		out[len++]='-';
+		tenths=-tenths;
+	}
+	len+=fmt_uint(out+len, tenths/10);
+	out[len++]='.';
+	out[len++]='0'+(tenths%10);
+	return(len);
+}
+
+// write t as local HH:MM:SS (8 characters), returns 8
+int
+fmt_hms(timecache_t* tc, time_t t, char* out)
+{
+	struct tm nts;
+	int sec;
+
+	// time zone offsets are whole minutes, so only the seconds move within a minute
+	if (t/60!=tc->minute || tc->hhmm[0]==0)
+	{
+		localtime_r(&t, &nts);
+		tc->hhmm[0]='0'+nts.tm_hour/10;
+		tc->hhmm[1]='0'+nts.tm_hour%10;
+		tc->hhmm[2]=':';
+		tc->hhmm[3]='0'+nts.tm_min/10;
+		tc->hhmm[4]='0'+nts.tm_min%10;
+		tc->hhmm[5]=':';
+		tc->minute=t/60;
+	}
+	memcpy(out, tc->hhmm, 6);
+	sec=t%60;
+	out[6]='0'+sec/10;
+	out[7]='0'+sec%10;
+	return(8);
+}
+
+// format a board's temperature once, for everything that displays it
+// (tsum is in hundredths, rounded as %#.1f rounded tval, see round_tenths)
+void
+board_format_temp(board_t* b)
+{
+	b->t10=round_tenths(b->tsum);
+	b->tlen=fmt_tenths(b->tstr, b->t10);
+	b->tstr[b->tlen]=0;
 }
 
+// build "HH:MM:SS,elapsed,temp[,temp...]\n" in line, returns its length
+int
+format_row(timecache_t* tc, char* line, time_t t, int elapsed)
+{
+	int len;
+	int i;
+
+	len=fmt_hms(tc, t, line);
+	line[len++]=',';
+	len+=fmt_uint(line+len, elapsed);
+	for (i=0; i<nboards; i++)
+	{
+		line[len++]=',';
+		memcpy(line+len, boards[i].tstr, boards[i].tlen);
+		len+=boards[i].tlen;
+	}
+	line[len++]='\n';
+	return(len);
+}
+
+void unixtime2string(char* int_part, char* out_time);
+
 // Convert the integer portion of unix timestamp into H:M:S
 void
 unixtime2string(char* int_part, char* out_time)
 {
 	unsigned int nutime;
+	time_t t;
 	struct tm *nts;
 	char buf1[100];
-	char buf2[50];
 	
 	sscanf(int_part, "%u", &nutime);
-	nts=localtime((time_t*)&nutime);
+	t=nutime;
+	nts=localtime(&t);
 	strftime(buf1, 100, "%H:%M:%S", nts);
 	
 	strcpy(out_time, buf1);	
 }
 
-void sig_handler(int signo)
+/******************************************************************************
+ * function: board_add(char* spec)
+ * introduction: add a board from a --board option.
+ * spec is <ads device>[,lcd=<lcd device>][,rs=<gpio>][,record=<file>] or
+ * sim[:<bus>.<cs>][,replay=<file>][,lcd=<file>][,record=<file>]
+ * return value: 0 on success, -1 if the spec is bad or there are too many boards
+ ******************************************************************************/
+int
+board_add(char* spec)
 {
-  if (signo == SIGINT)
-    printf("received SIGINT\n");
-  if (dofile)
-  {
-  	fclose(outfile);
-  }
-  close(ads_fd);
-  lcd_clear();
-	lcd_display_string(1,"Bye");
-  close(lcd_fd);
-  printf("Bye\n");
-  exit(0);
+	board_t* b;
+	char* tok;
+	char* save;
+	int cs=0;
+
+	if (nboards>=MAX_BOARDS)
+	{
+		fprintf(stderr, "Too many boards, maximum is %d\n", MAX_BOARDS);
+		return(-1);
+	}
+	b=&boards[nboards];
+	memset(b, 0, sizeof(board_t));
+	b->ads_fd=-1;
+	b->lcd_fd=-1;
+	b->lcd_rs_gpio=LCD_RS_GPIO;
+
+	tok=strtok_r(spec, ",", &save);
+	if (tok==NULL)
+	{
+		fprintf(stderr, "Empty board specification\n");
+		return(-1);
+	}
+	if (strncmp(tok, "sim", 3)==0)
+	{
+		b->sim=1;
+		b->bus=0;
+		if (tok[3]==':')
+			sscanf(tok+4, "%d.%d", &b->bus, &cs);
+		b->sim_base=20.0+5.0*nboards;
+		b->sim_seed=nboards+1;
+	}
+	else if (sscanf(tok, "/dev/spidev%d.%d", &b->bus, &cs)!=2)
+	{
+		fprintf(stderr, "Can't work out the SPI bus of %s\n", tok);
+		return(-1);
+	}
+	snprintf(b->ads_dev, DEVNAME_LEN, "%s", tok);
+
+	while ((tok=strtok_r(NULL, ",", &save))!=NULL)
+	{
+		if (strncmp(tok, "lcd=", 4)==0)
+			snprintf(b->lcd_dev, DEVNAME_LEN, "%s", tok+4);
+		else if (strncmp(tok, "rs=", 3)==0)
+			b->lcd_rs_gpio=atoi(tok+3);
+		else if (strncmp(tok, "record=", 7)==0)
+			snprintf(b->record_file, FNAME_LEN, "%s", tok+7);
+		else if (strncmp(tok, "replay=", 7)==0 && b->sim)
+		{
+			if (replay_load(b, tok+7)!=0)
+				return(-1);
+		}
+		else
+		{
+			fprintf(stderr, "Unknown board option %s\n", tok);
+			return(-1);
+		}
+	}
+	nboards++;
+	return(0);
 }
 
+// open the ADS1118 side of a board (nothing to open for a simulated one)
 int
-main(int argc, char* argv[])
+board_open_ads(board_t* b)
 {
-	int ret;
-	int i;
-	uint8_t spi_config=0;
-	double tval;
-	int repeat=0;
-	int period=1;
-	char fname[128];
-	char tstring[128];
-	char tstring2[128];
-	time_t mytime;
-	time_t desiredtime;
-	struct timespec tstime;
-	int not_finished=1;
-	int elapsed=0;
-	int showtime=0;
-	
-	// initialise GPIO
-	setup_io();
-	INP_GPIO(LCD_RS_GPIO); // must use INP_GPIO before we can use OUT_GPIO
-  OUT_GPIO(LCD_RS_GPIO);
-	
-	// parse inputs
-	dofile=0;
-	if (argc>2)
+	if (b->record_file[0] && b->record==NULL)
 	{
-		if (strcmp(argv[1], "msg")==0) // print to the lcd
+		b->record=fopen(b->record_file, "w");
+		if (b->record==NULL)
 		{
-			spi_config=0;
-			ret=spi_open(&lcd_fd, 0, spi_config);
-			if (ret!=0)
-			{
-				printf("Exiting\n");
-			exit(1);
-			}
-			lcd_display_string(0,argv[2]);
-			close(lcd_fd);
-			exit(0);
+			fprintf(stderr, "Error creating %s: %s\n", b->record_file, strerror(errno));
+			return(-1);
+		}
+		fprintf(b->record, "# unix_ns,T internal sensor|C thermocouple,code\n");
+	}
+	if (b->sim)
+		return(0);
+	return(spi_open(&b->ads_fd, b->ads_dev, SPI_CPHA));
+}
+
+// open the LCD side of a board, if it has one (a text file for a simulated one)
+int
+board_open_lcd(board_t* b)
+{
+	if (b->lcd_dev[0]==0 || b->lcd_fd>=0)
+		return(0);
+	if (b->sim)
+	{
+		memset(b->lcd_text, ' ', sizeof(b->lcd_text));
+		b->lcd_fd=open(b->lcd_dev, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+		if (b->lcd_fd<0)
+		{
+			fprintf(stderr, "Error creating %s: %s\n", b->lcd_dev, strerror(errno));
+			return(-1);
+		}
+		return(0);
+	}
+	return(spi_open(&b->lcd_fd, b->lcd_dev, 0));
+}
+
+void
+board_close(board_t* b)
+{
+	if (b->ads_fd>=0)
+		close(b->ads_fd);
+	if (b->lcd_fd>=0)
+		close(b->lcd_fd);
+	b->ads_fd=-1;
+	b->lcd_fd=-1;
+	if (b->record)
+		fclose(b->record);
+	b->record=NULL;
+}
+
+// samples all boards on one bus each time the main loop releases a tick
+void*
+bus_worker(void* arg)
+{
+	bus_worker_t* w=(bus_worker_t*)arg;
+	char tstring[32];
+	int k;
+	int pad;
+
+	while(1)
+	{
+		pthread_barrier_wait(&tick_start);
+		if (nworkers==0) // main loop is shutting down
+			break;
+		if (sim_clock)
+			sim_ns=sim_tick_ns;
+		bus_measure(w->boards, w->nboards);
+		for (k=0; k<w->nboards; k++)
+		{
+			board_format_temp(w->boards[k]);
+			if (w->boards[k]->lcd_fd<0)
+				continue;
+			// right aligned in 7 characters, as %7.1f
+			pad=7-w->boards[k]->tlen;
+			if (pad<0)
+				pad=0;
+			memset(tstring, ' ', pad);
+			memcpy(tstring+pad, w->boards[k]->tstr, w->boards[k]->tlen+1);
+			TM_START(t0);
+			lcd_clear(w->boards[k]);
+			lcd_display_string(w->boards[k], 1, tstring);
+			TM_END(STAGE_LCD, t0);
+		}
+		pthread_barrier_wait(&tick_done);
+		if (ntriggers)
+			trig_sample_until_tick(w);
+	}
+	// write out captures that were still waiting for post-trigger readings
+	for (k=0; k<w->nboards; k++)
+	{
+		if (w->boards[k]->capture_at)
+			capture_finish(w->boards[k]);
+	}
+	return(NULL);
+}
+
+// group the boards by bus and start one worker per bus
+int
+workers_start(void)
+{
+	int i;
+	int k;
+	sigset_t set;
+	sigset_t oldset;
+
+	nworkers=0;
+	for (i=0; i<nboards; i++)
+	{
+		for (k=0; k<nworkers; k++)
+		{
+			if (workers[k].bus==boards[i].bus)
+				break;
+		}
+		if (k==nworkers)
+		{
+			workers[k].bus=boards[i].bus;
+			workers[k].nboards=0;
+			nworkers++;
+		}
+		workers[k].boards[workers[k].nboards++]=&boards[i];
+	}
+
+	pthread_barrier_init(&tick_start, NULL, nworkers+1);
+	pthread_barrier_init(&tick_done, NULL, nworkers+1);
+
+	// SIGINT must reach the main loop, not a worker
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	for (k=0; k<nworkers; k++)
+	{
+		if (pthread_create(&workers[k].thread, NULL, bus_worker, &workers[k])!=0)
+		{
+			fprintf(stderr, "Error starting worker for SPI bus %d\n", workers[k].bus);
+			exit(1);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	return(0);
+}
+
+void
+workers_stop(void)
+{
+	int k;
+	int n=nworkers;
+
+	nworkers=0;
+	pthread_barrier_wait(&tick_start);
+	for (k=0; k<n; k++)
+		pthread_join(workers[k].thread, NULL);
+	pthread_barrier_destroy(&tick_start);
+	pthread_barrier_destroy(&tick_done);
+}
+
+// background thread, runs queued jobs in order until told to stop
+void*
+bg_worker(void* arg)
+{
+	bg_job_t* job;
+
+	pthread_mutex_lock(&bg_lock);
+	while(1)
+	{
+		while (bg_head==NULL && bg_running)
+			pthread_cond_wait(&bg_cond, &bg_lock);
+		if (bg_head==NULL) // stopped and nothing left to do
+			break;
+		job=bg_head;
+		bg_head=job->next;
+		if (bg_head==NULL)
+			bg_tail=NULL;
+		bg_busy=1;
+		pthread_mutex_unlock(&bg_lock);
+		job->fn(job->arg);
+		free(job);
+		pthread_mutex_lock(&bg_lock);
+		bg_busy=0;
+		if (bg_head==NULL)
+			pthread_cond_broadcast(&bg_idle);
+	}
+	pthread_mutex_unlock(&bg_lock);
+	return(NULL);
+}
+
+int
+bg_start(void)
+{
+	sigset_t set;
+	sigset_t oldset;
+	int ret;
+
+	bg_running=1;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	ret=pthread_create(&bg_thread, NULL, bg_worker, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	if (ret!=0)
+	{
+		fprintf(stderr, "Error starting background thread\n");
+		bg_running=0;
+		return(-1);
+	}
+	return(0);
+}
+
+// queue fn(arg) for the background thread, or run it here if there is none
+void
+bg_submit(void (*fn)(void*), void* arg)
+{
+	bg_job_t* job;
+
+	if (!bg_running)
+	{
+		fn(arg);
+		return;
+	}
+	job=malloc(sizeof(bg_job_t));
+	job->fn=fn;
+	job->arg=arg;
+	job->next=NULL;
+	pthread_mutex_lock(&bg_lock);
+	if (bg_tail)
+		bg_tail->next=job;
+	else
+		bg_head=job;
+	bg_tail=job;
+	pthread_cond_signal(&bg_cond);
+	pthread_mutex_unlock(&bg_lock);
+}
+
+// wait until every queued job has run, the thread keeps going
+void
+bg_drain(void)
+{
+	pthread_mutex_lock(&bg_lock);
+	while (bg_running && (bg_head || bg_busy))
+		pthread_cond_wait(&bg_idle, &bg_lock);
+	pthread_mutex_unlock(&bg_lock);
+}
+
+// finish the queued jobs and stop the background thread
+void
+bg_stop(void)
+{
+	if (!bg_running)
+		return;
+	pthread_mutex_lock(&bg_lock);
+	bg_running=0;
+	pthread_cond_signal(&bg_cond);
+	pthread_mutex_unlock(&bg_lock);
+	pthread_join(bg_thread, NULL);
+}
+
+long
+ms_since(struct timespec* then, struct timespec* now)
+{
+	return((now->tv_sec-then->tv_sec)*1000+(now->tv_nsec-then->tv_nsec)/1000000);
+}
+
+// write out the buffer, caller holds w->lock
+int
+writer_flush_locked(logwriter_t* w)
+{
+	int done=0;
+	int ret;
+
+	if (w->used==0 || w->fd<0)
+		return(0);
+	if (w->prealloc && w->size+w->used>w->alloc_end)
+	{
+		while (w->alloc_end<w->size+w->used)
+			w->alloc_end+=w->prealloc;
+		// KEEP_SIZE leaves the file length alone, so tail only sees real rows
+		fallocate(w->fd, FALLOC_FL_KEEP_SIZE, w->size, w->alloc_end-w->size);
+		w->n_alloc++;
+	}
+	while (done<w->used)
+	{
+		ret=write(w->fd, w->buf+done, w->used-done);
+		w->n_write++;
+		if (ret<0)
+		{
+			if (errno==EINTR)
+				continue;
+			fprintf(stderr, "Error writing log: %s\n", strerror(errno));
+			break;
+		}
+		done+=ret;
+	}
+	w->size+=done;
+	w->used=0;
+	w->pending_rows=0;
+	w->dirty=1;
+	return(0);
+}
+
+// timer thread for the flush_ms and sync_ms windows
+void*
+writer_timer(void* arg)
+{
+	logwriter_t* w=(logwriter_t*)arg;
+	struct timespec now;
+	struct timespec wake;
+	struct timespec due;
+	int tick;
+	int fd;
+
+	tick=w->flush_ms;
+	if (w->sync_ms && (tick==0 || w->sync_ms<tick))
+		tick=w->sync_ms;
+	pthread_mutex_lock(&w->lock);
+	while (w->timer_running)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &wake);
+		wake.tv_sec+=tick/1000;
+		wake.tv_nsec+=(tick%1000)*1000000L;
+		if (wake.tv_nsec>=1000000000L)
+		{
+			wake.tv_sec++;
+			wake.tv_nsec-=1000000000L;
+		}
+		// wake when the oldest buffered row is due, rather than up to a
+		// whole tick after it
+		if (w->flush_ms && w->pending_rows)
+		{
+			due=w->first_pending;
+			due.tv_sec+=w->flush_ms/1000;
+			due.tv_nsec+=(w->flush_ms%1000)*1000000L;
+			if (due.tv_nsec>=1000000000L)
+			{
+				due.tv_sec++;
+				due.tv_nsec-=1000000000L;
+			}
+			if (due.tv_sec<wake.tv_sec || (due.tv_sec==wake.tv_sec && due.tv_nsec<wake.tv_nsec))
+				wake=due;
+		}
+		pthread_cond_timedwait(&w->cond, &w->lock, &wake);
+		if (!w->timer_running)
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (w->flush_ms && w->pending_rows && ms_since(&w->first_pending, &now)>=w->flush_ms)
+			writer_flush_locked(w);
+		if (w->sync_ms && w->dirty && w->fd>=0 && ms_since(&w->last_sync, &now)>=w->sync_ms)
+		{
+			// sync a duplicate without the lock held, so rows can still be appended meanwhile
+			fd=dup(w->fd);
+			w->dirty=0;
+			w->last_sync=now;
+			w->n_sync++;
+			pthread_mutex_unlock(&w->lock);
+			fdatasync(fd);
+			close(fd);
+			pthread_mutex_lock(&w->lock);
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+	return(NULL);
+}
+
+int
+writer_init(logwriter_t* w, int rows, int fl_ms, int sy_ms, long pre)
+{
+	pthread_condattr_t attr;
+	sigset_t set;
+	sigset_t oldset;
+
+	memset(w, 0, sizeof(logwriter_t));
+	w->fd=-1;
+	// with only flush_ms set the timer does the flushing, and rows wait
+	// until then unless the buffer fills first
+	if (rows>0)
+		w->flush_rows=rows;
+	else
+		w->flush_rows=fl_ms>0 ? WRITEBUF_SIZE : 1;
+	w->flush_ms=fl_ms;
+	w->sync_ms=sy_ms;
+	w->prealloc=pre;
+	w->buf=malloc(WRITEBUF_SIZE);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&w->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (w->flush_ms || w->sync_ms)
+	{
+		w->timer_running=1;
+		sigemptyset(&set);
+		sigaddset(&set, SIGINT);
+		sigaddset(&set, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &set, &oldset);
+		if (pthread_create(&w->timer, NULL, writer_timer, w)!=0)
+		{
+			fprintf(stderr, "Error starting log writer timer\n");
+			w->timer_running=0;
+		}
+		pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	}
+	return(0);
+}
+
+// start writing to a newly opened file
+void
+writer_attach(logwriter_t* w, int fd)
+{
+	pthread_mutex_lock(&w->lock);
+	w->fd=fd;
+	w->size=0;
+	w->alloc_end=0;
+	w->dirty=0;
+	clock_gettime(CLOCK_MONOTONIC, &w->last_sync);
+	pthread_mutex_unlock(&w->lock);
+}
+
+void
+writer_append(logwriter_t* w, const char* data, int len)
+{
+	pthread_mutex_lock(&w->lock);
+	if (w->used+len>WRITEBUF_SIZE)
+		writer_flush_locked(w);
+	if (w->pending_rows==0)
+		clock_gettime(CLOCK_MONOTONIC, &w->first_pending);
+	memcpy(w->buf+w->used, data, len);
+	w->used+=len;
+	w->pending_rows++;
+	w->rows++;
+	if (w->pending_rows>=w->flush_rows)
+		writer_flush_locked(w);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// write the header of a new file straight away, it is not a row and does
+// not count towards flush_rows
+void
+writer_header(logwriter_t* w, const char* data, int len)
+{
+	pthread_mutex_lock(&w->lock);
+	if (w->used+len>WRITEBUF_SIZE)
+		writer_flush_locked(w);
+	memcpy(w->buf+w->used, data, len);
+	w->used+=len;
+	writer_flush_locked(w);
+	pthread_mutex_unlock(&w->lock);
+}
+
+void
+writer_flush(logwriter_t* w)
+{
+	pthread_mutex_lock(&w->lock);
+	writer_flush_locked(w);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// flush, sync if syncing is configured, give back unused preallocation and close
+void
+writer_detach(logwriter_t* w)
+{
+	pthread_mutex_lock(&w->lock);
+	if (w->fd>=0)
+	{
+		writer_flush_locked(w);
+		if (w->prealloc)
+			ftruncate(w->fd, w->size);
+		if (w->sync_ms)
+		{
+			fdatasync(w->fd);
+			w->n_sync++;
+		}
+		close(w->fd);
+		w->fd=-1;
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+// write out what is buffered and fdatasync it, for a clean stop
+void
+writer_sync(logwriter_t* w)
+{
+	pthread_mutex_lock(&w->lock);
+	if (w->fd>=0)
+	{
+		writer_flush_locked(w);
+		fdatasync(w->fd);
+		w->n_sync++;
+		w->dirty=0;
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+void
+writer_destroy(logwriter_t* w)
+{
+	if (w->timer_running)
+	{
+		pthread_mutex_lock(&w->lock);
+		w->timer_running=0;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->timer, NULL);
+	}
+	writer_detach(w);
+	free(w->buf);
+	w->buf=NULL;
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+}
+
+// open a log file for the writer, as fopen(name, "w") would
+int
+writer_open_file(logwriter_t* w, const char* path)
+{
+	int fd;
+
+	fd=open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd<0)
+	{
+		fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+		return(-1);
+	}
+	writer_attach(w, fd);
+	return(0);
+}
+
+// split the log file name into directory, stem and extension
+void
+seglog_split_name(seglog_t* log)
+{
+	char* slash;
+	char* dot;
+	const char* base;
+
+	slash=strrchr(log->fname, '/');
+	if (slash)
+	{
+		snprintf(log->dir, FNAME_LEN, "%.*s", (int)(slash-log->fname+1), log->fname);
+		base=slash+1;
+	}
+	else
+	{
+		log->dir[0]=0;
+		base=log->fname;
+	}
+	snprintf(log->stem, FNAME_LEN, "%s", base);
+	dot=strrchr(log->stem, '.');
+	if (dot && dot!=log->stem)
+	{
+		snprintf(log->ext, FNAME_LEN, "%s", dot);
+		*dot=0;
+	}
+	else
+	{
+		log->ext[0]=0;
+	}
+}
+
+// path holds 2*FNAME_LEN, dir and name are each shorter than FNAME_LEN so it always fits
+void
+seglog_path(seglog_t* log, const char* name, char* path)
+{
+	snprintf(path, 2*FNAME_LEN, "%s%s", log->dir, name);
+}
+
+// rewrite the manifest, caller holds log->lock
+void
+seglog_write_manifest(seglog_t* log)
+{
+	char path[2*FNAME_LEN];
+	char tmp[2*FNAME_LEN+8];
+	FILE* fp;
+	segment_t* sg;
+	int i;
+
+	snprintf(path, sizeof(path), "%s.manifest", log->fname);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fp=fopen(tmp, "w");
+	if (fp==NULL)
+	{
+		fprintf(stderr, "Error writing manifest %s: %s\n", tmp, strerror(errno));
+		return;
+	}
+	fprintf(fp, "# seq,file,first_unix,last_unix,first_elapsed,last_elapsed,rows,state\n");
+	for (i=0; i<log->nsegs; i++)
+	{
+		sg=&log->segs[i];
+		fprintf(fp, "%d,%s,%ld,%ld,%d,%d,%ld,%s\n", sg->seq, sg->name,
+			(long)sg->first_time, (long)sg->last_time, sg->first_elapsed, sg->last_elapsed,
+			sg->rows, sg->closed ? "closed" : "open");
+	}
+	fclose(fp);
+	rename(tmp, path); // readers never see a half written manifest
+}
+
+// start <path>.idx for a .tsc file, see therm_tsc.h. The index only saves
+// readers decoding every block, so failing to write it is not fatal.
+void
+seglog_index_open(seglog_t* log, const char* path)
+{
+	char ipath[2*FNAME_LEN+8];
+	uint8_t hdr[TSC_INDEX_HEADER];
+
+	snprintf(ipath, sizeof(ipath), "%s.idx", path);
+	log->idx_fd=open(ipath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (log->idx_fd<0)
+	{
+		fprintf(stderr, "Error creating index %s: %s\n", ipath, strerror(errno));
+		return;
+	}
+	if (write(log->idx_fd, hdr, tsc_index_header(hdr, log->enc.ncols))!=TSC_INDEX_HEADER)
+	{
+		close(log->idx_fd);
+		log->idx_fd=-1;
+	}
+}
+
+void
+seglog_index_close(seglog_t* log)
+{
+	if (log->idx_fd>=0)
+		close(log->idx_fd);
+	log->idx_fd=-1;
+}
+
+void
+seglog_index_remove(const char* path)
+{
+	char ipath[2*FNAME_LEN+8];
+
+	snprintf(ipath, sizeof(ipath), "%s.idx", path);
+	unlink(ipath);
+}
+
+// remove the segments listed in an old manifest, the same way fopen(.., "w")
+// would have truncated an unsegmented log
+void
+seglog_remove_old(seglog_t* log)
+{
+	char path[2*FNAME_LEN];
+	char line[LINE_LEN];
+	char name[FNAME_LEN];
+	FILE* fp;
+	int seq;
+
+	snprintf(path, sizeof(path), "%s.manifest", log->fname);
+	fp=fopen(path, "r");
+	if (fp==NULL)
+		return;
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "%d,%127[^,]", &seq, name)==2 && strchr(name, '/')==NULL)
+		{
+			seglog_path(log, name, path);
+			unlink(path);
+			if (log->codec)
+				seglog_index_remove(path);
+		}
+	}
+	fclose(fp);
+}
+
+// start writing segment number next_seq
+int
+seglog_new_segment(seglog_t* log)
+{
+	char path[2*FNAME_LEN];
+	char link[2*FNAME_LEN+8];
+	segment_t* sg;
+
+	pthread_mutex_lock(&log->lock);
+	if (log->nsegs==log->maxsegs)
+	{
+		log->maxsegs=log->maxsegs ? 2*log->maxsegs : 16;
+		log->segs=realloc(log->segs, log->maxsegs*sizeof(segment_t));
+	}
+	sg=&log->segs[log->nsegs];
+	memset(sg, 0, sizeof(segment_t));
+	sg->seq=log->next_seq++;
+	// leave room for the .gz added when it is compressed
+	if (snprintf(sg->name, FNAME_LEN, "%s-%06d%s", log->stem, sg->seq, log->ext)>=FNAME_LEN-3)
+	{
+		fprintf(stderr, "Segment name for %s is too long\n", log->fname);
+		pthread_mutex_unlock(&log->lock);
+		return(-1);
+	}
+	seglog_path(log, sg->name, path);
+	if (writer_open_file(&log->w, path)!=0)
+	{
+		pthread_mutex_unlock(&log->lock);
+		return(-1);
+	}
+	if (log->codec)
+		seglog_index_open(log, path);
+	log->nsegs++;
+	log->bytes=strlen(log->header);
+	if (log->bytes)
+	{
+		writer_header(&log->w, log->header, log->bytes);
+	}
+
+	// point the plain file name at the live segment, so tail and downloads keep working
+	snprintf(link, sizeof(link), "%s.lnk", log->fname);
+	unlink(link);
+	if (symlink(sg->name, link)==0)
+		rename(link, log->fname);
+	seglog_write_manifest(log);
+	pthread_mutex_unlock(&log->lock);
+	return(0);
+}
+
+// what the background thread should do with a closed segment
+typedef struct finish_job_s
+{
+	seglog_t* log;
+	int seq;
+	int compress;
+} finish_job_t;
+
+/******************************************************************************
+ * function: seglog_finish_segment(void* arg)
+ * introduction: background job run after a segment is closed.
+ * Compresses the segment (if asked to) and then applies the retention limits.
+ * parameters: arg is a malloc'd finish_job_t
+ ******************************************************************************/
+void
+seglog_finish_segment(void* arg)
+{
+	finish_job_t* job=(finish_job_t*)arg;
+	seglog_t* log=job->log;
+	int seq=job->seq;
+	int compress=job->compress;
+	char path[2*FNAME_LEN];
+	char* gz_argv[4];
+	pid_t pid;
+	int status;
+	int i;
+	time_t newest;
+	extern char** environ;
+
+	free(arg);
+	if (compress)
+	{
+		pthread_mutex_lock(&log->lock);
+		path[0]=0;
+		for (i=0; i<log->nsegs; i++)
+		{
+			if (log->segs[i].seq==seq)
+				seglog_path(log, log->segs[i].name, path);
+		}
+		pthread_mutex_unlock(&log->lock);
+
+		gz_argv[0]="gzip";
+		gz_argv[1]="-f";
+		gz_argv[2]=path;
+		gz_argv[3]=NULL;
+		if (path[0] && posix_spawnp(&pid, "gzip", NULL, NULL, gz_argv, environ)==0
+			&& waitpid(pid, &status, 0)==pid && WIFEXITED(status) && WEXITSTATUS(status)==0)
+		{
+			pthread_mutex_lock(&log->lock);
+			for (i=0; i<log->nsegs; i++)
+			{
+				if (log->segs[i].seq==seq)
+					strncat(log->segs[i].name, ".gz", FNAME_LEN-strlen(log->segs[i].name)-1);
+			}
+			seglog_write_manifest(log);
+			pthread_mutex_unlock(&log->lock);
+		}
+		else
+		{
+			fprintf(stderr, "Error compressing %s\n", path);
+		}
+	}
+
+	// retention, the live segment is never removed. Ages count back from the
+	// newest row, so they follow the rows' clock under --speed too
+	pthread_mutex_lock(&log->lock);
+	newest=0;
+	for (i=0; i<log->nsegs; i++)
+	{
+		if (log->segs[i].rows>0 && log->segs[i].last_time>newest)
+			newest=log->segs[i].last_time;
+	}
+	while (log->nsegs>1 && log->segs[0].closed
+		&& ((retain_segments && log->nsegs>retain_segments)
+			|| (retain_age && log->segs[0].last_time<newest-retain_age)))
+	{
+		seglog_path(log, log->segs[0].name, path);
+		unlink(path);
+		if (log->codec)
+			seglog_index_remove(path);
+		memmove(&log->segs[0], &log->segs[1], (log->nsegs-1)*sizeof(segment_t));
+		log->nsegs--;
+	}
+	seglog_write_manifest(log);
+	pthread_mutex_unlock(&log->lock);
+}
+
+// append the .tsc block being built to the log, and its summary to the index
+void
+seglog_seal_block(seglog_t* log)
+{
+	uint8_t entry[TSC_INDEX_RECORD(TSC_MAX_COLS)];
+	int n;
+
+	if (log->enc.nrows>0 && log->idx_fd>=0)
+	{
+		// written straight away while the block may still sit in the writer's
+		// buffer, readers ignore entries that point past the end of the data
+		n=tsc_index_entry(&log->enc, log->bytes, entry);
+		if (write(log->idx_fd, entry, n)!=n)
+			seglog_index_close(log);
+	}
+	n=tsc_seal(&log->enc, log->blockbuf);
+	if (n>0)
+	{
+		writer_append(&log->w, (char*)log->blockbuf, n);
+		log->bytes+=n;
+	}
+}
+
+// close the live segment and hand it over to the background thread
+void
+seglog_close_segment(seglog_t* log, int compress)
+{
+	finish_job_t* job;
+
+	if (log->codec)
+	{
+		seglog_seal_block(log); // a block never spans two segments
+		seglog_index_close(log);
+		compress=0;             // and gzip would gain next to nothing
+	}
+	writer_detach(&log->w);
+	pthread_mutex_lock(&log->lock);
+	log->segs[log->nsegs-1].closed=1;
+	seglog_write_manifest(log);
+	job=malloc(sizeof(finish_job_t));
+	job->log=log;
+	job->seq=log->segs[log->nsegs-1].seq;
+	job->compress=compress;
+	pthread_mutex_unlock(&log->lock);
+	bg_submit(seglog_finish_segment, job);
+}
+
+int
+seglog_open(seglog_t* log, const char* fname, const char* header)
+{
+	int len=strlen(fname);
+	int rows;
+	char path[FNAME_LEN+16];
+	struct stat st;
+
+	memset(log, 0, sizeof(seglog_t));
+	log->idx_fd=-1;
+	snprintf(log->fname, FNAME_LEN, "%s", fname);
+	snprintf(log->header, LINE_LEN, "%s", header);
+	log->segmented=(segment_size>0 || segment_time>0);
+	log->codec=(len>4 && strcmp(fname+len-4, ".tsc")==0);
+	if (log->codec)
+	{
+		// blocks are self describing, there is no header line, and a block
+		// has to fit in the writer's buffer
+		log->header[0]=0;
+		while (block_rows>1 && tsc_block_max(nboards, block_rows)>WRITEBUF_SIZE)
+			block_rows/=2;
+		// the group commit settings apply to the rows, which wait in the
+		// encoder, so they limit the block here and the writer writes each one
+		rows=block_rows<1 ? 1 : block_rows;
+		if (flush_rows>0 && flush_rows<rows)
+			rows=flush_rows;
+		log->seal_ms=flush_ms;
+		if (sync_ms && (log->seal_ms==0 || sync_ms<log->seal_ms))
+			log->seal_ms=sync_ms;
+		if (tsc_encoder_init(&log->enc, nboards, rows)!=0
+			|| (log->blockbuf=malloc(tsc_block_max(nboards, log->enc.maxrows)))==NULL)
+		{
+			fprintf(stderr, "Error setting up the .tsc encoder\n");
+			return(-1);
+		}
+		log->enc.align=block_align;
+	}
+	writer_init(&log->w, log->codec ? 1 : flush_rows, flush_ms, sync_ms, prealloc);
+	log->is_open=1;
+	if (!log->segmented)
+	{
+		// an earlier segmented log leaves fname as a symlink to its last
+		// segment, which must not be truncated, and a manifest that no
+		// longer describes fname
+		if (lstat(fname, &st)==0 && S_ISLNK(st.st_mode))
+			unlink(fname);
+		snprintf(path, sizeof(path), "%s.manifest", fname);
+		unlink(path);
+		if (writer_open_file(&log->w, fname)!=0)
+			return(-1);
+		if (log->codec)
+		{
+			seglog_index_open(log, fname);
+		}
+		else
+		{
+			writer_header(&log->w, log->header, strlen(log->header));
+		}
+		return(0);
+	}
+	pthread_mutex_init(&log->lock, NULL);
+	seglog_split_name(log);
+	seglog_remove_old(log);
+	log->next_seq=1;
+	if (!bg_running && bg_start()!=0)
+		return(-1);
+	return(seglog_new_segment(log));
+}
+
+// add a row to a .tsc log, the block goes to the writer once it is full
+// or the row starts a new block_align interval
+void
+seglog_add_row(seglog_t* log, sample_t* s)
+{
+	if (tsc_due(&log->enc, s->t))
+		seglog_seal_block(log);
+	if (tsc_add(&log->enc, s->t, s->elapsed, s->temp10))
+		seglog_seal_block(log);
+}
+
+// called every tick at time t, seals the .tsc block if its first row would
+// otherwise wait past seal_ms for the next tick
+void
+seglog_tick(seglog_t* log, time_t t)
+{
+	if (log->seal_ms && log->enc.nrows>0 && (t+1-log->enc.first_t)*1000>log->seal_ms)
+		seglog_seal_block(log);
+}
+
+// append one row (line for CSV, s for .tsc), rolling over to a new segment first if it is due
+int
+seglog_write(seglog_t* log, sample_t* s, const char* line, int len)
+{
+	segment_t* sg;
+	struct timespec now;
+	time_t t=s->t;
+	int elapsed=s->elapsed;
+	long pending=log->codec ? (log->enc.nrows ? tsc_block_bytes(&log->enc) : 0) : len;
+
+	if (!log->segmented)
+	{
+		if (log->codec)
+			seglog_add_row(log, s);
+		else
+			writer_append(&log->w, line, len);
+		return(0);
+	}
+	sg=&log->segs[log->nsegs-1];
+	if (sg->rows>0 && ((segment_size && log->bytes+pending>segment_size)
+		|| (segment_time && t/segment_time!=sg->first_time/segment_time)))
+	{
+		seglog_close_segment(log, compress_segments);
+		if (seglog_new_segment(log)!=0)
+			return(-1);
+	}
+	if (log->codec)
+	{
+		seglog_add_row(log, s);
+	}
+	else
+	{
+		writer_append(&log->w, line, len);
+		log->bytes+=len;
+	}
+
+	pthread_mutex_lock(&log->lock);
+	sg=&log->segs[log->nsegs-1];
+	if (sg->rows==0)
+	{
+		sg->first_time=t;
+		sg->first_elapsed=elapsed;
+	}
+	sg->last_time=t;
+	sg->last_elapsed=elapsed;
+	sg->rows++;
+	// readers find the live segment's rows and times only in the manifest,
+	// so it follows the segment as it fills, but not on every row
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (sg->rows==1 || ms_since(&log->manifest_at, &now)>=MANIFEST_MS)
+	{
+		seglog_write_manifest(log);
+		log->manifest_at=now;
+	}
+	pthread_mutex_unlock(&log->lock);
+	return(0);
+}
+
+// free a closed log, queued behind its segments' finish jobs
+void
+seglog_free(void* arg)
+{
+	seglog_t* log=(seglog_t*)arg;
+
+	free(log->segs);
+	if (log->codec)
+	{
+		tsc_encoder_free(&log->enc);
+		free(log->blockbuf);
+	}
+	if (log->segmented)
+		pthread_mutex_destroy(&log->lock);
+	if (log->bg_close)
+	{
+		pthread_mutex_lock(&bg_lock);
+		logs_closing--;
+		pthread_cond_broadcast(&log_closed);
+		pthread_mutex_unlock(&bg_lock);
+	}
+	free(log);
+}
+
+// close the log and free it, once its segments are finished with
+void
+seglog_close(seglog_t* log)
+{
+	if (log->is_open)
+	{
+		log->is_open=0;
+		if (log->codec)
+		{
+			seglog_seal_block(log);
+			if (!log->segmented)
+				seglog_index_close(log);
+		}
+		writer_sync(&log->w);
+		// the last segment stays uncompressed, so the plain file name still
+		// points at a readable CSV for tail and downloads
+		if (log->segmented)
+			seglog_close_segment(log, 0);
+		writer_destroy(&log->w);
+	}
+	if (log->segmented)
+		bg_submit(seglog_free, log); // the finish jobs use segs
+	else
+		seglog_free(log);
+}
+
+// background job, so a stop or restart does not hold up the tick it arrives in
+void
+seglog_close_job(void* arg)
+{
+	seglog_close((seglog_t*)arg);
+}
+
+// hand the log to the background thread to close
+void
+seglog_close_later(seglog_t* log)
+{
+	if (!bg_running)
+		bg_start(); // runs here if it cannot be started
+	log->bg_close=1;
+	pthread_mutex_lock(&bg_lock);
+	logs_closing++;
+	pthread_mutex_unlock(&bg_lock);
+	bg_submit(seglog_close_job, log);
+}
+
+// wait for the logs being closed in the background, only needed before
+// writing to the same file again
+void
+seglog_wait_closed(void)
+{
+	pthread_mutex_lock(&bg_lock);
+	while (bg_running && logs_closing>0)
+		pthread_cond_wait(&log_closed, &bg_lock);
+	pthread_mutex_unlock(&bg_lock);
+}
+
+/******************************************************************************
+ * Shared memory publication (--shm). The layout and the seqlock protocol are
+ * in therm_shm.h, the latest slot is updated every tick and the ring gets
+ * every logged row.
+ ******************************************************************************/
+// pid of a running logger that published name, 0 if there is none. The
+// pidfile lock does not cover simulated boards, so this is what keeps two
+// loggers from writing the same segment
+int
+shm_owner(const char* name)
+{
+	therm_shm_t hdr;
+	int fd;
+	int n;
+
+	fd=shm_open(name, O_RDONLY, 0);
+	if (fd<0)
+		return(0);
+	n=pread(fd, &hdr, sizeof(hdr), 0);
+	close(fd);
+	if (n!=sizeof(hdr) || hdr.magic!=THERM_SHM_MAGIC || hdr.pid==0 || hdr.pid==(uint32_t)getpid())
+		return(0);
+	if (kill(hdr.pid, 0)<0 && errno==ESRCH)
+		return(0);
+	return(hdr.pid);
+}
+
+int
+shm_publish_open(const char* name, int ring_size)
+{
+	int fd;
+	int owner;
+	size_t size=therm_shm_size(ring_size);
+
+	// a segment left by a logger that is gone is replaced, one that is
+	// still being written is not, and neither is one created meanwhile
+	fd=shm_open(name, O_CREAT|O_EXCL|O_RDWR, 0644);
+	if (fd<0 && errno==EEXIST)
+	{
+		owner=shm_owner(name);
+		if (owner)
+		{
+			fprintf(stderr, "Error: shared memory %s is published by pid %d\n", name, owner);
+			return(-1);
+		}
+		shm_unlink(name);
+		fd=shm_open(name, O_CREAT|O_EXCL|O_RDWR, 0644);
+	}
+	if (fd<0)
+	{
+		fprintf(stderr, "Error creating shared memory %s: %s\n", name, strerror(errno));
+		return(-1);
+	}
+	if (ftruncate(fd, size)<0)
+	{
+		fprintf(stderr, "Error sizing shared memory %s: %s\n", name, strerror(errno));
+		close(fd);
+		return(-1);
+	}
+	shm=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm==MAP_FAILED)
+	{
+		fprintf(stderr, "Error mapping shared memory %s: %s\n", name, strerror(errno));
+		shm=NULL;
+		return(-1);
+	}
+	memset(shm, 0, size);
+	shm->ring_size=ring_size;
+	shm->slot_size=sizeof(therm_shm_slot_t);
+	shm->version=THERM_SHM_VERSION;
+	shm->pid=getpid();
+	__atomic_store_n(&shm->magic, THERM_SHM_MAGIC, __ATOMIC_RELEASE); // readers check this last
+	return(0);
+}
+
+void
+shm_fill_slot(therm_shm_slot_t* slot, time_t t, int elapsed)
+{
+	int i;
+
+	memset(slot, 0, sizeof(therm_shm_slot_t));
+	slot->t=t;
+	slot->elapsed=elapsed;
+	slot->nboards=nboards<THERM_SHM_BOARDS ? nboards : THERM_SHM_BOARDS;
+	for (i=0; i<slot->nboards; i++)
+		slot->temp10[i]=boards[i].t10;
+}
+
+// every tick
+void
+shm_publish_latest(time_t t, int elapsed)
+{
+	therm_shm_slot_t slot;
+
+	shm_fill_slot(&slot, t, elapsed);
+	slot.index=shm->latest.index+1;
+	therm_shm_put(&shm->latest, &slot);
+}
+
+// every logged row
+void
+shm_publish_row(time_t t, int elapsed)
+{
+	therm_shm_slot_t slot;
+	uint64_t head=shm->head;
+
+	shm_fill_slot(&slot, t, elapsed);
+	slot.index=head;
+	therm_shm_put(&shm->ring[head%shm->ring_size], &slot);
+	__atomic_store_n(&shm->head, head+1, __ATOMIC_RELEASE);
+}
+
+void
+shm_publish_close(const char* name)
+{
+	shm->pid=0;
+	munmap(shm, therm_shm_size(shm->ring_size));
+	shm=NULL;
+	shm_unlink(name);
+}
+
+// open fname as the log, the first line holds one temperature column per board
+int
+log_open(const char* fname)
+{
+	char line[LINE_LEN];
+	int len;
+	int i;
+
+	len=sprintf(line, "Time HH:MM:SS,Elapsed Sec,Temp C");
+	for (i=1; i<nboards; i++)
+	{
+		len+=snprintf(line+len, LINE_LEN-len, ",Temp C %s", boards[i].ads_dev);
+		if (len>LINE_LEN-2)
+			len=LINE_LEN-2; // cut short, still room for the newline
+	}
+	snprintf(line+len, LINE_LEN-len, "\n");
+	tlog=malloc(sizeof(seglog_t));
+	if (tlog==NULL)
+		return(-1);
+	if (seglog_open(tlog, fname, line)!=0)
+	{
+		if (tlog->is_open)
+			writer_destroy(&tlog->w);
+		seglog_free(tlog);
+		tlog=NULL;
+		return(-1);
+	}
+	snprintf(log_fname, FNAME_LEN, "%s", fname);
+	return(0);
+}
+
+/******************************************************************************
+ * function: parse_options(int argc, char* argv[])
+ * introduction: pull the --name=value options out of argv, leaving the
+ * positional arguments in place so the syntax in the header still works.
+ * return value: the new argc, or -1 on a bad option
+ ******************************************************************************/
+int
+parse_options(int argc, char* argv[])
+{
+	int i;
+	int n=1;
+
+	for (i=1; i<argc; i++)
+	{
+		if (strncmp(argv[i], "--board=", 8)==0)
+		{
+			if (board_add(argv[i]+8)!=0)
+				return(-1);
+		}
+		else if (strncmp(argv[i], "--segment-size=", 15)==0)
+		{
+			segment_size=atol(argv[i]+15);
+		}
+		else if (strncmp(argv[i], "--segment-time=", 15)==0)
+		{
+			segment_time=atol(argv[i]+15);
+		}
+		else if (strncmp(argv[i], "--retain-segments=", 18)==0)
+		{
+			retain_segments=atoi(argv[i]+18);
+		}
+		else if (strncmp(argv[i], "--retain-age=", 13)==0)
+		{
+			retain_age=atol(argv[i]+13);
+		}
+		else if (strncmp(argv[i], "--compress=", 11)==0)
+		{
+			compress_segments=atoi(argv[i]+11);
+		}
+		else if (strncmp(argv[i], "--flush-rows=", 13)==0)
+		{
+			flush_rows=atoi(argv[i]+13);
+		}
+		else if (strncmp(argv[i], "--flush-ms=", 11)==0)
+		{
+			flush_ms=atoi(argv[i]+11);
+		}
+		else if (strncmp(argv[i], "--sync-ms=", 10)==0)
+		{
+			sync_ms=atoi(argv[i]+10);
+		}
+		else if (strncmp(argv[i], "--block-rows=", 13)==0)
+		{
+			block_rows=atoi(argv[i]+13);
+		}
+		else if (strncmp(argv[i], "--block-align=", 14)==0)
+		{
+			block_align=atoi(argv[i]+14);
+		}
+		else if (strncmp(argv[i], "--speed=", 8)==0)
+		{
+			sim_speed=atof(argv[i]+8);
+		}
+		else if (strncmp(argv[i], "--duration=", 11)==0)
+		{
+			run_seconds=atol(argv[i]+11);
+		}
+		else if (strncmp(argv[i], "--prealloc=", 11)==0)
+		{
+			prealloc=atol(argv[i]+11);
+		}
+		else if (strncmp(argv[i], "--http=", 7)==0)
+		{
+			http_port=atoi(argv[i]+7);
+		}
+		else if (strncmp(argv[i], "--http-bind=", 12)==0)
+		{
+			snprintf(http_bind, sizeof(http_bind), "%s", argv[i]+12);
+		}
+		else if (strcmp(argv[i], "--shm")==0)
+		{
+			strcpy(shm_name, THERM_SHM_NAME);
+		}
+		else if (strncmp(argv[i], "--shm=", 6)==0)
+		{
+			snprintf(shm_name, FNAME_LEN, "%s%s", argv[i][6]=='/' ? "" : "/", argv[i]+6);
+		}
+		else if (strncmp(argv[i], "--shm-ring=", 11)==0)
+		{
+			shm_ring=atoi(argv[i]+11);
+			if (shm_ring<1)
+				shm_ring=1;
+		}
+		else if (strncmp(argv[i], "--trigger=", 10)==0)
+		{
+			if (trigger_add(argv[i]+10)!=0)
+				return(-1);
+		}
+		else if (strncmp(argv[i], "--trig-rate=", 12)==0)
+		{
+			trig_rate=atoi(argv[i]+12);
+		}
+		else if (strncmp(argv[i], "--pre-trigger=", 14)==0)
+		{
+			pre_trigger=atol(argv[i]+14);
+		}
+		else if (strncmp(argv[i], "--post-trigger=", 15)==0)
+		{
+			post_trigger=atol(argv[i]+15);
+		}
+		else if (strncmp(argv[i], "--capture-dir=", 14)==0)
+		{
+			// leave room for /capture-<date>-<time>-<ms>-b<board>.csv
+			if (strlen(argv[i]+14)>FNAME_LEN-CAPTURE_NAME_LEN)
+			{
+				fprintf(stderr, "--capture-dir is too long, at most %d characters\n", FNAME_LEN-CAPTURE_NAME_LEN);
+				return(-1);
+			}
+			snprintf(capture_dir, FNAME_LEN, "%s", argv[i]+14);
+		}
+		else if (strncmp(argv[i], "--pidfile=", 10)==0)
+		{
+			snprintf(pidfile, FNAME_LEN, "%s", argv[i]+10);
+			pidfile_set=1;
+		}
+		else if (strcmp(argv[i], "--control")==0)
+		{
+			strcpy(ctl_path, "/var/run/therm.sock");
+		}
+		else if (strncmp(argv[i], "--control=", 10)==0)
+		{
+			snprintf(ctl_path, FNAME_LEN, "%s", argv[i]+10);
+		}
+		else if (strncmp(argv[i], "--control-group=", 16)==0)
+		{
+			snprintf(ctl_group, FNAME_LEN, "%s", argv[i]+16);
+		}
+		else if (strncmp(argv[i], "--log-dir=", 10)==0)
+		{
+			snprintf(log_dir, FNAME_LEN, "%s", argv[i]+10);
+		}
+		else if (strncmp(argv[i], "--http-buffer=", 14)==0)
+		{
+			sample_buffer=atol(argv[i]+14);
+			if (sample_buffer<1)
+				sample_buffer=1;
+		}
+		else if (strncmp(argv[i], "--", 2)==0)
+		{
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return(-1);
+		}
+		else
+		{
+			argv[n++]=argv[i];
+		}
+	}
+	argv[n]=NULL;
+	return(n);
+}
+
+void sig_handler(int signo)
+{
+  not_finished=0;
+}
+
+int
+main(int argc, char* argv[])
+{
+	int ret;
+	int i;
+	int k;
+	double tval;
+	int repeat=0;
+	int period=1;
+	char fname[128];
+	char tstring[128];
+	char tstring2[128];
+	char line[LINE_LEN];
+	int len;
+	timecache_t tcache;
+	sample_t sample;
+#if TELEMETRY
+	struct timespec t_wake;
+#endif
+	char default_spec[2*DEVNAME_LEN];
+	time_t mytime;
+	time_t desiredtime;
+	struct timespec tstime;
+	struct timespec sim_t0;
+	struct timespec sim_t1;
+	long ticks_run=0;
+	int elapsed=0;
+	int showtime=0;
+	int use_gpio=0;
+	
+	memset(&tcache, 0, sizeof(tcache));
+	// parse options and set up the board list
+	argc=parse_options(argc, argv);
+	if (argc<0)
+	{
+		printf("Exiting\n");
+		exit(1);
+	}
+	if (argc>1 && strcmp(argv[1], "bench-writer")==0) // group commit benchmark, needs no hardware
+	{
+		bench_writer(argc>2 ? argv[2] : "bench.csv", argc>3 ? atol(argv[3]) : 200000);
+		exit(0);
+	}
+	if (argc>1 && strcmp(argv[1], "bench-format")==0) // row formatting benchmark
+	{
+		bench_format(argc>2 ? atol(argv[2]) : 1000000);
+		exit(0);
+	}
+	if (argc>1 && strcmp(argv[1], "bench-codec")==0) // log codec benchmark
+	{
+		bench_codec(argc>2 ? argv[2] : ".", argc>3 ? atol(argv[3]) : 86400*7);
+		exit(0);
+	}
+	if (argc>1 && strcmp(argv[1], "bench-e2e")==0 && nboards==0) // end to end throughput
+	{
+		argv=bench_e2e_setup(argc, argv);
+		argc=3;
+	}
+	if (nboards==0)
+	{
+		sprintf(default_spec, "%s,lcd=%s", default_ads_dev, default_lcd_dev);
+		board_add(default_spec);
+	}
+
+	// virtual time for a replay, or for simulated boards at another speed
+	for (i=0, ret=0; i<nboards; i++)
+		ret|=(boards[i].replay!=NULL);
+	if (ret || sim_speed!=1)
+	{
+		for (i=0; i<nboards && boards[i].sim; i++)
+			;
+		if (i<nboards || sim_speed<0)
+		{
+			fprintf(stderr, "--speed and replay= need every board simulated, and a speed of 0 or more\n");
+			exit(1);
+		}
+		sim_clock=1;
+		sim_start=time(NULL);
+		for (i=0; i<nboards; i++)
+		{
+			// start at the recording's first second
+			for (k=0; boards[i].replay && k<2; k++)
+			{
+				if (boards[i].replay->n[k] && boards[i].replay->ns[k][0]/1000000000LL<sim_start)
+					sim_start=boards[i].replay->ns[k][0]/1000000000LL;
+			}
+		}
+		sim_ns=(int64_t)sim_start*1000000000LL;
+	}
+	
+	// initialise GPIO
+	for (i=0; i<nboards; i++)
+	{
+		if (boards[i].sim==0 && boards[i].lcd_dev[0])
+			use_gpio=1;
+	}
+	if (use_gpio)
+	{
+		setup_io();
+		for (i=0; i<nboards; i++)
+		{
+			if (boards[i].sim==0 && boards[i].lcd_dev[0])
+			{
+				INP_GPIO(boards[i].lcd_rs_gpio); // must use INP_GPIO before we can use OUT_GPIO
+			  OUT_GPIO(boards[i].lcd_rs_gpio);
+			}
+		}
+	}
+	
+	// parse inputs
+	dofile=0;
+	if (argc>2)
+	{
+		if (strcmp(argv[1], "msg")==0) // print to the lcd
+		{
+			ret=board_open_lcd(&boards[0]);
+			if (ret!=0)
+			{
+				printf("Exiting\n");
+			exit(1);
+			}
+			lcd_display_string(&boards[0], 0,argv[2]);
+			board_close(&boards[0]);
+			exit(0);
 		}
 	}
 	if (argc>1)
 	{
 		if (strcmp(argv[1], "-h")==0) // print help
 		{
-			printf("%s [sec] [filename]\n", argv[0]);
+			printf("%s [--board=<spec>]... [sec] [filename]\n", argv[0]);
 			printf("%s msg <message in quotes>\n", argv[0]);
+			printf("board spec: <ads device>[,lcd=<lcd device>][,rs=<gpio>][,record=<file>]\n");
+			printf("            or sim[:<bus>.<cs>][,replay=<file>][,lcd=<file>][,record=<file>]\n");
+			printf("simulation options: --speed=<x> (0 = flat out) --duration=<sec>\n");
+			printf("log options: --segment-size=<bytes> --segment-time=<sec> --retain-segments=<n> --retain-age=<sec> --compress=0|1\n");
+			printf("             --flush-rows=<n> --flush-ms=<ms> --sync-ms=<ms> --prealloc=<bytes> --block-rows=<n> --block-align=<sec> (.tsc)\n");
+			printf("server options: --http=<port> --http-bind=<addr> --http-buffer=<samples> --shm[=<name>] --shm-ring=<rows>\n");
+			printf("control options: --control[=<socket>] --control-group=<group> --log-dir=<dir> --pidfile=<file>\n");
+			printf("trigger options: --trigger=<spec>... --trig-rate=<readings/s> --pre-trigger=<ms> --post-trigger=<ms> --capture-dir=<dir>\n");
+			printf("trigger spec: above=<C>|below=<C>|rate=<C/s>|window=<lo>:<hi>[,board=<n>][,hyst=<C>][,span=<ms>]\n");
+			printf("              captures read at --trig-rate, but every 10 ms in the ~115 ms measurement after each tick\n");
+			printf("%s bench-writer <file> [rows]\n", argv[0]);
+			printf("%s bench-format [rows]\n", argv[0]);
+			printf("%s bench-codec <dir> [rows]\n", argv[0]);
+			printf("%s bench-e2e <dir> [seconds] [boards]\n", argv[0]);
 			exit(0);
 		}
 		if (strcmp(argv[1], "lcdinit")==0) // initialize the LCD display
 		{
-			spi_config=0;
-			ret=spi_open(&lcd_fd, 0, spi_config);
+			ret=board_open_lcd(&boards[0]);
 			if (ret!=0)
 			{
 				printf("Exiting\n");
 				exit(1);
 			}
-			lcd_init();
-			close(lcd_fd);
+			lcd_init(&boards[0]);
+			board_close(&boards[0]);
 			exit(0);
 		}
 		if (strcmp(argv[1], "withtime")==0)
@@ -786,16 +2870,14 @@ main(int argc, char* argv[])
 		{
 			if (strcmp(argv[2], "msg")==0) // print to the lcd
 			{
-				spi_config=0;
-				ret=spi_open(&lcd_fd, 0, spi_config);
+				ret=board_open_lcd(&boards[0]);
 				if (ret!=0)
 				{
 					printf("Exiting\n");
 					exit(1);
 				}
-				lcd_init();
-				lcd_display_string(0,argv[3]);
-				lcd_initialised=1;
+				lcd_init(&boards[0]);
+				lcd_display_string(&boards[0], 0,argv[3]);
 			}
 		}
 	}
@@ -807,133 +2889,262 @@ main(int argc, char* argv[])
 		{
 			if (strcmp(argv[3], "msg")==0) // print to the lcd
 			{
-				spi_config=0;
-				ret=spi_open(&lcd_fd, 0, spi_config);
+				ret=board_open_lcd(&boards[0]);
 				if (ret!=0)
 				{
 					printf("Exiting\n");
 					exit(1);
 				}
-				lcd_init();
-				lcd_display_string(0,argv[4]);
-				lcd_initialised=1;
+				lcd_init(&boards[0]);
+				lcd_display_string(&boards[0], 0,argv[4]);
 			}
 		}
 	}
 	
-	if (dofile)
+	// only one process may drive the SPI buses, simulated boards don't need the lock
+	for (i=0; i<nboards && boards[i].sim; i++)
+		;
+	if (repeat && (pidfile_set || i<nboards) && pidfile_lock()!=0)
+	{
+		printf("Exiting\n");
+		exit(1);
+	}
+	if (!repeat && i<nboards && (ret=pidfile_owner())!=0)
 	{
-		outfile=fopen(fname, "w");
+		fprintf(stderr, "therm is logging (pid %d), ask it for the latest reading instead\n", ret);
+		exit(1);
 	}
+	log_period=period;
 	
-	// open SPI for ADS1118
-	spi_config |= SPI_CPHA;
-	ret=spi_open(&ads_fd, 1, spi_config);
-	if (ret!=0) // SPI error
+	// open SPI for the ADS1118s
+	for (i=0; i<nboards; i++)
 	{
-		printf("Exiting\n");
-		exit(1);
+		ret=board_open_ads(&boards[i]);
+		if (ret!=0) // SPI error
+		{
+			printf("Exiting\n");
+			exit(1);
+		}
 	}
 
 	if (repeat==0)
 	{
 		// display a single measurement and exit
-		tval=get_measurement();
 		if (showtime)
 		{
-			mytime = time(NULL);
-			sprintf(tstring, "%d", mytime);
+			mytime = sim_clock ? sim_start : time(NULL);
+			sprintf(tstring, "%ld", (long)mytime);
 			unixtime2string(tstring, tstring2);
-			printf("%s %#.1f\n", tstring2, tval);
+			printf("%s", tstring2);
 		}
-		else
+		for (i=0; i<nboards; i++)
 		{
-			printf("%#.1f\n", tval);
+			tval=get_measurement(&boards[i]);
+			printf(showtime||i ? " %#.1f" : "%#.1f", tval);
+			board_close(&boards[i]);
 		}
-		close(ads_fd);
+		printf("\n");
 		exit(0);
 	}
 	
-	// open up SPI for LCD
-  spi_config=0;
-	ret=spi_open(&lcd_fd, 0, spi_config);
-	if (ret!=0)
+	// open up SPI for the LCDs
+	for (i=0; i<nboards; i++)
+	{
+		ret=board_open_lcd(&boards[i]);
+		if (ret!=0)
+		{
+			printf("Exiting\n");
+			exit(1);
+		}
+		if (boards[i].lcd_initialised==0)
+			lcd_init(&boards[i]);
+	}
+	
+	// line 1 of the output file (and of every segment) will contain the
+	// column descriptions, one temperature column per board
+	if (dofile && log_open(fname)!=0)
 	{
 		printf("Exiting\n");
 		exit(1);
 	}
-
-	if (lcd_initialised==0)
-		lcd_init();
 	
-	if (dofile)
+	if (ntriggers && (trig_init()!=0 || (!bg_running && bg_start()!=0)))
+	{
+		printf("Exiting\n");
+		exit(1);
+	}
+	workers_start();
+	if (http_port)
+	{
+		ring_init(&samples, sample_buffer);
+		if (http_start(http_port)!=0)
+		{
+			printf("Exiting\n");
+			exit(1);
+		}
+	}
+	if (shm_name[0] && shm_publish_open(shm_name, shm_ring)!=0)
+	{
+		printf("Exiting\n");
+		exit(1);
+	}
+	if (log_dir[0]==0)
+	{
+		// next to the log named on the command line
+		ret=dofile && strrchr(fname, '/') ? strrchr(fname, '/')-fname : 0;
+		snprintf(log_dir, FNAME_LEN, "%.*s", ret, fname);
+		if (ret==0)
+			strcpy(log_dir, dofile && fname[0]=='/' ? "/" : ".");
+	}
+	if (ctl_path[0] && ctl_start(ctl_path)!=0)
+	{
+		printf("Exiting\n");
+		exit(1);
+	}
+	if (bench_e2e && bench_stream_start(http_port)!=0)
 	{
-		// line 1 of the output file will contain the three column descriptions
-		fprintf(outfile, "Time HH:MM:SS,Elapsed Sec,Temp C\n");
+		printf("Exiting\n");
+		exit(1);
 	}
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
 	
+	if (sim_clock)
+	{
+		// virtual time starts straight away
+		mytime=sim_start;
+		tstime.tv_nsec=0;
+		clock_gettime(CLOCK_MONOTONIC, &sim_t0);
+	}
+	else
+	{
 	// Align on an integer number of seconds and get current time
   mytime = time(NULL);
   tstime.tv_sec=mytime+1;
   tstime.tv_nsec=0;
   clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &tstime, NULL);
   mytime++;
+	}
   desiredtime=mytime;
 
-	signal(SIGINT, sig_handler);
-	
 	while(not_finished)
 	{
-		tval=get_measurement();
-		for (i=1; i<10; i++)
+		if (sim_clock)
+			sim_tick_ns=(int64_t)mytime*1000000000LL;
+		// all buses sample the same tick
+		pthread_barrier_wait(&tick_start);
+		pthread_barrier_wait(&tick_done);
+		if (replay_ended)
+			break;
+		
+		TM_COUNT(ticks);
+		if (ctl_running)
 		{
-			delay_ms(10);
-			tval=tval+get_measurement_fast();
+			if (__atomic_load_n(&ctl_req, __ATOMIC_ACQUIRE))
+				ctl_apply(&period, &desiredtime, &elapsed, mytime);
+			ctl_set_latest(mytime, elapsed);
 		}
-		tval=tval/10;
-		
-		// print the time, elapsed counter and temperature
-		sprintf(tstring, "%d", mytime);
-		unixtime2string(tstring, tstring2);
+		if (shm)
+			shm_publish_latest(mytime, elapsed);
+		// print the time, elapsed counter and temperatures
 		if (mytime==desiredtime)
 		{
-			printf("%s %d %#.1f\n", tstring2, elapsed, tval);
+			TM_START(t_fmt);
+			len=format_row(&tcache, line, mytime, elapsed);
+			TM_END(STAGE_FORMAT, t_fmt);
+			TM_COUNT(samples);
+			sample.t=mytime;
+			sample.elapsed=elapsed;
+			sample.nboards=nboards;
+			for (i=0; i<nboards; i++)
+				sample.temp10[i]=boards[i].t10;
+			if (samples.s)
+			{
+				ring_push(&samples, &sample);
+				http_notify();
+			}
+			if (shm)
+				shm_publish_row(mytime, elapsed);
 			if (dofile)
 			{
-				fprintf(outfile, "%s,%d,%#.1f\n", tstring2, elapsed, tval);
-				fflush(outfile);
+				TM_START(t_wr);
+				seglog_write(tlog, &sample, line, len); // copies the row
+				TM_END(STAGE_WRITE, t_wr);
+				__atomic_fetch_add(&log_rows, 1, __ATOMIC_RELAXED);
+			}
+			for (i=0; i<len; i++)
+			{
+				if (line[i]==',')
+					line[i]=' ';
 			}
+			fwrite(line, 1, len, stdout);
 			desiredtime=desiredtime+period;
 		}
-		//sprintf(tstring, "%s %#.1f", tstring2, tval);
-		lcd_clear();
-        sprintf(tstring, "%7.1f", tval);
-		lcd_display_string(1, tstring);
+		if (dofile && tlog->codec)
+			seglog_tick(tlog, mytime);
 		// now we sleep for a certain time
 		mytime++;
 		tstime.tv_sec=mytime;
 		elapsed++;
-		clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &tstime, NULL);
+		if (run_seconds && ++ticks_run>=run_seconds)
+			not_finished=0;
+		if (sim_clock)
+		{
+			// paced by --speed instead of the wall clock, 0 = don't wait at all
+			if (sim_speed>0)
+			{
+				sim_t1=sim_t0;
+				sim_t1.tv_sec+=(time_t)((mytime-sim_start)/sim_speed);
+				sim_t1.tv_nsec+=(long)(fmod((mytime-sim_start)/sim_speed, 1.0)*1E9);
+				if (sim_t1.tv_nsec>=1000000000L)
+				{
+					sim_t1.tv_sec++;
+					sim_t1.tv_nsec-=1000000000L;
+				}
+				while (not_finished && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &sim_t1, NULL)==EINTR);
+			}
+			continue;
+		}
+#if TELEMETRY
+		clock_gettime(CLOCK_REALTIME, &t_wake);
+		if (t_wake.tv_sec>=mytime)
+			TM_COUNT(overruns);
+#endif
+		while (not_finished && clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &tstime, NULL)==EINTR);
+#if TELEMETRY
+		clock_gettime(CLOCK_REALTIME, &t_wake);
+		if (t_wake.tv_sec>=tstime.tv_sec)
+			stat_add(&telemetry.wakeup, (t_wake.tv_sec-tstime.tv_sec)*1000000000LL+t_wake.tv_nsec);
+#endif
 	}
 	
-  close(ads_fd);
-    
-  // LCD requires opposite clock polarity
-  spi_config=0;
-	ret=spi_open(&lcd_fd, 0, spi_config);
-	if (ret!=0)
+	if (replay_ended)
+		printf("end of recording\n");
+	else if (run_seconds && ticks_run>=run_seconds)
+		printf("ran for %ld seconds\n", ticks_run);
+	else
+		printf("received SIGINT\n");
+	if (bench_e2e)
+		bench_report(ticks_run, &sim_t0);
+	ctl_stop();
+	if (shm)
+		shm_publish_close(shm_name);
+	http_stop();
+	workers_stop();
+	if (dofile)
 	{
-		printf("Exiting\n");
-		exit(1);
+		seglog_close(tlog);
+		tlog=NULL;
 	}
-
-
-	lcd_init();
-	lcd_clear();					// LCD clear
-	lcd_display_string(0,"Hello");	// display "ADS1118"
-  
-  close(lcd_fd);
-  
-  return(0);
+	bg_stop(); // captures still being written
+	for (i=0; i<nboards; i++)
+	{
+		lcd_clear(&boards[i]);
+		lcd_display_string(&boards[i], 1,"Bye");
+		board_close(&boards[i]);
+	}
+	pidfile_release();
+	printf("Bye\n");
+	
+	return(0);
 }
-
@@ -0,0 +1,460 @@
+/**********************************************************************************************
+ * therm.h
+ * Definitions shared by the parts of therm: the board, sample and log types, the
+ * settings and state kept in therm.c, and the functions the other parts
+ * (therm_http.c, therm_trig.c, therm_ctl.c, therm_bench.c) call back into. See therm.c for the build line.
+ ************************************************************************************************/
+
+#ifndef THERM_H
+#define THERM_H
+
+#define _GNU_SOURCE // fallocate
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <linux/spi/spidev.h>
+#include <unistd.h> // sleep
+#include <time.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <grp.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <strings.h>
+#include "therm_shm.h"
+#include "therm_tsc.h"
+
+// definitions
+#define DBG_PRINT 0
+#ifndef TELEMETRY
+#define TELEMETRY 1 // build with -DTELEMETRY=0 to compile out the stage timers and /metrics
+#endif
+#define BCM2708_PERI_BASE        0x20000000
+#define GPIO_BASE                (BCM2708_PERI_BASE + 0x200000) /* GPIO controller */
+#define PAGE_SIZE (4*1024)
+#define BLOCK_SIZE (4*1024)
+
+#define ADS1118_TS			   (0x0010)    
+#define ADS1118_PULLUP     	   (0x0008)
+#define ADS1118_NOP     	   (0x0002)  
+#define ADS1118_CNVRDY     	   (0x0001)
+//Set the configuration to AIN0/AIN1, FS=+/-0.256, SS, DR=128sps, PULLUP on DOUT
+#define ADSCON_CH0		(0x8B8A)
+//Set the configuration to AIN2/AIN3, FS=+/-0.256, SS, DR=128sps, PULLUP on DOUT
+#define ADSCON_CH1		(0xBB8A)
+
+#define INTERNAL_SENSOR 0
+#define EXTERNAL_SIGNAL 1
+#define BUFSIZE 64
+#define LCD_RS_GPIO 17
+#define MAX_BOARDS 8
+#define DEVNAME_LEN 64
+#define FNAME_LEN 128
+#define LINE_LEN 256
+#define WRITEBUF_SIZE (64*1024)
+#define MANIFEST_MS 1000 // the manifest is rewritten at most this often while a segment fills
+#define STAT_BUCKETS 24 // histogram buckets, bucket i counts durations under 2^i us
+#define STAGE_SPI 0
+#define STAGE_CONVERT 1     // sampled, see TM_CONVERT_EVERY
+#define STAGE_FORMAT 2
+#define STAGE_WRITE 3
+#define STAGE_LCD 4
+#define NSTAGES 5
+#define TM_CONVERT_EVERY 64 // conversions per timed one
+#define MAX_TRIGGERS 8
+#define REPLAY_EARLY_NS 2000000LL  // a recorded code this much older than the replay clock is stale
+#define REPLAY_LATE_NS 8000000LL   // one up to this much newer is the reading being replayed
+#define SIM_LCD_COLS 16
+
+// stage timing, compiled out with TELEMETRY=0
+#if TELEMETRY
+#define TM_START(v) struct timespec v; clock_gettime(CLOCK_MONOTONIC, &v)
+#define TM_END(st, v) stat_since(&telemetry.stage[st], &v)
+#define TM_COUNT(c) __atomic_fetch_add(&telemetry.c, 1, __ATOMIC_RELAXED)
+// for stages cheaper than clock_gettime() itself, time only 1 pass in n (per thread)
+#define TM_START_EVERY(v, n) static __thread unsigned int v##_n; struct timespec v; \
+	int v##_on=(++v##_n%(n)==0); if (v##_on) clock_gettime(CLOCK_MONOTONIC, &v)
+#define TM_END_EVERY(st, v) if (v##_on) stat_since(&telemetry.stage[st], &v)
+#else
+#define TM_START(v)
+#define TM_END(st, v)
+#define TM_COUNT(c)
+#define TM_START_EVERY(v, n)
+#define TM_END_EVERY(st, v)
+#endif
+
+// typedefs
+typedef struct spi_ioc_transfer spi_t;
+
+// one raw thermocouple reading, for the trigger engine
+typedef struct raw_sample_s
+{
+	int64_t ns;                // CLOCK_REALTIME
+	int t10;
+} raw_sample_t;
+
+// codes recorded with record=<file>, handed back by a board with replay=<file>
+typedef struct replay_s
+{
+	int64_t* ns[2];            // [0] internal sensor, [1] thermocouple
+	int* code[2];
+	long n[2];
+	long cur[2];               // next unused code
+	int last[2];               // last code handed back
+} replay_t;
+
+// everything needed to talk to one ADS1118/LCD board
+typedef struct board_s
+{
+	char ads_dev[DEVNAME_LEN]; // ADS1118 spidev node
+	char lcd_dev[DEVNAME_LEN]; // LCD spidev node, empty if the board has no LCD
+	int bus;                   // SPI bus number, boards on one bus share a worker
+	int lcd_rs_gpio;
+	int sim;                   // 1 = simulated ADS1118, no hardware is touched
+	int ads_fd;
+	int lcd_fd;
+	int lcd_initialised;
+	spi_t spi;
+	unsigned char txbuf[BUFSIZE];
+	unsigned char rxbuf[BUFSIZE];
+	int local_comp;
+	double tval;               // result of the last averaged measurement
+	int tsum;                  // the same, as the sum of the readings in tenths
+	char tstr[16];             // tval formatted once for the LCD, file and stdout
+	int tlen;
+	int t10;                   // tval rounded to tenths, as in tstr
+	// simulator state
+	int sim_result;            // code returned by the next transaction
+	double sim_base;           // mean simulated temperature
+	unsigned int sim_seed;
+	int sim_kind;              // what the last transaction started, 0 = internal sensor, 1 = thermocouple
+	replay_t* replay;          // recorded codes instead of the waveform, NULL = none
+	char lcd_text[2][SIM_LCD_COLS]; // a simulated LCD, written to the file named by lcd=
+	int lcd_addr;
+	// recording, any board
+	char record_file[FNAME_LEN]; // record=<file>, empty = off
+	FILE* record;
+	int prev_cfg;              // config word of the previous transaction, 0 = none yet
+	// trigger engine state, only touched by the board's bus worker
+	raw_sample_t* raw;         // pre-trigger ring of raw readings
+	long raw_cap;
+	long raw_head;             // readings ever stored
+	int trig_armed[MAX_TRIGGERS];
+	long trig_lag[MAX_TRIGGERS]; // rate triggers: reading span_ms before the newest
+	int64_t capture_at;        // time of the trigger being captured, 0 = none
+	int64_t capture_end;
+	int capture_trigger;
+	int capture_t10;
+} board_t;
+
+// latency histogram, updated from several threads with relaxed atomics
+typedef struct stat_hist_s
+{
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t bucket[STAT_BUCKETS];
+} stat_hist_t;
+
+typedef struct telemetry_s
+{
+	stat_hist_t stage[NSTAGES];
+	stat_hist_t wakeup;        // how late clock_nanosleep returned
+	uint64_t ticks;
+	uint64_t samples;          // rows output
+	uint64_t overruns;         // ticks that ran past the next tick's start
+} telemetry_t;
+
+// local time formatting that only calls localtime_r() when the minute changes
+typedef struct timecache_s
+{
+	time_t minute;             // t/60 of the cached HH:MM
+	char hhmm[6];              // "HH:MM:"
+} timecache_t;
+
+// one logged row, kept in memory for the HTTP server
+typedef struct sample_s
+{
+	time_t t;
+	int elapsed;
+	int nboards;
+	int temp10[MAX_BOARDS];    // tenths of a degree
+} sample_t;
+
+// one worker per SPI bus
+typedef struct bus_worker_s
+{
+	pthread_t thread;
+	int bus;
+	int nboards;
+	board_t* boards[MAX_BOARDS];
+} bus_worker_t;
+
+/******************************************************************************
+ * Group commit writer. Rows are collected in a buffer and written with one
+ * write() every flush_rows rows, or once the oldest buffered row is flush_ms
+ * old. fdatasync() runs on its own sync_ms timer. With prealloc set, file
+ * space is reserved with fallocate() in chunks of that size so appends don't
+ * have to allocate blocks (and fragment the SD card) one write at a time.
+ * A crash loses at most the rows of one flush window, plus whatever the
+ * kernel had not synced if sync_ms is 0.
+ ******************************************************************************/
+typedef struct logwriter_s
+{
+	int fd;
+	char* buf;
+	int used;
+	int flush_rows;            // write after this many rows (1 = every row), not counting headers
+	int flush_ms;              // write when the oldest buffered row is this old, 0 = off
+	int sync_ms;               // fdatasync this often, 0 = leave it to the kernel
+	long prealloc;             // fallocate chunk in bytes, 0 = off
+	int pending_rows;
+	struct timespec first_pending;
+	struct timespec last_sync;
+	int dirty;                 // written but not synced
+	off_t size;                // bytes written to the file
+	off_t alloc_end;           // end of the space reserved by fallocate
+	long rows;                 // counters for bench-writer
+	long n_write;
+	long n_sync;
+	long n_alloc;
+	int timer_running;
+	pthread_t timer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} logwriter_t;
+
+// one log segment, as listed in the manifest
+typedef struct segment_s
+{
+	int seq;
+	char name[FNAME_LEN];      // file name relative to the log directory
+	time_t first_time;
+	time_t last_time;
+	int first_elapsed;
+	int last_elapsed;
+	long rows;
+	int closed;
+} segment_t;
+
+/******************************************************************************
+ * The log file. Without segmenting it is just the file named on the command
+ * line. With --segment-size or --segment-time the rows go to a series of
+ * segment files <name>-<seq>.<ext>, <name>.<ext> is a symlink to the segment
+ * being written, and <name>.<ext>.manifest lists every segment with its time
+ * range so readers only need to open the segments they are interested in.
+ ******************************************************************************/
+typedef struct seglog_s
+{
+	char fname[FNAME_LEN];     // as given on the command line
+	char dir[FNAME_LEN];       // directory part of fname, with trailing '/'
+	char stem[FNAME_LEN];      // base name without extension
+	char ext[FNAME_LEN];       // extension including the '.', may be empty
+	char header[LINE_LEN];     // written at the start of every segment
+	logwriter_t w;
+	int is_open;
+	long bytes;                // bytes in the current segment
+	int segmented;
+	segment_t* segs;           // segments still on disk, oldest first
+	int nsegs;
+	int maxsegs;
+	int next_seq;
+	pthread_mutex_t lock;      // protects segs and the manifest
+	int codec;                 // 1 = .tsc blocks (see therm_tsc.h) instead of CSV rows
+	tsc_encoder_t enc;
+	uint8_t* blockbuf;
+	int idx_fd;                // <file>.idx next to the .tsc file being written, -1 if none
+	int bg_close;              // being closed by the background thread, counted in logs_closing
+	long seal_ms;              // a .tsc block is sealed before its first row is older, 0 = off
+	struct timespec manifest_at; // last rewrite of the manifest
+} seglog_t;
+
+// queued work for the background thread
+typedef struct bg_job_s
+{
+	void (*fn)(void*);
+	void* arg;
+	struct bg_job_s* next;
+} bg_job_t;
+
+// round hundredths to tenths the way printf("%#.1f", hundredths/100.0) did:
+// by the binary value of the double, so an exact 5 in the hundredths goes
+// whichever side of the half the double lies, and to the even tenth when the
+// double is the half itself (x.25, x.75). fma gives d*100-hundredths exactly.
+// Unlike printf, small negative values give 0 and print "0.0", not "-0.0".
+static inline int
+round_tenths(int hundredths)
+{
+	int q=hundredths/10;
+	int r=hundredths%10;
+	double err;
+
+	if (r==5 || r==-5)
+	{
+		err=fma(hundredths/100.0, 100.0, -(double)hundredths);
+		if (r<0)
+			err=-err; // > 0 now means further from zero than the half
+		if (err>0 || (err==0 && (q&1)))
+			q+=r>0 ? 1 : -1;
+	}
+	else if (r>5 || r<-5)
+	{
+		q+=r>0 ? 1 : -1;
+	}
+	return(q);
+}
+
+// global variables, defined in therm.c
+extern int mem_fd;
+extern void *gpio_map;
+extern volatile unsigned *gpio;
+extern board_t boards[MAX_BOARDS];
+extern int nboards;
+extern bus_worker_t workers[MAX_BOARDS];
+extern int nworkers;
+extern pthread_barrier_t tick_start;
+extern pthread_barrier_t tick_done;
+extern volatile sig_atomic_t not_finished;
+extern int dofile;
+extern seglog_t* tlog;
+extern long segment_size;
+extern long segment_time;
+extern int retain_segments;
+extern long retain_age;
+extern int compress_segments;
+extern int flush_rows;
+extern int flush_ms;
+extern int sync_ms;
+extern long prealloc;
+extern int block_rows;
+extern int block_align;
+extern char shm_name[FNAME_LEN];
+extern int shm_ring;
+extern therm_shm_t* shm;
+extern double sim_speed;
+extern int sim_clock;
+extern time_t sim_start;
+extern int64_t sim_tick_ns;
+extern __thread int64_t sim_ns;
+extern long run_seconds;
+extern volatile int replay_ended;
+#if TELEMETRY
+extern telemetry_t telemetry;
+#endif
+extern pthread_t bg_thread;
+extern pthread_mutex_t bg_lock;
+extern pthread_cond_t bg_cond;
+extern bg_job_t* bg_head;
+extern bg_job_t* bg_tail;
+extern int bg_running;
+extern int bg_busy;
+extern pthread_cond_t bg_idle;
+extern int logs_closing;
+extern pthread_cond_t log_closed;
+extern char log_fname[FNAME_LEN];
+extern int log_period;
+extern long log_rows;
+extern uint8_t spi_bits;
+extern uint32_t spi_speed;
+
+// functions in therm.c
+int adc_code2temp(int code);
+int local_compensation(int local_code);
+int64_t now_ns(void);
+int delay_ms(unsigned int msec);
+void stat_add(stat_hist_t* h, uint64_t ns);
+void stat_since(stat_hist_t* h, struct timespec* start);
+int spi_open(int* f_desc, const char* device, uint8_t config);
+void sim_lcd_write(board_t* b, unsigned char c, int data);
+void lcd_writecom(board_t* b, unsigned char c);
+void lcd_writedata(board_t* b, unsigned char c);
+void lcd_clear(board_t* b);
+void lcd_display_string(board_t* b, unsigned char line_num, char *ptr);
+void lcd_init(board_t* b);
+int sim_temp2code(double temp_c);
+int replay_load(board_t* b, const char* fname);
+int replay_code(board_t* b, int k, int64_t now);
+int sim_transact(board_t* b);
+int therm_transact(board_t* b);
+void ads_config(board_t* b, unsigned int mode, unsigned int chan);
+int ads_read(board_t* b, unsigned int mode, unsigned int chan);
+int convert_code(board_t* b, int code);
+double get_measurement(board_t* b);
+int get_measurement_fast_tenths(board_t* b);
+double get_measurement_fast(board_t* b);
+void bus_measure(board_t** list, int n);
+int fmt_uint(char* out, unsigned long v);
+int fmt_tenths(char* out, long tenths);
+int fmt_hms(timecache_t* tc, time_t t, char* out);
+void board_format_temp(board_t* b);
+int format_row(timecache_t* tc, char* line, time_t t, int elapsed);
+void unixtime2string(char* int_part, char* out_time);
+int board_add(char* spec);
+int board_open_ads(board_t* b);
+int board_open_lcd(board_t* b);
+void board_close(board_t* b);
+void* bus_worker(void* arg);
+int workers_start(void);
+void workers_stop(void);
+void* bg_worker(void* arg);
+int bg_start(void);
+void bg_submit(void (*fn)(void*), void* arg);
+void bg_drain(void);
+void bg_stop(void);
+long ms_since(struct timespec* then, struct timespec* now);
+int writer_flush_locked(logwriter_t* w);
+void* writer_timer(void* arg);
+int writer_init(logwriter_t* w, int rows, int fl_ms, int sy_ms, long pre);
+void writer_attach(logwriter_t* w, int fd);
+void writer_append(logwriter_t* w, const char* data, int len);
+void writer_header(logwriter_t* w, const char* data, int len);
+void writer_flush(logwriter_t* w);
+void writer_detach(logwriter_t* w);
+void writer_sync(logwriter_t* w);
+void writer_destroy(logwriter_t* w);
+int writer_open_file(logwriter_t* w, const char* path);
+void seglog_split_name(seglog_t* log);
+void seglog_path(seglog_t* log, const char* name, char* path);
+void seglog_write_manifest(seglog_t* log);
+void seglog_index_open(seglog_t* log, const char* path);
+void seglog_index_close(seglog_t* log);
+void seglog_index_remove(const char* path);
+void seglog_remove_old(seglog_t* log);
+int seglog_new_segment(seglog_t* log);
+void seglog_finish_segment(void* arg);
+void seglog_seal_block(seglog_t* log);
+void seglog_close_segment(seglog_t* log, int compress);
+int seglog_open(seglog_t* log, const char* fname, const char* header);
+void seglog_add_row(seglog_t* log, sample_t* s);
+void seglog_tick(seglog_t* log, time_t t);
+int seglog_write(seglog_t* log, sample_t* s, const char* line, int len);
+void seglog_free(void* arg);
+void seglog_close(seglog_t* log);
+void seglog_close_job(void* arg);
+void seglog_close_later(seglog_t* log);
+void seglog_wait_closed(void);
+int shm_owner(const char* name);
+int shm_publish_open(const char* name, int ring_size);
+void shm_fill_slot(therm_shm_slot_t* slot, time_t t, int elapsed);
+void shm_publish_latest(time_t t, int elapsed);
+void shm_publish_row(time_t t, int elapsed);
+void shm_publish_close(const char* name);
+int log_open(const char* fname);
+int parse_options(int argc, char* argv[]);
+
+#endif
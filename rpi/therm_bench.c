@@ -0,0 +1,495 @@
+/**********************************************************************************************
+ * therm_bench.c
+ * Benchmarks, see therm_bench.h and the syntax in therm.c.
+ ************************************************************************************************/
+
+#include "therm.h"
+#include "therm_bench.h"
+#include "therm_http.h"
+
+// global variables
+int bench_e2e=0;           // therm bench-e2e is running
+int bench_ws_fd=-1;        // its /stream client
+pthread_t bench_tid;
+volatile long bench_frames=0;
+
+/******************************************************************************
+ * function: bench_format(long nrows)
+ * introduction: time the old per-row formatting (sprintf of the time,
+ * unixtime2string() and %#.1f for stdout, file and LCD) against format_row().
+ ******************************************************************************/
+void
+bench_format(long nrows)
+{
+	timecache_t tc;
+	struct timespec t0;
+	struct timespec t1;
+	char tstring[128];
+	char tstring2[128];
+	char line[LINE_LEN];
+	char out[LINE_LEN];
+	double secs[2];
+	long r;
+	long sink=0;
+	time_t t0_unix=time(NULL);
+	int pass;
+
+	nboards=1;
+	memset(&tc, 0, sizeof(tc));
+	for (pass=0; pass<2; pass++)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (r=0; r<nrows; r++)
+		{
+			boards[0].tsum=2000+(r%1000);
+			boards[0].tval=((double)boards[0].tsum)/100;
+			if (pass==0)
+			{
+				sprintf(tstring, "%ld", (long)(t0_unix+r));
+				unixtime2string(tstring, tstring2);
+				sink+=sprintf(out, "%s %ld %#.1f\n", tstring2, r, boards[0].tval);
+				sink+=sprintf(line, "%s,%ld,%#.1f\n", tstring2, r, boards[0].tval);
+				sink+=sprintf(tstring, "%7.1f", boards[0].tval);
+			}
+			else
+			{
+				board_format_temp(&boards[0]);
+				sink+=format_row(&tc, line, t0_unix+r, r);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		secs[pass]=(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1E9;
+	}
+	printf("printf/strftime: %.0f rows/s\n", nrows/secs[0]);
+	printf("format_row:      %.0f rows/s\n", nrows/secs[1]);
+	if (sink==0)
+		printf("\n");
+}
+
+/******************************************************************************
+ * function: bench_writer(const char* fname, long nrows)
+ * introduction: write nrows typical log rows with a range of group commit
+ * settings and report rows/s and syscalls (write, fdatasync, fallocate) per row.
+ ******************************************************************************/
+void
+bench_writer(const char* fname, long nrows)
+{
+	static const struct
+	{
+		const char* name;
+		int rows;
+		int fl_ms;
+		int sy_ms;
+		long pre;
+	} cfg[]=
+	{
+		{"every row (old behaviour)", 1, 0, 0, 0},
+		{"every row, sync 100ms", 1, 0, 100, 0},
+		{"16 rows", 16, 0, 0, 0},
+		{"1000ms", 0, 1000, 0, 0},
+		{"256 rows / 1000ms", 256, 1000, 0, 0},
+		{"256 rows / 1000ms, sync 1000ms", 256, 1000, 1000, 0},
+		{"256 rows / 1000ms, sync 1000ms, prealloc 1M", 256, 1000, 1000, 1024*1024},
+	};
+	logwriter_t w;
+	struct timespec t0;
+	struct timespec t1;
+	char line[LINE_LEN];
+	int len;
+	long r;
+	unsigned int k;
+	double secs;
+
+	printf("%-46s %12s %14s\n", "setting", "rows/s", "syscalls/row");
+	for (k=0; k<sizeof(cfg)/sizeof(cfg[0]); k++)
+	{
+		writer_init(&w, cfg[k].rows, cfg[k].fl_ms, cfg[k].sy_ms, cfg[k].pre);
+		if (writer_open_file(&w, fname)!=0)
+			exit(1);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (r=0; r<nrows; r++)
+		{
+			len=sprintf(line, "%02ld:%02ld:%02ld,%ld,%#.1f\n", (r/3600)%24, (r/60)%60, r%60, r, 20.0+(r%100)/10.0);
+			writer_append(&w, line, len);
+		}
+		writer_detach(&w);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		secs=(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1E9;
+		printf("%-46s %12.0f %14.4f\n", cfg[k].name, nrows/secs,
+			(double)(w.n_write+w.n_sync+w.n_alloc)/nrows);
+		writer_destroy(&w);
+	}
+	unlink(fname);
+}
+
+/******************************************************************************
+ * Codec benchmark (therm bench-codec <dir> [rows]). Writes the same simulated
+ * day of readings as CSV, gzipped CSV and .tsc into dir, then times a full
+ * scan of each back into numbers and checks they all decode to the same
+ * values. The files are left in dir for 'python thermtsc.py bench <dir>'.
+ ******************************************************************************/
+
+// read a whole file (or the output of a command, with cmd set) into memory
+char*
+bench_slurp(const char* path, int cmd, long* size)
+{
+	FILE* f=cmd ? popen(path, "r") : fopen(path, "rb");
+	char* buf=NULL;
+	long cap=0;
+	long n=0;
+	size_t got;
+
+	if (f==NULL)
+		return(NULL);
+	do
+	{
+		if (n==cap)
+		{
+			cap=cap ? 2*cap : 1024*1024;
+			buf=realloc(buf, cap);
+		}
+		got=fread(buf+n, 1, cap-n, f);
+		n+=got;
+	} while (got>0);
+	if (cmd)
+		pclose(f);
+	else
+		fclose(f);
+	*size=n;
+	return(buf);
+}
+
+// sum of elapsed and temperatures of a CSV log, tenths parsed without floats
+long
+bench_scan_csv(const char* p, long size, long* rows)
+{
+	const char* end=p+size;
+	long sum=0;
+	long v;
+	int neg;
+
+	p=memchr(p, '\n', size)+1; // header
+	*rows=0;
+	while (p<end)
+	{
+		p+=9; // HH:MM:SS,
+		for (v=0; *p!=','; p++)
+			v=v*10+(*p-'0');
+		sum+=v;
+		p++;
+		neg=(*p=='-');
+		p+=neg;
+		for (v=0; *p!='.'; p++)
+			v=v*10+(*p-'0');
+		v=v*10+(p[1]-'0');
+		sum+=neg ? -v : v;
+		p+=3;
+		(*rows)++;
+	}
+	return(sum);
+}
+
+long
+bench_scan_tsc(const uint8_t* p, long size, long* rows)
+{
+	static int64_t t[0x10000];
+	static int32_t el[0x10000];
+	static int32_t temps[0x10000*TSC_MAX_COLS];
+	tsc_block_t b;
+	size_t n;
+	long sum=0;
+	int i;
+
+	*rows=0;
+	while ((n=tsc_block_parse(p, size, &b))>0)
+	{
+		if (tsc_block_decode(&b, t, el, temps)<0)
+			break;
+		for (i=0; i<b.nrows; i++)
+			sum+=el[i]+temps[i*b.ncols];
+		*rows+=b.nrows;
+		p+=n;
+		size-=n;
+	}
+	return(sum);
+}
+
+void
+bench_codec(const char* dir, long nrows)
+{
+	char path[3][2*FNAME_LEN];
+	char cmd[2*FNAME_LEN+16];
+	char line[LINE_LEN];
+	const char* names[3]={"csv", "csv.gz", "tsc"};
+	timecache_t tc;
+	tsc_encoder_t enc;
+	uint8_t* block;
+	uint8_t entry[TSC_INDEX_RECORD(1)];
+	long offset=0;
+	posix_spawn_file_actions_t fa;
+	char* gz_argv[3]={"gzip", "-c", NULL};
+	extern char** environ;
+	struct timespec t0;
+	struct timespec t1;
+	struct stat st;
+	FILE* f[3];
+	pid_t pid;
+	int status;
+	time_t start=time(NULL);
+	unsigned int seed=1;
+	long r;
+	long size;
+	long rows;
+	long sum[3];
+	double secs;
+	char* buf;
+	int k;
+	int n;
+
+	for (k=0; k<3; k++)
+		snprintf(path[k], sizeof(path[k]), "%s/bench.%s", dir, names[k]);
+	nboards=1;
+	memset(&tc, 0, sizeof(tc));
+	if (tsc_encoder_init(&enc, 1, block_rows)!=0)
+		exit(1);
+	enc.align=block_align;
+	block=malloc(tsc_block_max(1, block_rows));
+	f[0]=fopen(path[0], "w");
+	f[1]=fopen(path[2], "wb");
+	snprintf(cmd, sizeof(cmd), "%s.idx", path[2]);
+	f[2]=fopen(cmd, "wb");
+	if (f[0]==NULL || f[1]==NULL || f[2]==NULL)
+	{
+		fprintf(stderr, "Error creating the files in %s: %s\n", dir, strerror(errno));
+		exit(1);
+	}
+	fprintf(f[0], "Time HH:MM:SS,Elapsed Sec,Temp C\n");
+	fwrite(entry, 1, tsc_index_header(entry, 1), f[2]);
+	for (r=0; r<=nrows; r++)
+	{
+		// blocks and index entries as seglog_add_row() and seglog_seal_block() make them
+		if (r==nrows ? enc.nrows>0 : tsc_due(&enc, start+r))
+		{
+			fwrite(entry, 1, tsc_index_entry(&enc, offset, entry), f[2]);
+			offset+=fwrite(block, 1, tsc_seal(&enc, block), f[1]);
+		}
+		if (r==nrows)
+			break;
+		// a slow daily swing with a little noise, like a room
+		boards[0].tsum=(int)(2000+300*sin(r*2*M_PI/86400))+(int)(rand_r(&seed)%21)-10;
+		board_format_temp(&boards[0]);
+		n=format_row(&tc, line, start+r, r);
+		fwrite(line, 1, n, f[0]);
+		if (tsc_add(&enc, start+r, r, &boards[0].t10))
+		{
+			fwrite(entry, 1, tsc_index_entry(&enc, offset, entry), f[2]);
+			offset+=fwrite(block, 1, tsc_seal(&enc, block), f[1]);
+		}
+	}
+	fclose(f[0]);
+	fclose(f[1]);
+	fclose(f[2]);
+	tsc_encoder_free(&enc);
+	free(block);
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addopen(&fa, 0, path[0], O_RDONLY, 0);
+	posix_spawn_file_actions_addopen(&fa, 1, path[1], O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (posix_spawnp(&pid, "gzip", &fa, NULL, gz_argv, environ)!=0 || waitpid(pid, &status, 0)!=pid
+		|| !WIFEXITED(status) || WEXITSTATUS(status)!=0)
+	{
+		fprintf(stderr, "Error running gzip\n");
+		exit(1);
+	}
+	posix_spawn_file_actions_destroy(&fa);
+
+	printf("%-8s %12s %10s %14s\n", "format", "bytes", "bytes/row", "scan rows/s");
+	for (k=0; k<3; k++)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if (k==1)
+		{
+			snprintf(cmd, sizeof(cmd), "gzip -dc '%s'", path[1]);
+			buf=bench_slurp(cmd, 1, &size);
+		}
+		else
+		{
+			buf=bench_slurp(path[k], 0, &size);
+		}
+		if (buf==NULL)
+			exit(1);
+		sum[k]=k==2 ? bench_scan_tsc((uint8_t*)buf, size, &rows) : bench_scan_csv(buf, size, &rows);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		free(buf);
+		secs=(t1.tv_sec-t0.tv_sec)+(t1.tv_nsec-t0.tv_nsec)/1E9;
+		stat(path[k], &st);
+		printf("%-8s %12ld %10.2f %14.0f\n", names[k], (long)st.st_size, (double)st.st_size/nrows, rows/secs);
+		if (rows!=nrows)
+			printf("%s: read back %ld of %ld rows\n", names[k], rows, nrows);
+	}
+	if (sum[0]!=sum[1] || sum[0]!=sum[2])
+		printf("decoded values differ\n");
+}
+
+/******************************************************************************
+ * End to end benchmark (therm bench-e2e <dir> [seconds] [boards]). Runs the
+ * normal logging loop flat out (--speed=0) on simulated boards, one per bus,
+ * for the given number of simulated seconds, logging to <dir>/bench-e2e.tsc
+ * with the HTTP server and shared memory on, while a client thread takes every
+ * row off the /stream WebSocket. The report is samples/s from conversion
+ * through the log to that client, so a change that slows any stage shows up
+ * on a plain Linux box. Other options (a .csv name is not one) still apply,
+ * e.g. --flush-rows or --trigger.
+ ******************************************************************************/
+char**
+bench_e2e_setup(int argc, char* argv[])
+{
+	static char* args[3];
+	static char path[2*FNAME_LEN];
+	char spec[32];
+	char* end;
+	long secs=86400;
+	long n=2;
+	int i;
+
+	if (argc>3)
+		secs=strtol(argv[3], &end, 10);
+	if (argc>3 && (end==argv[3] || *end || secs<1))
+	{
+		fprintf(stderr, "bench-e2e: seconds must be a number of at least 1\n");
+		exit(1);
+	}
+	if (argc>4)
+		n=strtol(argv[4], &end, 10);
+	if (argc>4 && (end==argv[4] || *end || n<1 || n>MAX_BOARDS))
+	{
+		fprintf(stderr, "bench-e2e: boards must be a number from 1 to %d\n", MAX_BOARDS);
+		exit(1);
+	}
+	for (i=0; i<n; i++)
+	{
+		snprintf(spec, sizeof(spec), "sim:%d.0", i);
+		if (board_add(spec)!=0)
+			exit(1);
+	}
+	snprintf(path, sizeof(path), "%s/bench-e2e.tsc", argc>2 ? argv[2] : ".");
+	sim_speed=0;
+	run_seconds=secs;
+	if (http_port==0)
+		http_port=BENCH_HTTP_PORT;
+	if (shm_name[0]==0)
+		strcpy(shm_name, "/therm-bench");
+	bench_e2e=1;
+	args[0]=argv[0];
+	args[1]="1";
+	args[2]=path;
+	// the rows still get formatted and written, just not to the terminal
+	if (freopen("/dev/null", "w", stdout)==NULL)
+		exit(1);
+	return(args);
+}
+
+// count the frames arriving on the benchmark's WebSocket until the server closes it
+void*
+bench_stream(void* arg)
+{
+	static unsigned char buf[65536];
+	long have=0;
+	long at;
+	long len;
+	int hl;
+	int n;
+
+	while ((n=recv(bench_ws_fd, buf+have, sizeof(buf)-have, 0))>0)
+	{
+		have+=n;
+		at=0;
+		while (have-at>=2)
+		{
+			len=buf[at+1] & 0x7f;
+			hl=2;
+			if (len==126)
+			{
+				if (have-at<4)
+					break;
+				len=(buf[at+2]<<8) | buf[at+3];
+				hl=4;
+			}
+			if (have-at<hl+len)
+				break;
+			if ((buf[at] & 0x0f)==1)
+				__atomic_fetch_add(&bench_frames, 1, __ATOMIC_RELAXED);
+			at+=hl+len;
+		}
+		memmove(buf, buf+at, have-at);
+		have-=at;
+	}
+	close(bench_ws_fd);
+	return(NULL);
+}
+
+// wait for the stream client to catch up with the log, then print the results
+void
+bench_report(long ticks, struct timespec* t0)
+{
+	struct timespec t1;
+	struct timespec ms={0, 1000000};
+	struct stat st;
+	long frames=-1;
+	int idle=0;
+	double secs;
+
+	while (idle<2000 && __atomic_load_n(&bench_frames, __ATOMIC_RELAXED)<log_rows)
+	{
+		nanosleep(&ms, NULL); // not delay_ms(), that only moves the virtual clock
+		if (frames==__atomic_load_n(&bench_frames, __ATOMIC_RELAXED))
+			idle++;
+		else
+			idle=0;
+		frames=__atomic_load_n(&bench_frames, __ATOMIC_RELAXED);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs=(t1.tv_sec-t0->tv_sec)+(t1.tv_nsec-t0->tv_nsec)/1E9;
+	if (stat(log_fname, &st)!=0)
+		st.st_size=0;
+	fprintf(stderr, "%-7s %-10s %10s %12s %12s %10s %10s %10s\n", "boards", "sim secs", "real secs",
+		"ticks/s", "samples/s", "logged", "streamed", "log bytes");
+	fprintf(stderr, "%-7d %-10ld %10.3f %12.0f %12.0f %10ld %10ld %10ld\n", nboards, ticks, secs,
+		ticks/secs, ticks*nboards/secs, log_rows, (long)bench_frames, (long)st.st_size);
+}
+
+// connect to our own /stream, before the first row so none are missed
+int
+bench_stream_start(int port)
+{
+	struct sockaddr_in addr;
+	char req[]="GET /stream HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+	char resp[512];
+	int n=0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	addr.sin_port=htons(port);
+	bench_ws_fd=socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (connect(bench_ws_fd, (struct sockaddr*)&addr, sizeof(addr))<0
+		|| send(bench_ws_fd, req, strlen(req), 0)<0)
+	{
+		fprintf(stderr, "Error connecting to /stream: %s\n", strerror(errno));
+		return(-1);
+	}
+	// a byte at a time, so the first frame stays in the socket for the thread
+	while (n<(int)sizeof(resp)-1 && recv(bench_ws_fd, resp+n, 1, 0)==1)
+	{
+		resp[++n]=0;
+		if (n>=4 && strcmp(resp+n-4, "\r\n\r\n")==0)
+			break;
+	}
+	if (strncmp(resp, "HTTP/1.1 101", 12)!=0)
+	{
+		fprintf(stderr, "/stream refused the benchmark client\n");
+		return(-1);
+	}
+	return(pthread_create(&bench_tid, NULL, bench_stream, NULL)==0 ? 0 : -1);
+}
@@ -0,0 +1,29 @@
+/**********************************************************************************************
+ * therm_bench.h
+ * Benchmarks: therm bench-format, bench-writer, bench-codec and bench-e2e.
+ ************************************************************************************************/
+
+#ifndef THERM_BENCH_H
+#define THERM_BENCH_H
+
+#include "therm.h"
+
+#define BENCH_HTTP_PORT 8089
+
+extern int bench_e2e;
+extern int bench_ws_fd;
+extern pthread_t bench_tid;
+extern volatile long bench_frames;
+
+void bench_format(long nrows);
+void bench_writer(const char* fname, long nrows);
+char* bench_slurp(const char* path, int cmd, long* size);
+long bench_scan_csv(const char* p, long size, long* rows);
+long bench_scan_tsc(const uint8_t* p, long size, long* rows);
+void bench_codec(const char* dir, long nrows);
+char** bench_e2e_setup(int argc, char* argv[]);
+void* bench_stream(void* arg);
+void bench_report(long ticks, struct timespec* t0);
+int bench_stream_start(int port);
+
+#endif
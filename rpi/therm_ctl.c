@@ -0,0 +1,592 @@
+/**********************************************************************************************
+ * therm_ctl.c
+ * Pidfile lock and control socket, see therm_ctl.h.
+ ************************************************************************************************/
+
+#include "therm.h"
+#include "therm_ctl.h"
+
+// global variables
+char pidfile[FNAME_LEN]="/var/run/therm.pid";
+int pidfile_set=0;         // given with --pidfile, not being able to lock it is then an error
+int pid_fd=-1;
+char ctl_path[FNAME_LEN]=""; // control socket, empty = off
+char ctl_group[FNAME_LEN]=""; // group given access to it, empty = SUDO_GID
+char log_dir[FNAME_LEN]="";  // directory 'start' logs into
+int ctl_fd=-1;
+pthread_t ctl_tid;
+volatile int ctl_running=0;
+pthread_mutex_t ctl_lock=PTHREAD_MUTEX_INITIALIZER; // protects the ctl_ and log_ state below
+int ctl_req=0;             // CTL_START or CTL_STOP waiting for the main loop
+int ctl_result;
+char ctl_fname[FNAME_LEN];
+int ctl_period;
+ctl_conn_t ctl_evconn;     // stands for ctl_evfd in the epoll loop
+int ctl_pending=0;         // the start or stop a client is waiting on, until it is answered
+char ctl_pending_name[FNAME_LEN];
+struct timespec ctl_deadline; // CLOCK_MONOTONIC, when the waiting client gets "timed out"
+ctl_conn_t* ctl_waiter=NULL; // the client waiting, NULL if it has gone
+ctl_conn_t* ctl_conns=NULL;
+int ctl_nconns=0;
+int ctl_epfd=-1;
+int ctl_evfd=-1;           // the main loop pokes it once a start or stop is done
+sample_t ctl_latest;
+timecache_t ctl_tcache;
+
+/******************************************************************************
+ * Process control. A repeating therm takes an flock on a pidfile, so a second
+ * logger (or a one-shot reading) can't drive the same SPI buses at the same
+ * time. With --control it also listens on a unix socket for one-line
+ * commands, each answered with one line:
+ * status                  "logging <file> period <sec> rows <n> pid <pid>" or "idle pid <pid>"
+ * file                    the file being written (the live segment), or "none"
+ * latest                  the last reading, as 'therm withtime' prints it
+ * start <file> [period]   log to <log dir>/<file> (closing the current one), "ok logging <file>",
+ *                         file must be a plain name, see ctl_name_ok()
+ * stop                    close the log, flushed and synced, and keep acquiring, "ok idle"
+ * quit                    stop logging and exit, as SIGINT or SIGTERM do
+ * status, file and latest are answered by the control thread from memory,
+ * start and stop are carried out by the main loop at its next tick.
+ * The control thread serves up to CTL_MAX_CLIENTS connections at once from
+ * one epoll loop, so a client that stalls holds up nobody else. One start or
+ * stop is in flight at a time: its client gets the answer once the main loop
+ * has done it, and a start or stop from anyone else meanwhile gets "error
+ * busy". A client's later commands wait for its own start or stop.
+ ******************************************************************************/
+
+// take the pidfile lock, returns -1 if another logger holds it
+int
+pidfile_lock(void)
+{
+	char buf[16];
+	int n;
+
+	pid_fd=open(pidfile, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if (pid_fd<0)
+	{
+		if (!pidfile_set)
+			return(0); // default location not writable, e.g. not run as root
+		fprintf(stderr, "Error opening %s: %s\n", pidfile, strerror(errno));
+		return(-1);
+	}
+	if (flock(pid_fd, LOCK_EX|LOCK_NB)<0)
+	{
+		n=pread(pid_fd, buf, sizeof(buf)-1, 0);
+		buf[n>0 ? n : 0]=0;
+		fprintf(stderr, "therm is already running (pid %d)\n", atoi(buf));
+		close(pid_fd);
+		pid_fd=-1;
+		return(-1);
+	}
+	ftruncate(pid_fd, 0);
+	n=snprintf(buf, sizeof(buf), "%d\n", (int)getpid());
+	pwrite(pid_fd, buf, n, 0);
+	return(0);
+}
+
+// pid of the logger holding the pidfile lock, 0 if there is none
+int
+pidfile_owner(void)
+{
+	char buf[16];
+	int fd;
+	int n;
+
+	fd=open(pidfile, O_RDONLY|O_CLOEXEC);
+	if (fd<0)
+		return(0);
+	if (flock(fd, LOCK_SH|LOCK_NB)==0)
+	{
+		close(fd);
+		return(0);
+	}
+	n=pread(fd, buf, sizeof(buf)-1, 0);
+	buf[n>0 ? n : 0]=0;
+	close(fd);
+	return(atoi(buf)>0 ? atoi(buf) : -1);
+}
+
+void
+pidfile_release(void)
+{
+	if (pid_fd<0)
+		return;
+	unlink(pidfile); // while still holding the lock
+	close(pid_fd);
+	pid_fd=-1;
+}
+
+// called by the main loop every tick, keeps the reading 'latest' answers with
+void
+ctl_set_latest(time_t t, int elapsed)
+{
+	int i;
+
+	pthread_mutex_lock(&ctl_lock);
+	ctl_latest.t=t;
+	ctl_latest.elapsed=elapsed;
+	ctl_latest.nboards=nboards;
+	for (i=0; i<nboards; i++)
+		ctl_latest.temp10[i]=boards[i].t10;
+	pthread_mutex_unlock(&ctl_lock);
+}
+
+/******************************************************************************
+ * function: ctl_apply(int* period, time_t* desiredtime, int* elapsed, time_t now)
+ * introduction: carry out a start or stop from the control socket. Runs in the
+ * main loop between ticks, so the log is never closed under a row being written.
+ * A new log starts with this tick's row and elapsed back at 0.
+ ******************************************************************************/
+void
+ctl_apply(int* period, time_t* desiredtime, int* elapsed, time_t now)
+{
+	struct stat st_old;
+	struct stat st_new;
+	uint64_t one=1;
+	int reopen=0;
+
+	pthread_mutex_lock(&ctl_lock);
+	if (ctl_req==0) // timed out meanwhile
+	{
+		pthread_mutex_unlock(&ctl_lock);
+		return;
+	}
+	if (dofile)
+	{
+		// syncing, gzip and retention run on the background thread, unless
+		// the same file is started again and has to be let go of first
+		reopen=(ctl_req==CTL_START && stat(log_fname, &st_old)==0 && stat(ctl_fname, &st_new)==0
+			&& st_old.st_dev==st_new.st_dev && st_old.st_ino==st_new.st_ino);
+		seglog_close_later(tlog);
+		tlog=NULL;
+		dofile=0;
+	}
+	ctl_result=0;
+	if (ctl_req==CTL_START)
+	{
+		if (reopen)
+			seglog_wait_closed();
+		if (log_open(ctl_fname)==0)
+		{
+			dofile=1;
+			*period=log_period=ctl_period;
+			*desiredtime=now;
+			*elapsed=0;
+			log_rows=0;
+		}
+		else
+		{
+			ctl_result=-1;
+		}
+	}
+	ctl_req=0;
+	pthread_mutex_unlock(&ctl_lock);
+	write(ctl_evfd, &one, sizeof(one));
+}
+
+// hand a start or stop to the main loop, caller holds ctl_lock. Returns -2
+// if another one has not been answered yet
+int
+ctl_request(int req)
+{
+	if (ctl_pending)
+		return(-2);
+	ctl_req=req;
+	ctl_pending=req;
+	clock_gettime(CLOCK_MONOTONIC, &ctl_deadline);
+	ctl_deadline.tv_sec+=CTL_TIMEOUT;
+	return(0);
+}
+
+// a log name 'start' accepts: no directories, no hidden or special names
+int
+ctl_name_ok(const char* name)
+{
+	return(name[0]!=0 && name[0]!='.' && strchr(name, '/')==NULL);
+}
+
+// answer one command line into reply, returns 1 if the answer has to wait
+// for the main loop, see ctl_answer()
+int
+ctl_command(char* cmd, char* reply, int size)
+{
+	char* arg;
+	char fname[FNAME_LEN];
+	int len;
+	int ret=0;
+	int i;
+
+	reply[0]=0;
+	pthread_mutex_lock(&ctl_lock);
+	if (strcmp(cmd, "status")==0)
+	{
+		if (dofile)
+			snprintf(reply, size, "logging %s period %d rows %ld pid %d\n", log_fname, log_period,
+				__atomic_load_n(&log_rows, __ATOMIC_RELAXED), (int)getpid());
+		else
+			snprintf(reply, size, "idle pid %d\n", (int)getpid());
+	}
+	else if (strcmp(cmd, "file")==0)
+	{
+		if (!dofile)
+		{
+			snprintf(reply, size, "none\n");
+		}
+		else if (tlog->segmented)
+		{
+			pthread_mutex_lock(&tlog->lock);
+			snprintf(reply, size, "%s%s\n", tlog->dir, tlog->segs[tlog->nsegs-1].name);
+			pthread_mutex_unlock(&tlog->lock);
+		}
+		else
+		{
+			snprintf(reply, size, "%s\n", tlog->fname);
+		}
+	}
+	else if (strcmp(cmd, "latest")==0)
+	{
+		if (ctl_latest.t==0)
+		{
+			snprintf(reply, size, "error no reading yet\n");
+		}
+		else
+		{
+			len=fmt_hms(&ctl_tcache, ctl_latest.t, reply);
+			for (i=0; i<ctl_latest.nboards && len<size-16; i++)
+			{
+				reply[len++]=' ';
+				len+=fmt_tenths(reply+len, ctl_latest.temp10[i]);
+			}
+			reply[len++]='\n';
+			reply[len]='\0';
+		}
+	}
+	else if (strncmp(cmd, "start ", 6)==0)
+	{
+		arg=cmd+6;
+		ctl_period=1;
+		if (sscanf(arg, "%127s %d", fname, &ctl_period)<1 || ctl_period<1)
+		{
+			snprintf(reply, size, "error usage: start <file> [period]\n");
+		}
+		else if (!ctl_name_ok(fname)
+			|| snprintf(ctl_fname, FNAME_LEN, "%s/%s", log_dir, fname)>=FNAME_LEN)
+		{
+			// the socket is open to other users, who must not get root to write anywhere
+			snprintf(reply, size, "error the file must be a plain name in %s\n", log_dir);
+		}
+		else if (ctl_request(CTL_START)<0)
+		{
+			snprintf(reply, size, "error busy\n");
+		}
+		else
+		{
+			snprintf(ctl_pending_name, FNAME_LEN, "%s", fname);
+			ret=1;
+		}
+	}
+	else if (strcmp(cmd, "stop")==0)
+	{
+		if (ctl_request(CTL_STOP)<0)
+			snprintf(reply, size, "error busy\n");
+		else
+			ret=1;
+	}
+	else if (strcmp(cmd, "quit")==0)
+	{
+		not_finished=0;
+		snprintf(reply, size, "ok\n");
+	}
+	else
+	{
+		snprintf(reply, size, "error unknown command\n");
+	}
+	pthread_mutex_unlock(&ctl_lock);
+	return(ret);
+}
+
+void
+ctl_close(ctl_conn_t* c)
+{
+	ctl_conn_t** p;
+
+	if (ctl_waiter==c)
+		ctl_waiter=NULL; // the start or stop still happens, nobody hears about it
+	epoll_ctl(ctl_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	for (p=&ctl_conns; *p; p=&(*p)->next)
+	{
+		if (*p==c)
+		{
+			*p=c->next;
+			break;
+		}
+	}
+	ctl_nconns--;
+	free(c);
+}
+
+// replies are one short line, a client that does not take one is dropped
+int
+ctl_reply(ctl_conn_t* c, const char* reply)
+{
+	int len=strlen(reply);
+
+	return(send(c->fd, reply, len, MSG_DONTWAIT|MSG_NOSIGNAL)==len ? 0 : -1);
+}
+
+// run the complete lines a client has sent, up to a start or stop that has to
+// wait, returns -1 when the connection should go
+int
+ctl_lines(ctl_conn_t* c)
+{
+	char reply[LINE_LEN+FNAME_LEN];
+	char* nl;
+
+	while (!c->waiting && (nl=memchr(c->in, '\n', c->inlen))!=NULL)
+	{
+		*nl=0;
+		if (nl>c->in && nl[-1]=='\r')
+			nl[-1]=0;
+		c->waiting=ctl_command(c->in, reply, sizeof(reply));
+		c->inlen-=nl+1-c->in;
+		memmove(c->in, nl+1, c->inlen);
+		if (c->waiting)
+			ctl_waiter=c;
+		else if (ctl_reply(c, reply)<0)
+			return(-1);
+	}
+	if (c->waiting)
+		return(0);
+	if (c->inlen==sizeof(c->in)-1) // line too long
+		return(-1);
+	if (c->eof)
+	{
+		// a last command without a newline
+		if (c->inlen>0)
+		{
+			c->in[c->inlen]=0;
+			c->inlen=0;
+			c->waiting=ctl_command(c->in, reply, sizeof(reply));
+			if (c->waiting)
+			{
+				ctl_waiter=c;
+				return(0);
+			}
+			ctl_reply(c, reply);
+		}
+		return(-1);
+	}
+	return(0);
+}
+
+int
+ctl_input(ctl_conn_t* c)
+{
+	int n;
+
+	n=read(c->fd, c->in+c->inlen, sizeof(c->in)-1-c->inlen);
+	if (n<0)
+		return((errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR) ? 0 : -1);
+	if (n==0)
+	{
+		c->eof=1;
+		epoll_ctl(ctl_epfd, EPOLL_CTL_DEL, c->fd, NULL); // only the answer is left to send
+	}
+	c->inlen+=n;
+	return(ctl_lines(c));
+}
+
+/******************************************************************************
+ * function: ctl_answer(void)
+ * introduction: answer the pending start or stop once the main loop has
+ * carried it out, or with "timed out" after CTL_TIMEOUT seconds (the main
+ * loop is stuck, or stopping), then carry on with that client's other lines.
+ ******************************************************************************/
+void
+ctl_answer(void)
+{
+	char reply[LINE_LEN+FNAME_LEN];
+	struct timespec now;
+	ctl_conn_t* c;
+	int ret;
+
+	pthread_mutex_lock(&ctl_lock);
+	if (ctl_pending==0)
+	{
+		pthread_mutex_unlock(&ctl_lock);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (ctl_req && now.tv_sec*1000000000LL+now.tv_nsec
+		< ctl_deadline.tv_sec*1000000000LL+ctl_deadline.tv_nsec)
+	{
+		pthread_mutex_unlock(&ctl_lock);
+		return; // not done yet
+	}
+	ret=ctl_req ? -3 : ctl_result;
+	if (ctl_pending==CTL_START && ret==0)
+		snprintf(reply, sizeof(reply), "ok logging %s\n", ctl_pending_name);
+	else if (ctl_pending==CTL_STOP && ret==0)
+		snprintf(reply, sizeof(reply), "ok idle\n");
+	else
+		snprintf(reply, sizeof(reply), "error %s\n", ret==-1 ? "could not open the log" : "timed out");
+	ctl_req=0;
+	ctl_pending=0;
+	c=ctl_waiter;
+	ctl_waiter=NULL;
+	pthread_mutex_unlock(&ctl_lock);
+	if (c==NULL)
+		return;
+	c->waiting=0;
+	if (ctl_reply(c, reply)<0 || ctl_lines(c)<0)
+		ctl_close(c);
+}
+
+void*
+ctl_thread(void* arg)
+{
+	struct epoll_event evs[CTL_MAX_CLIENTS+2];
+	struct epoll_event ev;
+	ctl_conn_t* c;
+	uint64_t v;
+	int n;
+	int i;
+	int fd;
+
+	while (ctl_running)
+	{
+		// wake up now and then to time out a start or stop
+		n=epoll_wait(ctl_epfd, evs, CTL_MAX_CLIENTS+2, ctl_pending ? 100 : -1);
+		for (i=0; i<n; i++)
+		{
+			c=(ctl_conn_t*)evs[i].data.ptr;
+			if (c==NULL) // the listening socket
+			{
+				while ((fd=accept4(ctl_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC))>=0)
+				{
+					if (ctl_nconns==CTL_MAX_CLIENTS || (c=calloc(1, sizeof(ctl_conn_t)))==NULL)
+					{
+						send(fd, "error too many clients\n", 23, MSG_DONTWAIT|MSG_NOSIGNAL);
+						close(fd);
+						continue;
+					}
+					c->fd=fd;
+					ev.events=EPOLLIN;
+					ev.data.ptr=c;
+					epoll_ctl(ctl_epfd, EPOLL_CTL_ADD, fd, &ev);
+					c->next=ctl_conns;
+					ctl_conns=c;
+					ctl_nconns++;
+				}
+			}
+			else if (c->fd==ctl_evfd)
+			{
+				read(ctl_evfd, &v, sizeof(v));
+			}
+			else if ((evs[i].events & EPOLLERR) || ctl_input(c)<0)
+			{
+				ctl_close(c);
+			}
+		}
+		ctl_answer();
+	}
+	while (ctl_conns)
+		ctl_close(ctl_conns);
+	return(NULL);
+}
+
+int
+ctl_start(const char* path)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	struct group* gr;
+	gid_t gid;
+	sigset_t set;
+	sigset_t oldset;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family=AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	fd=socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	// a socket file nobody answers on is left over from a crash
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))==0)
+	{
+		fprintf(stderr, "A logger is already listening on %s\n", path);
+		close(fd);
+		return(-1);
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))<0 || listen(fd, 4)<0)
+	{
+		fprintf(stderr, "Error listening on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return(-1);
+	}
+	// therm runs under sudo, the web server that talks to it doesn't, so it
+	// gets in through the socket's group rather than the socket being open to all
+	gid=-1;
+	if (ctl_group[0])
+	{
+		gr=getgrnam(ctl_group);
+		if (gr==NULL)
+		{
+			fprintf(stderr, "Unknown group %s\n", ctl_group);
+			close(fd);
+			unlink(path);
+			return(-1);
+		}
+		gid=gr->gr_gid;
+	}
+	else if (getenv("SUDO_GID"))
+	{
+		gid=atoi(getenv("SUDO_GID"));
+	}
+	if ((gid!=(gid_t)-1 && chown(path, -1, gid)<0) || chmod(path, 0660)<0)
+	{
+		fprintf(stderr, "Error setting the owner of %s: %s\n", path, strerror(errno));
+		close(fd);
+		unlink(path);
+		return(-1);
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	ctl_fd=fd;
+	ctl_epfd=epoll_create1(EPOLL_CLOEXEC);
+	ctl_evfd=eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	ctl_evconn.fd=ctl_evfd;
+	ev.events=EPOLLIN;
+	ev.data.ptr=NULL;
+	epoll_ctl(ctl_epfd, EPOLL_CTL_ADD, ctl_fd, &ev);
+	ev.data.ptr=&ctl_evconn;
+	epoll_ctl(ctl_epfd, EPOLL_CTL_ADD, ctl_evfd, &ev);
+	ctl_running=1;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	if (pthread_create(&ctl_tid, NULL, ctl_thread, NULL)!=0)
+	{
+		fprintf(stderr, "Error starting the control thread\n");
+		ctl_running=0;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	return(ctl_running ? 0 : -1);
+}
+
+void
+ctl_stop(void)
+{
+	uint64_t one=1;
+
+	if (!ctl_running)
+		return;
+	ctl_running=0;
+	write(ctl_evfd, &one, sizeof(one)); // wakes up epoll_wait
+	pthread_join(ctl_tid, NULL);
+	close(ctl_fd);
+	close(ctl_evfd);
+	close(ctl_epfd);
+	unlink(ctl_path);
+}
@@ -0,0 +1,71 @@
+/**********************************************************************************************
+ * therm_ctl.h
+ * Process control: the pidfile lock that keeps a second logger off the SPI
+ * buses, and the --control unix socket (status, file, latest, start, stop, quit).
+ ************************************************************************************************/
+
+#ifndef THERM_CTL_H
+#define THERM_CTL_H
+
+#include "therm.h"
+
+#define CTL_START 1
+#define CTL_STOP 2
+#define CTL_TIMEOUT 5              // seconds a client waits for the main loop
+#define CTL_MAX_CLIENTS 16         // control connections served at once
+
+// a control socket connection
+typedef struct ctl_conn_s
+{
+	int fd;
+	char in[LINE_LEN];
+	int inlen;
+	int waiting;               // its start or stop is with the main loop, later lines wait
+	int eof;                   // the client has sent everything, close once it is answered
+	struct ctl_conn_s* next;
+} ctl_conn_t;
+
+extern char pidfile[FNAME_LEN];
+extern int pidfile_set;
+extern int pid_fd;
+extern char ctl_path[FNAME_LEN];
+extern char ctl_group[FNAME_LEN];
+extern char log_dir[FNAME_LEN];
+extern int ctl_fd;
+extern pthread_t ctl_tid;
+extern volatile int ctl_running;
+extern pthread_mutex_t ctl_lock;
+extern int ctl_req;
+extern int ctl_result;
+extern char ctl_fname[FNAME_LEN];
+extern int ctl_period;
+extern ctl_conn_t ctl_evconn;
+extern int ctl_pending;
+extern char ctl_pending_name[FNAME_LEN];
+extern struct timespec ctl_deadline;
+extern ctl_conn_t* ctl_waiter;
+extern ctl_conn_t* ctl_conns;
+extern int ctl_nconns;
+extern int ctl_epfd;
+extern int ctl_evfd;
+extern sample_t ctl_latest;
+extern timecache_t ctl_tcache;
+
+int pidfile_lock(void);
+int pidfile_owner(void);
+void pidfile_release(void);
+void ctl_set_latest(time_t t, int elapsed);
+void ctl_apply(int* period, time_t* desiredtime, int* elapsed, time_t now);
+int ctl_request(int req);
+int ctl_name_ok(const char* name);
+int ctl_command(char* cmd, char* reply, int size);
+void ctl_close(ctl_conn_t* c);
+int ctl_reply(ctl_conn_t* c, const char* reply);
+int ctl_lines(ctl_conn_t* c);
+int ctl_input(ctl_conn_t* c);
+void ctl_answer(void);
+void* ctl_thread(void* arg);
+int ctl_start(const char* path);
+void ctl_stop(void);
+
+#endif
@@ -0,0 +1,846 @@
+/**********************************************************************************************
+ * therm_http.c
+ * Embedded HTTP/WebSocket server, see therm_http.h.
+ ************************************************************************************************/
+
+#include "therm.h"
+#include "therm_http.h"
+
+// global variables
+int http_port=0;           // embedded HTTP server, 0 = off
+char http_bind[64]="127.0.0.1"; // address it listens on, --http-bind=0.0.0.0 for every interface
+long sample_buffer=86400;  // samples kept in memory for it
+sample_ring_t samples;
+int http_epfd=-1;
+int http_evfd=-1;
+pthread_t http_tid;
+volatile int http_running=0;
+conn_t* http_conns=NULL;
+long http_sent=0;          // samples already sent to WebSocket clients
+timecache_t http_tcache;
+#if TELEMETRY
+static const char* stage_names[NSTAGES]={"spi", "convert", "format", "write", "lcd"};
+#endif
+
+/******************************************************************************
+ * Sample buffer. Every logged row is also kept in memory, in a ring of
+ * sample_buffer entries, for the HTTP server to answer from.
+ ******************************************************************************/
+void
+ring_init(sample_ring_t* r, long cap)
+{
+	r->s=calloc(cap, sizeof(sample_t));
+	r->cap=cap;
+	r->head=0;
+	pthread_mutex_init(&r->lock, NULL);
+}
+
+void
+ring_push(sample_ring_t* r, sample_t* s)
+{
+	pthread_mutex_lock(&r->lock);
+	r->s[r->head%r->cap]=*s;
+	r->head++;
+	pthread_mutex_unlock(&r->lock);
+}
+
+// index of the first sample at or after from, samples are in time order
+long
+ring_find(sample_ring_t* r, time_t from)
+{
+	long lo;
+	long hi;
+	long mid;
+
+	pthread_mutex_lock(&r->lock);
+	lo=r->head>r->cap ? r->head-r->cap : 0;
+	hi=r->head;
+	while (lo<hi)
+	{
+		mid=(lo+hi)/2;
+		if (r->s[mid%r->cap].t<from)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return(lo);
+}
+
+/******************************************************************************
+ * function: ring_read(sample_ring_t* r, long* next, time_t to, sample_t* out, int max)
+ * introduction: copy up to max samples with t <= to, starting at index *next,
+ * so they can be formatted without holding up the logging loop. *next moves
+ * past them, and past any the ring has overwritten meanwhile.
+ * return value: number of samples copied
+ ******************************************************************************/
+int
+ring_read(sample_ring_t* r, long* next, time_t to, sample_t* out, int max)
+{
+	int n=0;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->head-*next>r->cap)
+		*next=r->head-r->cap;
+	while (n<max && *next<r->head && r->s[*next%r->cap].t<=to)
+	{
+		out[n++]=r->s[*next%r->cap];
+		(*next)++;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return(n);
+}
+
+// latest sample, returns 0 if there is none yet
+int
+ring_latest(sample_ring_t* r, sample_t* s)
+{
+	int ret=0;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->head>0)
+	{
+		*s=r->s[(r->head-1)%r->cap];
+		ret=1;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return(ret);
+}
+
+// {"time":"HH:MM:SS","unix":...,"elapsed":...,"temp":[...]}
+int
+format_sample_json(timecache_t* tc, char* out, sample_t* s)
+{
+	int len;
+	int i;
+
+	memcpy(out, "{\"time\":\"", 9);
+	len=9;
+	len+=fmt_hms(tc, s->t, out+len);
+	memcpy(out+len, "\",\"unix\":", 9);
+	len+=9;
+	len+=fmt_uint(out+len, s->t);
+	memcpy(out+len, ",\"elapsed\":", 11);
+	len+=11;
+	len+=fmt_uint(out+len, s->elapsed);
+	memcpy(out+len, ",\"temp\":[", 9);
+	len+=9;
+	for (i=0; i<s->nboards; i++)
+	{
+		if (i)
+			out[len++]=',';
+		len+=fmt_tenths(out+len, s->temp10[i]);
+	}
+	out[len++]=']';
+	out[len++]='}';
+	return(len);
+}
+
+/******************************************************************************
+ * SHA-1 and base64, only needed for the WebSocket handshake
+ ******************************************************************************/
+#define ROL32(v, n) (((v)<<(n)) | ((v)>>(32-(n))))
+
+void
+sha1_block(uint32_t h[5], const unsigned char* block)
+{
+	uint32_t w[80];
+	uint32_t a, b, c, d, e, f, k, tmp;
+	int i;
+
+	for (i=0; i<16; i++)
+		w[i]=((uint32_t)block[4*i]<<24) | (block[4*i+1]<<16) | (block[4*i+2]<<8) | block[4*i+3];
+	for (i=16; i<80; i++)
+		w[i]=ROL32(w[i-3]^w[i-8]^w[i-14]^w[i-16], 1);
+	a=h[0]; b=h[1]; c=h[2]; d=h[3]; e=h[4];
+	for (i=0; i<80; i++)
+	{
+		if (i<20)      { f=(b&c)|((~b)&d);    k=0x5A827999; }
+		else if (i<40) { f=b^c^d;             k=0x6ED9EBA1; }
+		else if (i<60) { f=(b&c)|(b&d)|(c&d); k=0x8F1BBCDC; }
+		else           { f=b^c^d;             k=0xCA62C1D6; }
+		tmp=ROL32(a, 5)+f+e+k+w[i];
+		e=d; d=c; c=ROL32(b, 30); b=a; a=tmp;
+	}
+	h[0]+=a; h[1]+=b; h[2]+=c; h[3]+=d; h[4]+=e;
+}
+
+void
+sha1(const unsigned char* data, size_t len, unsigned char digest[20])
+{
+	uint32_t h[5]={0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+	unsigned char tail[128];
+	uint64_t bits=(uint64_t)len*8;
+	size_t i;
+	size_t r=len%64;
+	size_t tl;
+
+	for (i=0; i+64<=len; i+=64)
+		sha1_block(h, data+i);
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, data+len-r, r);
+	tail[r]=0x80;
+	tl=r<56 ? 64 : 128;
+	for (i=0; i<8; i++)
+		tail[tl-1-i]=(bits>>(8*i)) & 0xff;
+	sha1_block(h, tail);
+	if (tl==128)
+		sha1_block(h, tail+64);
+	for (i=0; i<20; i++)
+		digest[i]=(h[i/4]>>(24-8*(i%4))) & 0xff;
+}
+
+int
+base64_encode(const unsigned char* in, int len, char* out)
+{
+	static const char tbl[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	int i;
+	int n=0;
+	uint32_t v;
+
+	for (i=0; i<len; i+=3)
+	{
+		v=in[i]<<16;
+		if (i+1<len)
+			v|=in[i+1]<<8;
+		if (i+2<len)
+			v|=in[i+2];
+		out[n++]=tbl[(v>>18) & 63];
+		out[n++]=tbl[(v>>12) & 63];
+		out[n++]=i+1<len ? tbl[(v>>6) & 63] : '=';
+		out[n++]=i+2<len ? tbl[v & 63] : '=';
+	}
+	out[n]=0;
+	return(n);
+}
+
+/******************************************************************************
+ * Embedded HTTP server (--http=<port>). One thread runs an epoll loop over
+ * the listening socket, the client connections and an eventfd that the
+ * logging loop pokes after each new sample. Endpoints:
+ * /latest                  latest sample as JSON
+ * /range?from=<u>&to=<u>   JSON array of the buffered samples in a unix time range
+ * /stream                  WebSocket, one JSON text frame per sample
+ * Plain HTTP requests are answered and closed, there is no keep-alive.
+ ******************************************************************************/
+
+// queue data on a connection, writing straight away if nothing is pending
+int
+conn_send(conn_t* c, const char* data, int len)
+{
+	int ret;
+	struct epoll_event ev;
+
+	if (c->outlen==0)
+	{
+		ret=send(c->fd, data, len, MSG_NOSIGNAL);
+		if (ret<0 && errno!=EAGAIN && errno!=EWOULDBLOCK)
+			return(-1);
+		if (ret<0)
+			ret=0;
+		data+=ret;
+		len-=ret;
+		if (len==0)
+			return(0);
+	}
+	if (c->kind==CONN_WS && c->outlen+len>WS_BACKLOG_MAX) // client isn't keeping up
+		return(-1);
+	if (c->outlen+len>c->outcap)
+	{
+		c->outcap=2*(c->outlen+len);
+		c->out=realloc(c->out, c->outcap);
+	}
+	memcpy(c->out+c->outlen, data, len);
+	c->outlen+=len;
+	ev.events=EPOLLIN|EPOLLOUT;
+	ev.data.ptr=c;
+	epoll_ctl(http_epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	return(0);
+}
+
+// write out what conn_send() could not, returns -1 when the connection should go
+int
+conn_drain(conn_t* c)
+{
+	int ret;
+	struct epoll_event ev;
+
+	while (c->outlen>0)
+	{
+		ret=send(c->fd, c->out, c->outlen, MSG_NOSIGNAL);
+		if (ret<0)
+		{
+			if (errno==EAGAIN || errno==EWOULDBLOCK)
+				return(0);
+			return(-1);
+		}
+		memmove(c->out, c->out+ret, c->outlen-ret);
+		c->outlen-=ret;
+		if (c->outlen==0 && c->range_open && http_range_fill(c)<0)
+			return(-1);
+	}
+	if (c->close_after)
+		return(-1);
+	ev.events=EPOLLIN;
+	ev.data.ptr=c;
+	epoll_ctl(http_epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	return(0);
+}
+
+void
+conn_close(conn_t* c)
+{
+	conn_t** p;
+
+	epoll_ctl(http_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	for (p=&http_conns; *p; p=&(*p)->next)
+	{
+		if (*p==c)
+		{
+			*p=c->next;
+			break;
+		}
+	}
+	free(c->out);
+	free(c);
+}
+
+conn_t*
+conn_add(int fd, int kind)
+{
+	conn_t* c;
+	struct epoll_event ev;
+
+	c=calloc(1, sizeof(conn_t));
+	c->fd=fd;
+	c->kind=kind;
+	ev.events=EPOLLIN;
+	ev.data.ptr=c;
+	if (epoll_ctl(http_epfd, EPOLL_CTL_ADD, fd, &ev)<0)
+	{
+		free(c);
+		return(NULL);
+	}
+	c->next=http_conns;
+	http_conns=c;
+	return(c);
+}
+
+// send a complete response and close once it is out
+int
+http_respond(conn_t* c, const char* status, const char* type, const char* body, int len)
+{
+	char hdr[256];
+	int hlen;
+
+	// any origin may read, what can reach the server is up to --http-bind
+	hlen=snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %d\r\n"
+		"Access-Control-Allow-Origin: *\r\nConnection: close\r\n\r\n", status, type, len);
+	c->close_after=1;
+	if (conn_send(c, hdr, hlen)<0 || conn_send(c, body, len)<0)
+		return(-1);
+	if (c->outlen==0)
+		return(-1); // all sent, done with it
+	return(0);
+}
+
+// value of ?name=<long> in the query string, or def
+long
+query_long(const char* query, const char* name, long def)
+{
+	const char* p=query;
+	int n=strlen(name);
+
+	while (p && *p)
+	{
+		if (strncmp(p, name, n)==0 && p[n]=='=')
+			return(atol(p+n+1));
+		p=strchr(p, '&');
+		if (p)
+			p++;
+	}
+	return(def);
+}
+
+// case insensitive search for a header, copies its value into val
+int
+http_header(const char* req, const char* name, char* val, int vlen)
+{
+	const char* p=req;
+	int n=strlen(name);
+	int i;
+
+	while ((p=strstr(p, "\r\n"))!=NULL)
+	{
+		p+=2;
+		if (strncasecmp(p, name, n)==0 && p[n]==':')
+		{
+			p+=n+1;
+			while (*p==' ')
+				p++;
+			for (i=0; i<vlen-1 && p[i] && p[i]!='\r'; i++)
+				val[i]=p[i];
+			val[i]=0;
+			return(1);
+		}
+	}
+	return(0);
+}
+
+// send one WebSocket frame, header and payload in one send()
+int
+ws_send(conn_t* c, int opcode, const char* data, int len)
+{
+	char buf[4+HTTP_INBUF];    // the largest frame we send is a pong to the largest ping
+	char* frame=buf;
+	int hlen=2;
+	int ret;
+
+	if (4+len>(int)sizeof(buf) && (frame=malloc(4+len))==NULL)
+		return(-1);
+	frame[0]=0x80 | opcode; // FIN
+	if (len<126)
+	{
+		frame[1]=len;
+	}
+	else
+	{
+		frame[1]=126;
+		frame[2]=(len>>8) & 0xff;
+		frame[3]=len & 0xff;
+		hlen=4;
+	}
+	memcpy(frame+hlen, data, len);
+	ret=conn_send(c, frame, hlen+len);
+	if (frame!=buf)
+		free(frame);
+	return(ret);
+}
+
+int
+http_upgrade_ws(conn_t* c, const char* req)
+{
+	char key[128];
+	char resp[256];
+	unsigned char digest[20];
+	char accept[32];
+	char js[JSON_SAMPLE_LEN];
+	char* end;
+	int len;
+	sample_t s;
+
+	if (!http_header(req, "Sec-WebSocket-Key", key, sizeof(key)-40))
+		return(http_respond(c, "400 Bad Request", "text/plain", "missing key\n", 12));
+	strcat(key, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+	sha1((unsigned char*)key, strlen(key), digest);
+	base64_encode(digest, 20, accept);
+	len=snprintf(resp, sizeof(resp), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+		"Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+	c->kind=CONN_WS;
+	// a client may send its first frames in the same packet as the request
+	end=strstr(c->in, "\r\n\r\n")+4;
+	c->inlen-=end-c->in;
+	memmove(c->in, end, c->inlen);
+	if (conn_send(c, resp, len)<0)
+		return(-1);
+	// start the client off with the current value
+	if (ring_latest(&samples, &s))
+	{
+		len=format_sample_json(&http_tcache, js, &s);
+		if (ws_send(c, 1, js, len)<0)
+			return(-1);
+	}
+	return(ws_input(c));
+}
+
+/******************************************************************************
+ * function: http_range_fill(conn_t* c)
+ * introduction: format the next samples of a /range answer, RANGE_CHUNK at a
+ * time, for as long as the socket takes them. conn_drain() calls it again
+ * once the socket has room, so a day of samples never sits in memory as JSON.
+ * return value: -1 when the connection should go
+ ******************************************************************************/
+int
+http_range_fill(conn_t* c)
+{
+	sample_t list[RANGE_CHUNK];
+	char body[RANGE_CHUNK*(JSON_SAMPLE_LEN+1)+2];
+	int n;
+	int i;
+	int len;
+
+	while (c->outlen==0 && c->range_open)
+	{
+		n=ring_read(&samples, &c->range_next, c->range_to, list, RANGE_CHUNK);
+		len=0;
+		for (i=0; i<n; i++)
+		{
+			if (c->range_sent++)
+				body[len++]=',';
+			len+=format_sample_json(&http_tcache, body+len, &list[i]);
+		}
+		if (n<RANGE_CHUNK)
+		{
+			body[len++]=']';
+			body[len++]='\n';
+			c->range_open=0;
+			c->close_after=1;
+		}
+		if (conn_send(c, body, len)<0)
+			return(-1);
+	}
+	if (!c->range_open && c->outlen==0)
+		return(-1); // all sent, done with it
+	return(0);
+}
+
+// /range, a JSON array streamed without a Content-Length, the end of the
+// array is the end of the connection
+int
+http_range(conn_t* c, const char* query)
+{
+	static const char hdr[]="HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+		"Access-Control-Allow-Origin: *\r\nConnection: close\r\n\r\n[";
+
+	c->range_next=ring_find(&samples, query_long(query, "from", 0));
+	c->range_to=query_long(query, "to", 0x7fffffffL);
+	c->range_sent=0;
+	c->range_open=1;
+	if (conn_send(c, hdr, sizeof(hdr)-1)<0)
+		return(-1);
+	return(http_range_fill(c));
+}
+
+#if TELEMETRY
+// one histogram in Prometheus text format, returns the length added
+int
+metrics_hist(char* out, int size, const char* name, const char* label, stat_hist_t* h)
+{
+	int len=0;
+	int i;
+	uint64_t cum=0;
+	const char* sep=label[0] ? "," : "";
+	const char* lb=label[0] ? "{" : "";
+	const char* rb=label[0] ? "}" : "";
+
+	for (i=0; i<STAT_BUCKETS; i++)
+	{
+		cum+=__atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+		len+=snprintf(out+len, size-len, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, label, sep,
+			(double)(1ULL<<i)/1E6, (unsigned long long)cum);
+	}
+	len+=snprintf(out+len, size-len, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, sep,
+		(unsigned long long)__atomic_load_n(&h->count, __ATOMIC_RELAXED));
+	len+=snprintf(out+len, size-len, "%s_sum%s%s%s %.9f\n", name, lb, label, rb,
+		__atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED)/1E9);
+	len+=snprintf(out+len, size-len, "%s_count%s%s%s %llu\n", name, lb, label, rb,
+		(unsigned long long)__atomic_load_n(&h->count, __ATOMIC_RELAXED));
+	return(len);
+}
+
+// /metrics, the telemetry in Prometheus text exposition format
+int
+http_metrics(conn_t* c)
+{
+	int size=(NSTAGES+1)*(STAT_BUCKETS+6)*96+2048;
+	char* body=malloc(size);
+	char label[48];
+	int len=0;
+	int i;
+	int ret;
+
+	len+=snprintf(body+len, size-len, "# HELP therm_stage_seconds Time spent in each stage of the acquisition loop, convert is sampled 1 in %d.\n"
+		"# TYPE therm_stage_seconds histogram\n", TM_CONVERT_EVERY);
+	for (i=0; i<NSTAGES; i++)
+	{
+		snprintf(label, sizeof(label), "stage=\"%s\"", stage_names[i]);
+		len+=metrics_hist(body+len, size-len, "therm_stage_seconds", label, &telemetry.stage[i]);
+	}
+	len+=snprintf(body+len, size-len, "# HELP therm_stage_max_seconds Longest time seen in each stage.\n"
+		"# TYPE therm_stage_max_seconds gauge\n");
+	for (i=0; i<NSTAGES; i++)
+		len+=snprintf(body+len, size-len, "therm_stage_max_seconds{stage=\"%s\"} %.9f\n", stage_names[i],
+			__atomic_load_n(&telemetry.stage[i].max_ns, __ATOMIC_RELAXED)/1E9);
+	len+=snprintf(body+len, size-len, "# HELP therm_wakeup_late_seconds How late clock_nanosleep returned after the tick time.\n"
+		"# TYPE therm_wakeup_late_seconds histogram\n");
+	len+=metrics_hist(body+len, size-len, "therm_wakeup_late_seconds", "", &telemetry.wakeup);
+	len+=snprintf(body+len, size-len, "# TYPE therm_wakeup_late_max_seconds gauge\ntherm_wakeup_late_max_seconds %.9f\n",
+		__atomic_load_n(&telemetry.wakeup.max_ns, __ATOMIC_RELAXED)/1E9);
+	len+=snprintf(body+len, size-len, "# HELP therm_ticks_total Acquisition ticks.\n# TYPE therm_ticks_total counter\ntherm_ticks_total %llu\n",
+		(unsigned long long)__atomic_load_n(&telemetry.ticks, __ATOMIC_RELAXED));
+	len+=snprintf(body+len, size-len, "# HELP therm_samples_total Rows output.\n# TYPE therm_samples_total counter\ntherm_samples_total %llu\n",
+		(unsigned long long)__atomic_load_n(&telemetry.samples, __ATOMIC_RELAXED));
+	len+=snprintf(body+len, size-len, "# HELP therm_overruns_total Ticks still running when the next one was due.\n# TYPE therm_overruns_total counter\ntherm_overruns_total %llu\n",
+		(unsigned long long)__atomic_load_n(&telemetry.overruns, __ATOMIC_RELAXED));
+	ret=http_respond(c, "200 OK", "text/plain; version=0.0.4", body, len);
+	free(body);
+	return(ret);
+}
+#endif
+
+// a complete request header is in c->in, returns -1 to close the connection
+int
+http_request(conn_t* c)
+{
+	char path[256];
+	char val[64];
+	char js[JSON_SAMPLE_LEN];
+	char* query;
+	int len;
+	sample_t s;
+
+	if (sscanf(c->in, "GET %255s", path)!=1)
+		return(http_respond(c, "405 Method Not Allowed", "text/plain", "GET only\n", 9));
+	query=strchr(path, '?');
+	if (query)
+		*query++=0;
+	else
+		query="";
+
+	if (strcmp(path, "/stream")==0 && http_header(c->in, "Upgrade", val, sizeof(val))
+		&& strcasecmp(val, "websocket")==0)
+		return(http_upgrade_ws(c, c->in));
+	if (strcmp(path, "/latest")==0)
+	{
+		if (!ring_latest(&samples, &s))
+			return(http_respond(c, "503 Service Unavailable", "application/json", "{}\n", 3));
+		len=format_sample_json(&http_tcache, js, &s);
+		js[len++]='\n';
+		return(http_respond(c, "200 OK", "application/json", js, len));
+	}
+	if (strcmp(path, "/range")==0)
+		return(http_range(c, query));
+#if TELEMETRY
+	if (strcmp(path, "/metrics")==0)
+		return(http_metrics(c));
+#endif
+	return(http_respond(c, "404 Not Found", "text/plain", "not found\n", 10));
+}
+
+// handle the frames a WebSocket client sends, we only care about ping and close
+int
+ws_input(conn_t* c)
+{
+	unsigned char* p;
+	uint64_t plen;
+	int hlen;
+	int opcode;
+	int i;
+	unsigned char* mask;
+
+	while (c->inlen>=2)
+	{
+		p=(unsigned char*)c->in;
+		opcode=p[0] & 0x0f;
+		plen=p[1] & 0x7f;
+		hlen=2;
+		if (plen==126)
+		{
+			if (c->inlen<4)
+				return(0);
+			plen=(p[2]<<8) | p[3];
+			hlen=4;
+		}
+		else if (plen==127)
+		{
+			return(-1); // nothing a client should send us is that big
+		}
+		if (p[1] & 0x80)
+			hlen+=4;
+		if (hlen+plen>HTTP_INBUF)
+			return(-1);
+		if (c->inlen<hlen+(int)plen)
+			return(0);
+		if (p[1] & 0x80)
+		{
+			mask=p+hlen-4;
+			for (i=0; i<(int)plen; i++)
+				p[hlen+i]^=mask[i%4];
+		}
+		if (opcode==8) // close
+		{
+			ws_send(c, 8, (char*)p+hlen, plen>2 ? 2 : plen);
+			return(-1);
+		}
+		if (opcode==9) // ping
+		{
+			if (ws_send(c, 10, (char*)p+hlen, plen)<0)
+				return(-1);
+		}
+		memmove(c->in, c->in+hlen+plen, c->inlen-hlen-plen);
+		c->inlen-=hlen+plen;
+	}
+	return(0);
+}
+
+int
+conn_input(conn_t* c)
+{
+	int ret;
+
+	ret=recv(c->fd, c->in+c->inlen, HTTP_INBUF-1-c->inlen, 0);
+	if (ret<=0)
+		return((ret<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) ? 0 : -1);
+	c->inlen+=ret;
+	c->in[c->inlen]=0;
+	if (c->kind==CONN_WS)
+		return(ws_input(c));
+	if (c->close_after || c->range_open) // already answered, ignore anything else
+	{
+		c->inlen=0;
+		return(0);
+	}
+	if (strstr(c->in, "\r\n\r\n"))
+		return(http_request(c));
+	if (c->inlen>=HTTP_INBUF-1)
+		return(http_respond(c, "431 Request Header Fields Too Large", "text/plain", "too large\n", 10));
+	return(0);
+}
+
+// send the samples added since the last broadcast to every WebSocket client
+void
+ws_broadcast(void)
+{
+	char js[JSON_SAMPLE_LEN];
+	sample_t s;
+	conn_t* c;
+	conn_t* next;
+	long head;
+	int len;
+
+	pthread_mutex_lock(&samples.lock);
+	head=samples.head;
+	pthread_mutex_unlock(&samples.lock);
+	if (head-http_sent>samples.cap)
+		http_sent=head-samples.cap;
+	while (http_sent<head)
+	{
+		pthread_mutex_lock(&samples.lock);
+		s=samples.s[http_sent%samples.cap];
+		pthread_mutex_unlock(&samples.lock);
+		http_sent++;
+		len=format_sample_json(&http_tcache, js, &s);
+		for (c=http_conns; c; c=next)
+		{
+			next=c->next;
+			if (c->kind==CONN_WS && ws_send(c, 1, js, len)<0)
+				conn_close(c);
+		}
+	}
+}
+
+void*
+http_thread(void* arg)
+{
+	struct epoll_event evs[32];
+	conn_t* c;
+	int n;
+	int i;
+	int fd;
+	int broadcast;
+	uint64_t v;
+
+	while (http_running)
+	{
+		n=epoll_wait(http_epfd, evs, 32, -1);
+		broadcast=0;
+		for (i=0; i<n; i++)
+		{
+			c=(conn_t*)evs[i].data.ptr;
+			if (c->kind==CONN_EVENT)
+			{
+				read(c->fd, &v, sizeof(v));
+				broadcast=1;
+			}
+			else if (c->kind==CONN_LISTEN)
+			{
+				while ((fd=accept4(c->fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC))>=0)
+				{
+					if (conn_add(fd, CONN_HTTP)==NULL)
+						close(fd);
+				}
+			}
+			else
+			{
+				if ((evs[i].events & (EPOLLERR|EPOLLHUP))
+					|| ((evs[i].events & EPOLLOUT) && conn_drain(c)<0)
+					|| ((evs[i].events & EPOLLIN) && conn_input(c)<0))
+					conn_close(c);
+			}
+		}
+		// after the batch, ws_broadcast() may close clients that later evs[] still point at
+		if (broadcast)
+			ws_broadcast();
+	}
+	while (http_conns)
+		conn_close(http_conns);
+	return(NULL);
+}
+
+int
+http_start(int port)
+{
+	struct sockaddr_in addr;
+	int fd;
+	int one=1;
+	sigset_t set;
+	sigset_t oldset;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family=AF_INET;
+	addr.sin_port=htons(port);
+	if (inet_pton(AF_INET, http_bind, &addr.sin_addr)!=1)
+	{
+		fprintf(stderr, "Error: --http-bind=%s is not an IPv4 address\n", http_bind);
+		return(-1);
+	}
+	http_epfd=epoll_create1(EPOLL_CLOEXEC);
+	fd=socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))<0 || listen(fd, 16)<0)
+	{
+		fprintf(stderr, "Error listening on %s:%d: %s\n", http_bind, port, strerror(errno));
+		close(fd);
+		return(-1);
+	}
+	conn_add(fd, CONN_LISTEN);
+	http_evfd=eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	conn_add(http_evfd, CONN_EVENT);
+	http_running=1;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &oldset);
+	if (pthread_create(&http_tid, NULL, http_thread, NULL)!=0)
+	{
+		fprintf(stderr, "Error starting HTTP server\n");
+		http_running=0;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	return(http_running ? 0 : -1);
+}
+
+// tell the server thread a new sample is in the ring
+void
+http_notify(void)
+{
+	uint64_t v=1;
+
+	if (http_running)
+		write(http_evfd, &v, sizeof(v));
+}
+
+void
+http_stop(void)
+{
+	uint64_t v=1;
+
+	if (!http_running)
+		return;
+	http_running=0;
+	write(http_evfd, &v, sizeof(v)); // wake up epoll_wait
+	pthread_join(http_tid, NULL);
+	close(http_epfd);
+}
@@ -0,0 +1,90 @@
+/**********************************************************************************************
+ * therm_http.h
+ * Embedded HTTP/WebSocket server (--http): /latest, /range, the /stream
+ * WebSocket and /metrics, answered from the in-memory sample ring.
+ ************************************************************************************************/
+
+#ifndef THERM_HTTP_H
+#define THERM_HTTP_H
+
+#include "therm.h"
+
+#define HTTP_INBUF 4096
+#define WS_BACKLOG_MAX (1024*1024)
+#define JSON_SAMPLE_LEN (96+12*MAX_BOARDS)
+#define RANGE_CHUNK 64 // samples formatted at a time for /range
+#define CONN_LISTEN 0
+#define CONN_EVENT 1
+#define CONN_HTTP 2
+#define CONN_WS 3
+
+typedef struct sample_ring_s
+{
+	sample_t* s;
+	long cap;
+	long head;                 // number of samples ever pushed
+	pthread_mutex_t lock;
+} sample_ring_t;
+
+// a socket watched by the HTTP server's epoll loop
+typedef struct conn_s
+{
+	int fd;
+	int kind;                  // CONN_LISTEN, CONN_EVENT, CONN_HTTP or CONN_WS
+	char in[HTTP_INBUF];
+	int inlen;
+	char* out;                 // data the socket would not take yet
+	int outlen;
+	int outcap;
+	int close_after;           // close once out is drained
+	int range_open;            // a /range answer is being streamed
+	long range_next;           // its next ring index
+	time_t range_to;
+	long range_sent;
+	struct conn_s* next;
+} conn_t;
+
+extern int http_port;
+extern char http_bind[64];
+extern long sample_buffer;
+extern sample_ring_t samples;
+extern int http_epfd;
+extern int http_evfd;
+extern pthread_t http_tid;
+extern volatile int http_running;
+extern conn_t* http_conns;
+extern long http_sent;
+extern timecache_t http_tcache;
+
+void ring_init(sample_ring_t* r, long cap);
+void ring_push(sample_ring_t* r, sample_t* s);
+long ring_find(sample_ring_t* r, time_t from);
+int ring_read(sample_ring_t* r, long* next, time_t to, sample_t* out, int max);
+int ring_latest(sample_ring_t* r, sample_t* s);
+int format_sample_json(timecache_t* tc, char* out, sample_t* s);
+void sha1_block(uint32_t h[5], const unsigned char* block);
+void sha1(const unsigned char* data, size_t len, unsigned char digest[20]);
+int base64_encode(const unsigned char* in, int len, char* out);
+int conn_send(conn_t* c, const char* data, int len);
+int conn_drain(conn_t* c);
+void conn_close(conn_t* c);
+conn_t* conn_add(int fd, int kind);
+int http_respond(conn_t* c, const char* status, const char* type, const char* body, int len);
+long query_long(const char* query, const char* name, long def);
+int http_header(const char* req, const char* name, char* val, int vlen);
+int ws_send(conn_t* c, int opcode, const char* data, int len);
+int http_upgrade_ws(conn_t* c, const char* req);
+int http_range_fill(conn_t* c);
+int http_range(conn_t* c, const char* query);
+int metrics_hist(char* out, int size, const char* name, const char* label, stat_hist_t* h);
+int http_metrics(conn_t* c);
+int http_request(conn_t* c);
+int ws_input(conn_t* c);
+int conn_input(conn_t* c);
+void ws_broadcast(void);
+void* http_thread(void* arg);
+int http_start(int port);
+void http_notify(void);
+void http_stop(void);
+
+#endif
@@ -0,0 +1,173 @@
+/**********************************************************************************************
+ * therm_shm.h
+ * Layout of the shared memory segment published by 'therm --shm' and a small
+ * reader API for C programs. The Node (thermshm.js) and Python (flask/thermshm.py)
+ * readers use the same offsets, so keep them in step with any change here.
+ *
+ * The segment (default /dev/shm/therm) is:
+ * offset 0    header (32 bytes)
+ * offset 32   latest slot, rewritten every acquisition tick
+ * offset 96   ring of ring_size slots, one per logged row, slot = index % ring_size
+ *
+ * Every slot is protected by a seqlock: the writer makes seq odd, writes the
+ * sample and makes seq even again. A reader copies the slot and retries if
+ * seq was odd or changed meanwhile. Readers never block the logger and, once
+ * the segment is mapped, need no system calls.
+ *
+ * Build the example reader with:
+ * gcc -o thermshm thermshm.c -lrt
+ ************************************************************************************************/
+
+#ifndef THERM_SHM_H
+#define THERM_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define THERM_SHM_NAME "/therm"
+#define THERM_SHM_MAGIC 0x4d524854 // "THRM"
+#define THERM_SHM_VERSION 1
+#define THERM_SHM_BOARDS 8
+
+// one sample, 64 bytes
+typedef struct therm_shm_slot_s
+{
+	uint32_t seq;              // seqlock, odd while the slot is being written
+	uint32_t pad;
+	uint64_t index;            // sample number, tells a reader which lap of the ring it got
+	int64_t t;                 // unix time
+	int32_t elapsed;
+	int32_t nboards;
+	int32_t temp10[THERM_SHM_BOARDS]; // tenths of a degree
+} therm_shm_slot_t;
+
+typedef struct therm_shm_s
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ring_size;        // slots in the ring
+	uint32_t slot_size;        // sizeof(therm_shm_slot_t)
+	uint32_t pid;              // logger pid, 0 once it has stopped
+	uint32_t pad;
+	uint64_t head;             // logged rows so far, the newest is at (head-1) % ring_size
+	therm_shm_slot_t latest;
+	therm_shm_slot_t ring[];
+} therm_shm_t;
+
+_Static_assert(sizeof(therm_shm_slot_t)==64, "therm_shm_slot_t layout");
+_Static_assert(sizeof(therm_shm_t)==96, "therm_shm_t layout");
+
+static inline size_t
+therm_shm_size(uint32_t ring_size)
+{
+	return(sizeof(therm_shm_t)+ring_size*sizeof(therm_shm_slot_t));
+}
+
+// writer side, copy a sample into a slot
+static inline void
+therm_shm_put(therm_shm_slot_t* slot, const therm_shm_slot_t* s)
+{
+	uint32_t seq=__atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&slot->seq, seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->index=s->index;
+	slot->t=s->t;
+	slot->elapsed=s->elapsed;
+	slot->nboards=s->nboards;
+	memcpy(slot->temp10, s->temp10, sizeof(slot->temp10));
+	__atomic_store_n(&slot->seq, seq+2, __ATOMIC_RELEASE);
+}
+
+// reader side, consistent copy of a slot
+static inline void
+therm_shm_get(const therm_shm_slot_t* slot, therm_shm_slot_t* out)
+{
+	uint32_t s1;
+	uint32_t s2;
+
+	do
+	{
+		s1=__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		memcpy(out, (const void*)slot, sizeof(therm_shm_slot_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2=__atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	} while ((s1 & 1) || s1!=s2);
+}
+
+// map a published segment read-only, returns NULL if there is none
+static inline therm_shm_t*
+therm_shm_open(const char* name)
+{
+	int fd;
+	struct stat st;
+	void* p;
+	therm_shm_t* shm;
+
+	fd=shm_open(name ? name : THERM_SHM_NAME, O_RDONLY, 0);
+	if (fd<0)
+		return(NULL);
+	if (fstat(fd, &st)<0 || st.st_size<(off_t)sizeof(therm_shm_t))
+	{
+		close(fd);
+		return(NULL);
+	}
+	p=mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p==MAP_FAILED)
+		return(NULL);
+	shm=(therm_shm_t*)p;
+	if (shm->magic!=THERM_SHM_MAGIC || shm->version!=THERM_SHM_VERSION
+		|| st.st_size<(off_t)therm_shm_size(shm->ring_size))
+	{
+		munmap(p, st.st_size);
+		return(NULL);
+	}
+	return(shm);
+}
+
+static inline void
+therm_shm_close(therm_shm_t* shm)
+{
+	munmap(shm, therm_shm_size(shm->ring_size));
+}
+
+// latest sample, returns 0 if the logger has not published one yet
+static inline int
+therm_shm_latest(const therm_shm_t* shm, therm_shm_slot_t* out)
+{
+	therm_shm_get(&shm->latest, out);
+	return(out->t!=0);
+}
+
+/**********************************************************************************************
+ * function: therm_shm_recent(const therm_shm_t* shm, therm_shm_slot_t* out, int n)
+ * introduction: copy up to n of the most recent logged rows, oldest first.
+ * Slots the logger overwrote while they were being read are skipped.
+ * return value: number of rows copied
+ **********************************************************************************************/
+static inline int
+therm_shm_recent(const therm_shm_t* shm, therm_shm_slot_t* out, int n)
+{
+	uint64_t head=__atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+	uint64_t i;
+	uint64_t first;
+	int got=0;
+
+	if ((uint64_t)n>shm->ring_size)
+		n=shm->ring_size;
+	first=head>(uint64_t)n ? head-n : 0;
+	for (i=first; i<head; i++)
+	{
+		therm_shm_get(&shm->ring[i%shm->ring_size], &out[got]);
+		if (out[got].index==i)
+			got++;
+	}
+	return(got);
+}
+
+#endif
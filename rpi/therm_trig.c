@@ -0,0 +1,414 @@
+/**********************************************************************************************
+ * therm_trig.c
+ * Trigger engine and captures, see therm_trig.h.
+ ************************************************************************************************/
+
+#include "therm.h"
+#include "therm_trig.h"
+
+// global variables
+trigger_t triggers[MAX_TRIGGERS];
+int ntriggers=0;
+int trig_rate=780;         // raw readings per second between ticks
+int64_t trig_period_ns;
+unsigned int trig_dr;      // ADS1118 data rate bits for those readings
+long pre_trigger=500;      // ms of readings saved before a trigger
+long post_trigger=500;     // and after it
+char capture_dir[FNAME_LEN]=".";
+
+/******************************************************************************
+ * Trigger engine (--trigger). Every raw thermocouple reading goes through
+ * trig_sample(): the 10 readings of each averaged measurement and, between
+ * ticks, readings taken at trig_rate with the ADS1118 at a matching data rate.
+ * The ADS1118 is busy with the averaged measurement for the first ~115 ms of
+ * every tick, so there the readings thin out: none for the ~25 ms of the
+ * internal sensor and first conversion, then one every 10 ms.
+ * Each board keeps the last pre_trigger+post_trigger ms of readings in a ring.
+ * When a trigger fires the alarm is printed and logged to triggers.csv in
+ * capture_dir, and once post_trigger ms have passed the readings from
+ * pre_trigger ms before the trigger to post_trigger ms after it are written
+ * to capture-<date>-<time>-<ms>-b<board>.csv there. The 1 s averaged log
+ * carries on as before. Triggers are evaluated on the board's bus worker,
+ * the alarm message and the files come from the background thread.
+ ******************************************************************************/
+
+// parse <condition>[,board=<n>][,hyst=<C>][,span=<ms>], where <condition> is
+// above=<C>, below=<C>, rate=<C/s> (negative for a falling rate) or window=<lo>:<hi>
+int
+trigger_add(char* spec)
+{
+	trigger_t* tr;
+	char* tok;
+	char* save;
+	double lo;
+	double hi;
+	double hyst=-1;
+
+	if (ntriggers==MAX_TRIGGERS)
+	{
+		fprintf(stderr, "Too many triggers, at most %d\n", MAX_TRIGGERS);
+		return(-1);
+	}
+	tr=&triggers[ntriggers];
+	memset(tr, 0, sizeof(trigger_t));
+	snprintf(tr->desc, sizeof(tr->desc), "%s", spec);
+	tr->board=-1;
+	tr->span_ms=250;
+	tr->kind=-1;
+	for (tok=strtok_r(spec, ",", &save); tok; tok=strtok_r(NULL, ",", &save))
+	{
+		if (strncmp(tok, "above=", 6)==0 || strncmp(tok, "below=", 6)==0)
+		{
+			tr->kind=TRIG_LEVEL;
+			tr->dir=tok[0]=='a' ? 1 : -1;
+			tr->lo=lround(atof(tok+6)*10);
+		}
+		else if (strncmp(tok, "rate=", 5)==0)
+		{
+			tr->kind=TRIG_RATE;
+			lo=atof(tok+5);
+			tr->dir=lo<0 ? -1 : 1;
+			tr->lo=lround(lo*100);
+		}
+		else if (strncmp(tok, "window=", 7)==0 && sscanf(tok+7, "%lf:%lf", &lo, &hi)==2 && lo<hi)
+		{
+			tr->kind=TRIG_WINDOW;
+			tr->lo=lround(lo*10);
+			tr->hi=lround(hi*10);
+		}
+		else if (strncmp(tok, "board=", 6)==0)
+		{
+			tr->board=atoi(tok+6);
+		}
+		else if (strncmp(tok, "hyst=", 5)==0)
+		{
+			hyst=atof(tok+5);
+		}
+		else if (strncmp(tok, "span=", 5)==0)
+		{
+			tr->span_ms=atoi(tok+5);
+		}
+		else
+		{
+			break;
+		}
+	}
+	if (tok || tr->kind<0 || tr->span_ms<1)
+	{
+		fprintf(stderr, "Bad trigger %s\n", tr->desc);
+		return(-1);
+	}
+	if (tr->kind==TRIG_RATE)
+		tr->hyst=lround((hyst<0 ? 0.1 : hyst)*100);
+	else
+		tr->hyst=lround((hyst<0 ? 0.5 : hyst)*10);
+	ntriggers++;
+	return(0);
+}
+
+// size the rings and pick the ADS1118 data rate, once the boards are known
+int
+trig_init(void)
+{
+	static const int dr_sps[8]={8, 16, 32, 64, 128, 250, 475, 860};
+	long keep_ms;
+	int i;
+	int d;
+
+	for (i=0; i<ntriggers; i++)
+	{
+		if (triggers[i].board>=nboards)
+		{
+			fprintf(stderr, "Trigger %s is for board %d, there are %d\n", triggers[i].desc, triggers[i].board, nboards);
+			return(-1);
+		}
+	}
+	if (trig_rate<1)
+		trig_rate=1;
+	if (pre_trigger<0)
+		pre_trigger=0;
+	if (post_trigger<0)
+		post_trigger=0;
+	// conversions must finish within the period, the ADS1118 clock is only good to 10%
+	for (d=0; d<7 && dr_sps[d]*10<trig_rate*11; d++)
+		;
+	if (dr_sps[d]*10<trig_rate*11)
+		trig_rate=dr_sps[d]*10/11;
+	trig_dr=d<<5;
+	trig_period_ns=1000000000LL/trig_rate;
+	// the ring holds a capture window, or a rate trigger's span if that is longer
+	keep_ms=pre_trigger+post_trigger;
+	for (i=0; i<ntriggers; i++)
+		if (triggers[i].kind==TRIG_RATE && triggers[i].span_ms>keep_ms)
+			keep_ms=triggers[i].span_ms;
+	for (i=0; i<nboards; i++)
+	{
+		// one extra second of readings so the pre-trigger part is always there
+		boards[i].raw_cap=(keep_ms+1000)*trig_rate/1000+64;
+		boards[i].raw=malloc(boards[i].raw_cap*sizeof(raw_sample_t));
+		if (boards[i].raw==NULL)
+		{
+			fprintf(stderr, "Error allocating the pre-trigger buffer\n");
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+// capture-<date>-<time>-<ms>-b<board>.csv in capture_dir, -1 if it does not fit in FNAME_LEN
+int
+capture_name(char* out, int board, int64_t at)
+{
+	struct tm tm;
+	time_t t=at/1000000000LL;
+	char tstring[32];
+
+	localtime_r(&t, &tm);
+	strftime(tstring, sizeof(tstring), "%Y%m%d-%H%M%S", &tm);
+	if (snprintf(out, FNAME_LEN, "%s/capture-%s-%03d-b%d.csv", capture_dir, tstring,
+		(int)(at/1000000 % 1000), board)>=FNAME_LEN)
+	{
+		fprintf(stderr, "Capture file name in %s is too long\n", capture_dir);
+		return(-1);
+	}
+	return(0);
+}
+
+// print the alarm and append a line to triggers.csv
+void
+trigger_log(void* arg)
+{
+	capture_job_t* job=(capture_job_t*)arg;
+	char path[FNAME_LEN+16];
+	char cname[FNAME_LEN];
+	char tstring[16];
+	FILE* f;
+	long pos;
+	time_t t;
+	struct tm tm;
+
+	tstring[fmt_tenths(tstring, job->t10)]='\0';
+	t=job->fired/1000000000LL;
+	localtime_r(&t, &tm);
+	printf("trigger %s on board %d: %s at %02d:%02d:%02d.%03d\n", triggers[job->trigger].desc, job->board,
+		tstring, tm.tm_hour, tm.tm_min, tm.tm_sec, (int)(job->fired/1000000 % 1000));
+	if (capture_name(cname, job->board, job->at)!=0)
+	{
+		free(job);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/triggers.csv", capture_dir);
+	f=fopen(path, "a");
+	if (f==NULL)
+	{
+		fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+		free(job);
+		return;
+	}
+	pos=ftell(f);
+	if (pos==0)
+		fprintf(f, "unix_ms,trigger,board,temperature,capture\n");
+	fprintf(f, "%lld,\"%s\",%d,%s,%s\n", (long long)(job->at/1000000), triggers[job->trigger].desc,
+		job->board, tstring, strrchr(cname, '/')+1);
+	fclose(f);
+	free(job);
+}
+
+// write a capture file, times are ms relative to the trigger
+void
+capture_write(void* arg)
+{
+	capture_job_t* job=(capture_job_t*)arg;
+	char path[FNAME_LEN];
+	char tstring[16];
+	FILE* f;
+	int i;
+	int64_t d;
+
+	if (capture_name(path, job->board, job->at)!=0)
+	{
+		free(job);
+		return;
+	}
+	f=fopen(path, "w");
+	if (f==NULL)
+	{
+		fprintf(stderr, "Error opening %s: %s\n", path, strerror(errno));
+		free(job);
+		return;
+	}
+	fprintf(f, "# trigger %s, board %d, at %lld.%03d, %d readings/s, every 10 ms in the averaged measurement at each tick\n",
+		triggers[job->trigger].desc, job->board, (long long)(job->at/1000000000LL), (int)(job->at/1000000 % 1000), trig_rate);
+	fprintf(f, "ms,temperature\n");
+	for (i=0; i<job->n; i++)
+	{
+		d=(job->s[i].ns-job->at)/1000; // us
+		tstring[fmt_tenths(tstring, job->s[i].t10)]='\0';
+		fprintf(f, "%s%lld.%03d,%s\n", d<0 ? "-" : "", (long long)(llabs(d)/1000), (int)(llabs(d)%1000), tstring);
+	}
+	fclose(f);
+	free(job);
+}
+
+// copy the capture window out of the ring and queue it for writing
+void
+capture_finish(board_t* b)
+{
+	capture_job_t* job;
+	int64_t from=b->capture_at-pre_trigger*1000000LL;
+	long first=b->raw_head>b->raw_cap ? b->raw_head-b->raw_cap : 0;
+	long i;
+
+	for (i=b->raw_head; i>first && b->raw[(i-1)%b->raw_cap].ns>=from; i--)
+		;
+	job=malloc(sizeof(capture_job_t)+(b->raw_head-i)*sizeof(raw_sample_t));
+	if (job)
+	{
+		job->trigger=b->capture_trigger;
+		job->board=b-boards;
+		job->at=b->capture_at;
+		job->fired=b->capture_at;
+		job->t10=b->capture_t10;
+		job->n=0;
+		for (; i<b->raw_head; i++)
+			job->s[job->n++]=b->raw[i%b->raw_cap];
+		bg_submit(capture_write, job);
+	}
+	b->capture_at=0;
+}
+
+// evaluate trigger i on the newest reading, returns 1 if it fires
+int
+trig_eval(board_t* b, int i, raw_sample_t* r)
+{
+	trigger_t* tr=&triggers[i];
+	raw_sample_t* old;
+	long first=b->raw_head>b->raw_cap ? b->raw_head-b->raw_cap : 0;
+	int64_t span=tr->span_ms*1000000LL;
+	int x=r->t10;
+	int fire;
+	int rearm;
+
+	if (tr->kind==TRIG_RATE)
+	{
+		// the newest reading that is at least span old
+		if (b->trig_lag[i]<first)
+			b->trig_lag[i]=first;
+		while (b->trig_lag[i]+1<b->raw_head && r->ns-b->raw[(b->trig_lag[i]+1)%b->raw_cap].ns>=span)
+			b->trig_lag[i]++;
+		old=&b->raw[b->trig_lag[i]%b->raw_cap];
+		if (r->ns-old->ns<span)
+			return(0); // not enough history yet
+		x=(int)((int64_t)(r->t10-old->t10)*10000000000LL/(r->ns-old->ns));
+	}
+	if (tr->kind==TRIG_WINDOW)
+	{
+		fire=x<tr->lo || x>tr->hi;
+		rearm=x>=tr->lo+tr->hyst && x<=tr->hi-tr->hyst;
+	}
+	else if (tr->dir>0)
+	{
+		fire=x>=tr->lo;
+		rearm=x<tr->lo-tr->hyst;
+	}
+	else
+	{
+		fire=x<=tr->lo;
+		rearm=x>tr->lo+tr->hyst;
+	}
+	if (b->trig_armed[i] && fire)
+	{
+		b->trig_armed[i]=0;
+		return(1);
+	}
+	if (rearm)
+		b->trig_armed[i]=1;
+	return(0);
+}
+
+// store a raw reading, check the triggers and finish a capture that is due
+void
+trig_sample(board_t* b, int v)
+{
+	raw_sample_t* r;
+	capture_job_t* job;
+	int board=b-boards;
+	int i;
+
+	r=&b->raw[b->raw_head%b->raw_cap];
+	r->ns=now_ns();
+	r->t10=v;
+	b->raw_head++;
+	for (i=0; i<ntriggers; i++)
+	{
+		if (triggers[i].board>=0 && triggers[i].board!=board)
+			continue;
+		if (!trig_eval(b, i, r))
+			continue;
+		// a trigger during a running capture is logged, the capture carries on
+		if (b->capture_at==0)
+		{
+			b->capture_at=r->ns;
+			b->capture_end=r->ns+post_trigger*1000000LL;
+			b->capture_trigger=i;
+			b->capture_t10=v;
+		}
+		// the alarm is printed by the background thread too, stdout may block
+		job=malloc(sizeof(capture_job_t));
+		if (job)
+		{
+			job->trigger=i;
+			job->board=board;
+			job->at=b->capture_at;
+			job->fired=r->ns;
+			job->t10=v;
+			job->n=0;
+			bg_submit(trigger_log, job);
+		}
+	}
+	if (b->capture_at && r->ns>=b->capture_end)
+		capture_finish(b);
+}
+
+// fast read for the trigger engine, external signal at trig_dr
+int
+trig_read(board_t* b)
+{
+	unsigned int tmp=(ADSCON_CH0 & ~ADS1118_DR_MASK) | trig_dr;
+
+	b->txbuf[0]=(unsigned char)((tmp>>8) & 0xff);
+	b->txbuf[1]=(unsigned char)(tmp & 0xff);
+	return(convert_code(b, therm_transact(b)));
+}
+
+/******************************************************************************
+ * function: trig_sample_until_tick(bus_worker_t* w)
+ * introduction: between averaged measurements, keep reading every board of
+ * the bus every trig_period_ns until just before the next tick (ticks are on
+ * whole seconds). The first reading returns the conversion bus_measure left
+ * running, after that each one starts the next conversion at trig_dr.
+ ******************************************************************************/
+void
+trig_sample_until_tick(bus_worker_t* w)
+{
+	struct timespec next;
+	int64_t t;
+	int64_t deadline;
+	int k;
+
+	t=now_ns();
+	deadline=(t/1000000000LL+1)*1000000000LL-TRIG_TICK_MARGIN_NS;
+	while (not_finished && t+trig_period_ns<deadline)
+	{
+		t+=trig_period_ns;
+		next.tv_sec=t/1000000000LL;
+		next.tv_nsec=t%1000000000LL;
+		if (sim_clock) // the main loop does the pacing
+			sim_ns=t;
+		else
+			while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next, NULL)==EINTR)
+				;
+		for (k=0; k<w->nboards; k++)
+			trig_sample(w->boards[k], trig_read(w->boards[k]));
+	}
+}
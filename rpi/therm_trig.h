@@ -0,0 +1,70 @@
+/**********************************************************************************************
+ * therm_trig.h
+ * Trigger engine (--trigger): level, rate and window alarms on the raw
+ * thermocouple readings, and the pre/post-trigger captures around them.
+ ************************************************************************************************/
+
+#ifndef THERM_TRIG_H
+#define THERM_TRIG_H
+
+#include "therm.h"
+
+#define CAPTURE_NAME_LEN 40 // what capture_name() adds to capture_dir
+#define TRIG_LEVEL 0
+#define TRIG_RATE 1
+#define TRIG_WINDOW 2
+#define ADS1118_DR_MASK (0x00E0)
+#define TRIG_TICK_MARGIN_NS 5000000LL // stop raw sampling this long before a tick
+
+/******************************************************************************
+ * A trigger condition, from --trigger. Values are in tenths of a degree, or
+ * hundredths of a degree per second for rate triggers. A trigger fires when its
+ * condition becomes true and is re-armed once the reading is back inside the
+ * limit by hyst, so a noisy signal sitting on a limit fires once. It starts
+ * disarmed, a condition that is already true at start up does not fire.
+ ******************************************************************************/
+typedef struct trigger_s
+{
+	int kind;                  // TRIG_LEVEL, TRIG_RATE or TRIG_WINDOW
+	int dir;                   // level and rate: 1 = fire at or above lo, -1 = at or below
+	int lo;
+	int hi;                    // window: fire outside lo..hi
+	int hyst;
+	int board;                 // board number, -1 = every board
+	int span_ms;               // rate: measured over this many ms
+	char desc[64];             // the spec, for messages
+} trigger_t;
+
+// a finished capture, written out by the background thread
+typedef struct capture_job_s
+{
+	int trigger;
+	int board;
+	int64_t at;                // trigger time, ns
+	int64_t fired;             // for trigger_log, when this trigger fired (at is its capture's)
+	int t10;                   // the reading that fired it
+	int n;
+	raw_sample_t s[];
+} capture_job_t;
+
+extern trigger_t triggers[MAX_TRIGGERS];
+extern int ntriggers;
+extern int trig_rate;
+extern int64_t trig_period_ns;
+extern unsigned int trig_dr;
+extern long pre_trigger;
+extern long post_trigger;
+extern char capture_dir[FNAME_LEN];
+
+int trigger_add(char* spec);
+int trig_init(void);
+int capture_name(char* out, int board, int64_t at);
+void trigger_log(void* arg);
+void capture_write(void* arg);
+void capture_finish(board_t* b);
+int trig_eval(board_t* b, int i, raw_sample_t* r);
+void trig_sample(board_t* b, int v);
+int trig_read(board_t* b);
+void trig_sample_until_tick(bus_worker_t* w);
+
+#endif
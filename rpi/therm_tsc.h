@@ -0,0 +1,398 @@
+/**********************************************************************************************
+ * therm_tsc.h
+ * Compressed log format, written by therm when the log file name ends in .tsc,
+ * with the encoder therm uses and a block decoder for C programs. The Python
+ * reader (flask/thermtsc.py) follows the same layout, so keep it in step with
+ * any change here.
+ *
+ * A .tsc file is a series of blocks, each of which decodes on its own, so a
+ * reader can skip straight past blocks outside the time range it wants and a
+ * file cut short by a crash loses only its last block. All fields are little
+ * endian. A block is:
+ * offset 0   header (32 bytes)
+ *            uint32 magic "TSCB", uint16 rows, uint8 columns, uint8 version,
+ *            uint32 payload bytes, int32 first elapsed,
+ *            int64 first unix time, int64 last unix time
+ * offset 32  int32 first temperature of each column, in tenths of a degree
+ * then       the payload: columns+2 streams of rows-1 zigzag varints each, one
+ *            after the other
+ *            unix time     delta of delta (the first value is a plain delta)
+ *            elapsed       delta of delta, likewise
+ *            temperatures  one stream per column, deltas in tenths
+ *
+ * Logged at a steady period the time streams are all zeros and temperatures
+ * rarely move more than a few tenths between rows, so a row costs about one
+ * byte per column plus two, against some 20 bytes of CSV.
+ *
+ * Next to each .tsc file therm keeps <file>.idx, one fixed size record per
+ * block with where it is and a summary of every column, so aggregates over
+ * long ranges can be answered from the index and only the blocks at the
+ * edges of a range need decoding. The index is only a cache: a reader that
+ * finds it missing or shorter than the data can rebuild it from the blocks.
+ * offset 0   header (16 bytes)
+ *            uint32 magic "TSCI", uint32 version, uint32 columns, uint32 record bytes
+ * then       one record per block (32 + 24 * columns bytes)
+ *            int64 block offset in the .tsc file, int64 first unix time, int64 last unix time,
+ *            uint32 rows, uint32 0,
+ *            per column: int32 min, int32 max, int32 first, int32 last, int64 sum
+ ************************************************************************************************/
+
+#ifndef THERM_TSC_H
+#define THERM_TSC_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TSC_MAGIC 0x42435354 // "TSCB"
+#define TSC_VERSION 1
+#define TSC_HEADER 32
+#define TSC_MAX_COLS 8
+#define TSC_VARINT_MAX 10
+#define TSC_INDEX_MAGIC 0x49435354 // "TSCI"
+#define TSC_INDEX_VERSION 1
+#define TSC_INDEX_HEADER 16
+#define TSC_INDEX_RECORD(ncols) (32+24*(ncols))
+
+typedef struct tsc_encoder_s
+{
+	int ncols;
+	int maxrows;               // rows per block
+	int align;                 // blocks also end on multiples of this many seconds, 0 = off
+	int nrows;                 // rows in the block being built
+	int64_t first_t;
+	int64_t last_t;
+	int64_t prev_dt;
+	int32_t first_elapsed;
+	int32_t last_elapsed;
+	int64_t prev_de;
+	int32_t first[TSC_MAX_COLS];
+	int32_t prev[TSC_MAX_COLS];
+	int32_t min[TSC_MAX_COLS];  // column summaries for the index
+	int32_t max[TSC_MAX_COLS];
+	int64_t sum[TSC_MAX_COLS];
+	uint8_t* stream[TSC_MAX_COLS+2]; // time, elapsed, then one per column
+	int len[TSC_MAX_COLS+2];
+} tsc_encoder_t;
+
+// a block as found in a file, see tsc_block_parse()
+typedef struct tsc_block_s
+{
+	int nrows;
+	int ncols;
+	int32_t first_elapsed;
+	int64_t first_t;
+	int64_t last_t;
+	const uint8_t* first;      // first temperatures
+	const uint8_t* payload;
+	uint32_t size;             // payload bytes
+} tsc_block_t;
+
+static inline void
+tsc_put32(uint8_t* p, uint32_t v)
+{
+	p[0]=v; p[1]=v>>8; p[2]=v>>16; p[3]=v>>24;
+}
+
+static inline uint32_t
+tsc_get32(const uint8_t* p)
+{
+	return(p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24));
+}
+
+static inline void
+tsc_put64(uint8_t* p, uint64_t v)
+{
+	tsc_put32(p, (uint32_t)v);
+	tsc_put32(p+4, (uint32_t)(v>>32));
+}
+
+static inline uint64_t
+tsc_get64(const uint8_t* p)
+{
+	return(tsc_get32(p) | ((uint64_t)tsc_get32(p+4)<<32));
+}
+
+// zigzag varint, small values of either sign take one byte
+static inline int
+tsc_put_varint(uint8_t* p, int64_t v)
+{
+	uint64_t u=((uint64_t)v<<1) ^ (uint64_t)(v>>63);
+	int n=0;
+
+	while (u>=0x80)
+	{
+		p[n++]=(uint8_t)(u | 0x80);
+		u>>=7;
+	}
+	p[n++]=(uint8_t)u;
+	return(n);
+}
+
+// returns the number of bytes used, 0 if the varint runs past end
+static inline int
+tsc_get_varint(const uint8_t* p, const uint8_t* end, int64_t* v)
+{
+	uint64_t u=0;
+	int shift=0;
+	int n=0;
+
+	while (p+n<end && shift<64)
+	{
+		u|=(uint64_t)(p[n] & 0x7f)<<shift;
+		if ((p[n++] & 0x80)==0)
+		{
+			*v=(int64_t)(u>>1) ^ -(int64_t)(u & 1);
+			return(n);
+		}
+		shift+=7;
+	}
+	return(0);
+}
+
+static inline int
+tsc_encoder_init(tsc_encoder_t* enc, int ncols, int maxrows)
+{
+	int i;
+
+	memset(enc, 0, sizeof(tsc_encoder_t));
+	if (ncols<1 || ncols>TSC_MAX_COLS || maxrows<1 || maxrows>0xffff)
+		return(-1);
+	enc->ncols=ncols;
+	enc->maxrows=maxrows;
+	for (i=0; i<ncols+2; i++)
+	{
+		enc->stream[i]=malloc(maxrows*TSC_VARINT_MAX);
+		if (enc->stream[i]==NULL)
+			return(-1);
+	}
+	return(0);
+}
+
+static inline void
+tsc_encoder_free(tsc_encoder_t* enc)
+{
+	int i;
+
+	for (i=0; i<enc->ncols+2; i++)
+		free(enc->stream[i]);
+	memset(enc, 0, sizeof(tsc_encoder_t));
+}
+
+// 1 if a row at time t belongs in a new block, seal the current one first
+static inline int
+tsc_due(const tsc_encoder_t* enc, int64_t t)
+{
+	return(enc->nrows>0 && enc->align>0 && t/enc->align!=enc->first_t/enc->align);
+}
+
+// add a row, returns 1 once the block is full and should be sealed
+static inline int
+tsc_add(tsc_encoder_t* enc, int64_t t, int32_t elapsed, const int* temps)
+{
+	int64_t dt;
+	int64_t de;
+	int i;
+
+	if (enc->nrows==0)
+	{
+		enc->first_t=t;
+		enc->first_elapsed=elapsed;
+		enc->prev_dt=0;
+		enc->prev_de=0;
+		memset(enc->len, 0, sizeof(enc->len));
+		for (i=0; i<enc->ncols; i++)
+		{
+			enc->first[i]=enc->prev[i]=temps[i];
+			enc->min[i]=enc->max[i]=temps[i];
+			enc->sum[i]=0;
+		}
+	}
+	else
+	{
+		dt=t-enc->last_t;
+		de=(int64_t)elapsed-enc->last_elapsed;
+		enc->len[0]+=tsc_put_varint(enc->stream[0]+enc->len[0], dt-enc->prev_dt);
+		enc->len[1]+=tsc_put_varint(enc->stream[1]+enc->len[1], de-enc->prev_de);
+		enc->prev_dt=dt;
+		enc->prev_de=de;
+		for (i=0; i<enc->ncols; i++)
+		{
+			enc->len[i+2]+=tsc_put_varint(enc->stream[i+2]+enc->len[i+2], (int64_t)temps[i]-enc->prev[i]);
+			enc->prev[i]=temps[i];
+			if (temps[i]<enc->min[i])
+				enc->min[i]=temps[i];
+			if (temps[i]>enc->max[i])
+				enc->max[i]=temps[i];
+		}
+	}
+	for (i=0; i<enc->ncols; i++)
+		enc->sum[i]+=temps[i];
+	enc->last_t=t;
+	enc->last_elapsed=elapsed;
+	enc->nrows++;
+	return(enc->nrows>=enc->maxrows);
+}
+
+// bytes tsc_seal() will write for the block being built
+static inline int
+tsc_block_bytes(const tsc_encoder_t* enc)
+{
+	int n=TSC_HEADER+4*enc->ncols;
+	int i;
+
+	for (i=0; i<enc->ncols+2; i++)
+		n+=enc->len[i];
+	return(n);
+}
+
+// the largest block an encoder can produce, for sizing buffers
+static inline int
+tsc_block_max(int ncols, int maxrows)
+{
+	return(TSC_HEADER+4*ncols+(ncols+2)*maxrows*TSC_VARINT_MAX);
+}
+
+// write out the block being built and start a new one, returns its length
+static inline int
+tsc_seal(tsc_encoder_t* enc, uint8_t* out)
+{
+	int n=TSC_HEADER;
+	int i;
+
+	if (enc->nrows==0)
+		return(0);
+	for (i=0; i<enc->ncols; i++, n+=4)
+		tsc_put32(out+n, (uint32_t)enc->first[i]);
+	for (i=0; i<enc->ncols+2; i++)
+	{
+		memcpy(out+n, enc->stream[i], enc->len[i]);
+		n+=enc->len[i];
+	}
+	tsc_put32(out, TSC_MAGIC);
+	out[4]=enc->nrows & 0xff;
+	out[5]=enc->nrows>>8;
+	out[6]=enc->ncols;
+	out[7]=TSC_VERSION;
+	tsc_put32(out+8, n-TSC_HEADER-4*enc->ncols);
+	tsc_put32(out+12, (uint32_t)enc->first_elapsed);
+	tsc_put64(out+16, (uint64_t)enc->first_t);
+	tsc_put64(out+24, (uint64_t)enc->last_t);
+	enc->nrows=0;
+	return(n);
+}
+
+// start of a .tsc.idx file, returns its length
+static inline int
+tsc_index_header(uint8_t* out, int ncols)
+{
+	tsc_put32(out, TSC_INDEX_MAGIC);
+	tsc_put32(out+4, TSC_INDEX_VERSION);
+	tsc_put32(out+8, ncols);
+	tsc_put32(out+12, TSC_INDEX_RECORD(ncols));
+	return(TSC_INDEX_HEADER);
+}
+
+// index record for the block being built, call before tsc_seal(), returns its length
+static inline int
+tsc_index_entry(const tsc_encoder_t* enc, int64_t offset, uint8_t* out)
+{
+	uint8_t* p=out+32;
+	int i;
+
+	tsc_put64(out, (uint64_t)offset);
+	tsc_put64(out+8, (uint64_t)enc->first_t);
+	tsc_put64(out+16, (uint64_t)enc->last_t);
+	tsc_put32(out+24, enc->nrows);
+	tsc_put32(out+28, 0);
+	for (i=0; i<enc->ncols; i++, p+=24)
+	{
+		tsc_put32(p, (uint32_t)enc->min[i]);
+		tsc_put32(p+4, (uint32_t)enc->max[i]);
+		tsc_put32(p+8, (uint32_t)enc->first[i]);
+		tsc_put32(p+12, (uint32_t)enc->prev[i]);
+		tsc_put64(p+16, (uint64_t)enc->sum[i]);
+	}
+	return(TSC_INDEX_RECORD(enc->ncols));
+}
+
+/**********************************************************************************************
+ * function: tsc_block_parse(const uint8_t* p, size_t avail, tsc_block_t* b)
+ * introduction: read the header of the block at p. Only the header is looked
+ * at, so checking a block's time range is cheap.
+ * return value: bytes the whole block takes, 0 if p holds no complete block
+ **********************************************************************************************/
+static inline size_t
+tsc_block_parse(const uint8_t* p, size_t avail, tsc_block_t* b)
+{
+	size_t n;
+
+	if (avail<TSC_HEADER || tsc_get32(p)!=TSC_MAGIC || p[7]!=TSC_VERSION)
+		return(0);
+	b->nrows=p[4] | (p[5]<<8);
+	b->ncols=p[6];
+	b->size=tsc_get32(p+8);
+	b->first_elapsed=(int32_t)tsc_get32(p+12);
+	b->first_t=(int64_t)tsc_get64(p+16);
+	b->last_t=(int64_t)tsc_get64(p+24);
+	b->first=p+TSC_HEADER;
+	b->payload=b->first+4*b->ncols;
+	n=TSC_HEADER+4*b->ncols+b->size;
+	if (b->nrows<1 || b->ncols<1 || b->ncols>TSC_MAX_COLS || n>avail)
+		return(0);
+	return(n);
+}
+
+/**********************************************************************************************
+ * function: tsc_block_decode(const tsc_block_t* b, int64_t* t, int32_t* elapsed, int32_t* temps)
+ * introduction: decode every row of a block. t and elapsed get nrows values,
+ * temps gets nrows*ncols values, row by row.
+ * return value: nrows, or -1 if the payload is corrupt
+ **********************************************************************************************/
+static inline int
+tsc_block_decode(const tsc_block_t* b, int64_t* t, int32_t* elapsed, int32_t* temps)
+{
+	const uint8_t* p=b->payload;
+	const uint8_t* end=b->payload+b->size;
+	int64_t v;
+	int64_t d;
+	int64_t x;
+	int n;
+	int r;
+	int c;
+
+	// time
+	t[0]=b->first_t;
+	for (r=1, d=0; r<b->nrows; r++, p+=n)
+	{
+		if ((n=tsc_get_varint(p, end, &v))==0)
+			return(-1);
+		d+=v;
+		t[r]=t[r-1]+d;
+	}
+	// elapsed
+	elapsed[0]=b->first_elapsed;
+	for (r=1, d=0; r<b->nrows; r++, p+=n)
+	{
+		if ((n=tsc_get_varint(p, end, &v))==0)
+			return(-1);
+		d+=v;
+		elapsed[r]=(int32_t)(elapsed[r-1]+d);
+	}
+	// temperatures
+	for (c=0; c<b->ncols; c++)
+	{
+		x=(int32_t)tsc_get32(b->first+4*c);
+		temps[c]=(int32_t)x;
+		for (r=1; r<b->nrows; r++, p+=n)
+		{
+			if ((n=tsc_get_varint(p, end, &v))==0)
+				return(-1);
+			x+=v;
+			temps[r*b->ncols+c]=(int32_t)x;
+		}
+	}
+	return(b->nrows);
+}
+
+#endif
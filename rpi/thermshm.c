@@ -0,0 +1,88 @@
+/**********************************************************************************************
+ * thermshm.c
+ * Example reader for the shared memory published by 'therm --shm'.
+ * It never talks to the hardware, so it needs no sudo and returns at once.
+ *
+ * Syntax:
+ * ./thermshm                 latest sample, same output as 'therm withtime'
+ * ./thermshm -n 10           the last 10 logged rows as time,elapsed,temperature...
+ * ./thermshm -s /name ...    read another segment than /therm (therm --shm=/name)
+ *
+ * Exit status is 1 if no logger is publishing.
+ *
+ * Build with:
+ * gcc -o thermshm thermshm.c -lrt
+ ************************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "therm_shm.h"
+
+void
+print_temp(int t10, const char* sep)
+{
+	printf("%s%s%d.%d", sep, t10<0 ? "-" : "", abs(t10)/10, abs(t10)%10);
+}
+
+int
+main(int argc, char* argv[])
+{
+	therm_shm_t* shm;
+	therm_shm_slot_t slot;
+	therm_shm_slot_t* rows;
+	const char* name=THERM_SHM_NAME;
+	char tstring[16];
+	time_t t;
+	int n=0;
+	int got;
+	int i;
+	int j;
+
+	for (i=1; i<argc-1; i++)
+	{
+		if (strcmp(argv[i], "-n")==0)
+			n=atoi(argv[++i]);
+		else if (strcmp(argv[i], "-s")==0)
+			name=argv[++i];
+	}
+
+	shm=therm_shm_open(name);
+	if (shm==NULL || shm->pid==0)
+	{
+		fprintf(stderr, "therm is not publishing %s\n", name);
+		exit(1);
+	}
+
+	if (n<=0)
+	{
+		if (!therm_shm_latest(shm, &slot))
+		{
+			fprintf(stderr, "no sample yet\n");
+			exit(1);
+		}
+		t=slot.t;
+		strftime(tstring, sizeof(tstring), "%H:%M:%S", localtime(&t));
+		printf("%s", tstring);
+		for (j=0; j<slot.nboards; j++)
+			print_temp(slot.temp10[j], " ");
+		printf("\n");
+	}
+	else
+	{
+		rows=malloc(n*sizeof(therm_shm_slot_t));
+		if (rows==NULL)
+			exit(1);
+		got=therm_shm_recent(shm, rows, n);
+		for (i=0; i<got; i++)
+		{
+			printf("%lld,%d", (long long)rows[i].t, rows[i].elapsed);
+			for (j=0; j<rows[i].nboards; j++)
+				print_temp(rows[i].temp10[j], ",");
+			printf("\n");
+		}
+		free(rows);
+	}
+	therm_shm_close(shm);
+	return(0);
+}
@@ -0,0 +1,92 @@
+// Reader for the shared memory published by 'therm --shm', see therm_shm.h
+// for the layout. Plain Node has no mmap, so this reads /dev/shm/therm with
+// pread; that is still a couple of system calls per sample instead of a sudo
+// process spawn and an SPI transaction.
+
+var fs = require('fs');
+
+var MAGIC = 0x4d524854;
+var VERSION = 1;
+var SLOT_SIZE = 64;
+var LATEST_OFFSET = 32;
+var RING_OFFSET = 96;
+
+function alloc(n)
+{
+	return Buffer.alloc ? Buffer.alloc(n) : new Buffer(n);
+}
+
+function u64(buf, off)
+{
+	return buf.readUInt32LE(off) + buf.readUInt32LE(off+4)*4294967296;
+}
+
+function ThermShm(name)
+{
+	var hdr = alloc(32);
+	this.fd = fs.openSync('/dev/shm/'+(name || '/therm').replace(/^\//, ''), 'r');
+	fs.readSync(this.fd, hdr, 0, 32, 0);
+	if (hdr.readUInt32LE(0)!=MAGIC || hdr.readUInt32LE(4)!=VERSION || hdr.readUInt32LE(12)!=SLOT_SIZE)
+	{
+		fs.closeSync(this.fd);
+		throw new Error('not a therm shared memory segment');
+	}
+	this.ringSize = hdr.readUInt32LE(8);
+	this.slot = alloc(SLOT_SIZE);
+	this.seq = alloc(4);
+	this.hdr = hdr;
+}
+
+ThermShm.prototype.close = function()
+{
+	fs.closeSync(this.fd);
+};
+
+ThermShm.prototype.running = function()
+{
+	fs.readSync(this.fd, this.hdr, 0, 32, 0);
+	return this.hdr.readUInt32LE(16)!=0;
+};
+
+// seqlock read, retry while the logger is writing the slot
+ThermShm.prototype.readSlot = function(offset)
+{
+	var s = this.slot;
+	var seq, i, n, temps;
+	do
+	{
+		fs.readSync(this.fd, s, 0, SLOT_SIZE, offset);
+		seq = s.readUInt32LE(0);
+		fs.readSync(this.fd, this.seq, 0, 4, offset);
+	} while ((seq & 1) || this.seq.readUInt32LE(0)!=seq);
+	n = s.readInt32LE(28);
+	temps = [];
+	for (i=0; i<n; i++)
+		temps.push(s.readInt32LE(32+4*i)/10);
+	return {index: u64(s, 8), t: u64(s, 16), elapsed: s.readInt32LE(24), temps: temps};
+};
+
+// latest sample (updated every tick), null before the first one
+ThermShm.prototype.latest = function()
+{
+	var v = this.readSlot(LATEST_OFFSET);
+	return v.t ? v : null;
+};
+
+// up to n of the most recent logged rows, oldest first
+ThermShm.prototype.recent = function(n)
+{
+	var head, i, v, rows = [];
+	fs.readSync(this.fd, this.hdr, 0, 32, 0);
+	head = u64(this.hdr, 24);
+	n = Math.min(n, this.ringSize);
+	for (i=Math.max(head-n, 0); i<head; i++)
+	{
+		v = this.readSlot(RING_OFFSET+(i%this.ringSize)*SLOT_SIZE);
+		if (v.index==i) // skip slots overwritten while reading
+			rows.push(v);
+	}
+	return rows;
+};
+
+module.exports = ThermShm;